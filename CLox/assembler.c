@@ -0,0 +1,447 @@
+#include "common.h"
+
+#ifdef JIT_AVAILABLE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "assembler.h"
+#include "object.h"
+#include "vm.h"
+
+void* GrowBuffer(void* buffer, size_t size)
+{
+	void* result = realloc(buffer, size);
+	if (result == NULL)
+	{
+		exit(1);
+	}
+
+	return result;
+}
+
+void Byte(Assembler* as, uint8_t byte)
+{
+	if (as->capacity < as->count + 1)
+	{
+		as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+		as->code = (uint8_t*)GrowBuffer(as->code, as->capacity);
+	}
+
+	as->code[as->count++] = byte;
+}
+
+void Int32(Assembler* as, int32_t value)
+{
+	for (int idx = 0; idx < 4; idx++)
+	{
+		Byte(as, (uint8_t)(value >> (idx * 8)));
+	}
+}
+
+void Int64(Assembler* as, uint64_t value)
+{
+	for (int idx = 0; idx < 8; idx++)
+	{
+		Byte(as, (uint8_t)(value >> (idx * 8)));
+	}
+}
+
+void Rex(Assembler* as, bool wide, int reg, int base)
+{
+	uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((base & 8) ? 0x01 : 0);
+	if (rex != 0x40)
+	{
+		Byte(as, rex);
+	}
+}
+
+void Direct(Assembler* as, int reg, int rm)
+{
+	Byte(as, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+//[base + disp32], RSP and R12 can only be used as a base through a SIB byte
+void Memory(Assembler* as, int reg, Register base, int32_t disp)
+{
+	Byte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == RSP)
+	{
+		Byte(as, 0x24);
+	}
+
+	Int32(as, disp);
+}
+
+void MovImm(Assembler* as, Register dst, uint64_t imm)
+{
+	Rex(as, true, 0, dst);
+	Byte(as, 0xB8 + (dst & 7));
+	Int64(as, imm);
+}
+
+static void NoteReloc(Assembler* as, bool boxed)
+{
+	if (as->relocCapacity < as->relocCount + 1)
+	{
+		as->relocCapacity = as->relocCapacity < 8 ? 8 : as->relocCapacity * 2;
+		as->relocs = (Reloc*)GrowBuffer(as->relocs, sizeof(Reloc) * as->relocCapacity);
+	}
+
+	as->relocs[as->relocCount].offset = as->count - (int)sizeof(uint64_t);
+	as->relocs[as->relocCount].boxed = boxed;
+	as->relocCount++;
+}
+
+void MovValue(Assembler* as, Register dst, Value value)
+{
+	MovImm(as, dst, value);
+	if (IS_OBJ(value))
+	{
+		NoteReloc(as, true);
+	}
+}
+
+void MovObject(Assembler* as, Register dst, Obj* object)
+{
+	MovImm(as, dst, (uint64_t)(uintptr_t)object);
+	NoteReloc(as, false);
+}
+
+void Load(Assembler* as, Register dst, Register base, int32_t disp)
+{
+	Rex(as, true, dst, base);
+	Byte(as, 0x8B);
+	Memory(as, dst, base, disp);
+}
+
+void Store(Assembler* as, Register base, int32_t disp, Register src)
+{
+	Rex(as, true, src, base);
+	Byte(as, 0x89);
+	Memory(as, src, base, disp);
+}
+
+void Load32(Assembler* as, Register dst, Register base, int32_t disp)
+{
+	Rex(as, false, dst, base);
+	Byte(as, 0x8B);
+	Memory(as, dst, base, disp);
+}
+
+//movsxd
+void LoadSigned32(Assembler* as, Register dst, Register base, int32_t disp)
+{
+	Rex(as, true, dst, base);
+	Byte(as, 0x63);
+	Memory(as, dst, base, disp);
+}
+
+//movzx
+void LoadByte(Assembler* as, Register dst, Register base, int32_t disp)
+{
+	Rex(as, false, dst, base);
+	Byte(as, 0x0F);
+	Byte(as, 0xB6);
+	Memory(as, dst, base, disp);
+}
+
+void Store32(Assembler* as, Register base, int32_t disp, Register src)
+{
+	Rex(as, false, src, base);
+	Byte(as, 0x89);
+	Memory(as, src, base, disp);
+}
+
+void Move(Assembler* as, Register dst, Register src)
+{
+	Rex(as, true, src, dst);
+	Byte(as, 0x89);
+	Direct(as, src, dst);
+}
+
+void AddImm(Assembler* as, Register reg, int32_t imm)
+{
+	Rex(as, true, 0, reg);
+	Byte(as, 0x81);
+	Direct(as, imm < 0 ? 5 : 0, reg);
+	Int32(as, imm < 0 ? -imm : imm);
+}
+
+void Add(Assembler* as, Register dst, Register src)
+{
+	Rex(as, true, src, dst);
+	Byte(as, 0x01);
+	Direct(as, src, dst);
+}
+
+void Sub(Assembler* as, Register dst, Register src)
+{
+	Rex(as, true, src, dst);
+	Byte(as, 0x29);
+	Direct(as, src, dst);
+}
+
+void ShiftLeft(Assembler* as, Register reg, uint8_t count)
+{
+	Rex(as, true, 0, reg);
+	Byte(as, 0xC1);
+	Direct(as, 4, reg);
+	Byte(as, count);
+}
+
+void And(Assembler* as, Register dst, Register src)
+{
+	Rex(as, true, src, dst);
+	Byte(as, 0x21);
+	Direct(as, src, dst);
+}
+
+void Xor(Assembler* as, Register dst, Register src)
+{
+	Rex(as, true, src, dst);
+	Byte(as, 0x31);
+	Direct(as, src, dst);
+}
+
+//Sets flags from a - b
+void Cmp(Assembler* as, Register a, Register b)
+{
+	Rex(as, true, b, a);
+	Byte(as, 0x39);
+	Direct(as, b, a);
+}
+
+//Sets flags from a & b
+void Test(Assembler* as, Register a, Register b)
+{
+	Rex(as, true, b, a);
+	Byte(as, 0x85);
+	Direct(as, b, a);
+}
+
+void Cmov(Assembler* as, Condition cc, Register dst, Register src)
+{
+	Rex(as, true, dst, src);
+	Byte(as, 0x0F);
+	Byte(as, 0x40 | cc);
+	Direct(as, dst, src);
+}
+
+void MovqToXmm(Assembler* as, XmmRegister dst, Register src)
+{
+	Byte(as, 0x66);
+	Rex(as, true, dst, src);
+	Byte(as, 0x0F);
+	Byte(as, 0x6E);
+	Direct(as, dst, src);
+}
+
+void MovqFromXmm(Assembler* as, Register dst, XmmRegister src)
+{
+	Byte(as, 0x66);
+	Rex(as, true, src, dst);
+	Byte(as, 0x0F);
+	Byte(as, 0x7E);
+	Direct(as, src, dst);
+}
+
+//movq xmm, [base + disp]
+void LoadXmm(Assembler* as, XmmRegister dst, Register base, int32_t disp)
+{
+	Byte(as, 0xF3);
+	Rex(as, false, dst, base);
+	Byte(as, 0x0F);
+	Byte(as, 0x7E);
+	Memory(as, dst, base, disp);
+}
+
+//movq [base + disp], xmm
+void StoreXmm(Assembler* as, Register base, int32_t disp, XmmRegister src)
+{
+	Byte(as, 0x66);
+	Rex(as, false, src, base);
+	Byte(as, 0x0F);
+	Byte(as, 0xD6);
+	Memory(as, src, base, disp);
+}
+
+void MoveXmm(Assembler* as, XmmRegister dst, XmmRegister src)
+{
+	if (dst == src)
+	{
+		return;
+	}
+
+	Byte(as, 0x66);
+	Rex(as, false, dst, src);
+	Byte(as, 0x0F);
+	Byte(as, 0x28);
+	Direct(as, dst, src);
+}
+
+void Sse(Assembler* as, SseOp op, XmmRegister dst, XmmRegister src)
+{
+	Byte(as, 0xF2);
+	Rex(as, false, dst, src);
+	Byte(as, 0x0F);
+	Byte(as, op);
+	Direct(as, dst, src);
+}
+
+//Converts the signed 32 bit integer in src's low half, which is how an integer Value keeps it
+void Cvtsi2sd(Assembler* as, XmmRegister dst, Register src)
+{
+	Byte(as, 0xF2);
+	Rex(as, false, dst, src);
+	Byte(as, 0x0F);
+	Byte(as, 0x2A);
+	Direct(as, dst, src);
+}
+
+//Compares a with b, unordered (NaN) sets every flag so only "below or equal" style conditions see it
+void Ucomisd(Assembler* as, XmmRegister a, XmmRegister b)
+{
+	Byte(as, 0x66);
+	Rex(as, false, a, b);
+	Byte(as, 0x0F);
+	Byte(as, 0x2E);
+	Direct(as, a, b);
+}
+
+void PushReg(Assembler* as, Register reg)
+{
+	Rex(as, false, 0, reg);
+	Byte(as, 0x50 + (reg & 7));
+}
+
+void PopReg(Assembler* as, Register reg)
+{
+	Rex(as, false, 0, reg);
+	Byte(as, 0x58 + (reg & 7));
+}
+
+void CallReg(Assembler* as, Register reg)
+{
+	Rex(as, false, 0, reg);
+	Byte(as, 0xFF);
+	Direct(as, 2, reg);
+}
+
+void JumpReg(Assembler* as, Register reg)
+{
+	Rex(as, false, 0, reg);
+	Byte(as, 0xFF);
+	Direct(as, 4, reg);
+}
+
+//Emits a jump with a zero displacement and returns where to patch it
+int JumpForward(Assembler* as, Condition cc)
+{
+	if (cc == CC_ALWAYS)
+	{
+		Byte(as, 0xE9);
+	}
+	else
+	{
+		Byte(as, 0x0F);
+		Byte(as, 0x80 | cc);
+	}
+
+	Int32(as, 0);
+	return as->count - 4;
+}
+
+void PatchJump(Assembler* as, int patch, int destination)
+{
+	int32_t rel = destination - (patch + 4);
+	memcpy(as->code + patch, &rel, sizeof(rel));
+}
+
+void PatchHere(Assembler* as, int patch)
+{
+	PatchJump(as, patch, as->count);
+}
+
+//Jumps to a target the compiler resolves once everything has been emitted, see Fixup
+void JumpTo(Assembler* as, Condition cc, int target)
+{
+	int patch = JumpForward(as, cc);
+	if (as->fixupCapacity < as->fixupCount + 1)
+	{
+		as->fixupCapacity = as->fixupCapacity < 16 ? 16 : as->fixupCapacity * 2;
+		as->fixups = (Fixup*)GrowBuffer(as->fixups, sizeof(Fixup) * as->fixupCapacity);
+	}
+
+	as->fixups[as->fixupCount].patch = patch;
+	as->fixups[as->fixupCount].target = target;
+	as->fixupCount++;
+}
+
+void Prologue(Assembler* as)
+{
+	PushReg(as, RBX);
+	PushReg(as, R12);
+	PushReg(as, R13);
+	PushReg(as, R14);
+	PushReg(as, R15);
+	Move(as, FRAME, RDI);
+	Load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+	MovImm(as, STACK_TOP_ADDRESS, (uint64_t)(uintptr_t)&vm.stackTop);
+	Load(as, STACK_TOP, STACK_TOP_ADDRESS, 0);
+	MovImm(as, NAN_MASK, QNAN);
+}
+
+void Epilogue(Assembler* as)
+{
+	PopReg(as, R15);
+	PopReg(as, R14);
+	PopReg(as, R13);
+	PopReg(as, R12);
+	PopReg(as, RBX);
+	Byte(as, 0xC3);
+}
+
+uint8_t* MakeExecutable(Assembler* as)
+{
+	//Write the code while the pages are writable, then flip them to executable
+	void* memory = mmap(NULL, as->count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory != MAP_FAILED)
+	{
+		memcpy(memory, as->code, as->count);
+		mprotect(memory, as->count, PROT_READ | PROT_EXEC);
+	}
+
+	free(as->code);
+	as->code = NULL;
+	return memory == MAP_FAILED ? NULL : (uint8_t*)memory;
+}
+
+void FreeExecutable(uint8_t* code, size_t size)
+{
+	munmap(code, size);
+}
+
+void RelocateCode(uint8_t* code, size_t size, Reloc* relocs, int relocCount)
+{
+	if (relocCount == 0)
+	{
+		return;
+	}
+
+	mprotect(code, size, PROT_READ | PROT_WRITE);
+	for (int idx = 0; idx < relocCount; idx++)
+	{
+		uint64_t imm;
+		memcpy(&imm, code + relocs[idx].offset, sizeof(imm));
+		Obj* object = relocs[idx].boxed ? AS_OBJ(imm) : (Obj*)(uintptr_t)imm;
+		if (object->isForwarded)
+		{
+			imm = relocs[idx].boxed ? OBJ_VAL(object->next) : (uint64_t)(uintptr_t)object->next;
+			memcpy(code + relocs[idx].offset, &imm, sizeof(imm));
+		}
+	}
+	mprotect(code, size, PROT_READ | PROT_EXEC);
+}
+
+#endif //JIT_AVAILABLE
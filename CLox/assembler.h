@@ -0,0 +1,140 @@
+#ifndef clox_assembler_h
+#define clox_assembler_h
+
+#include "common.h"
+
+#ifdef JIT_AVAILABLE
+#include "value.h"
+
+typedef enum
+{
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+} Register;
+
+typedef enum
+{
+	XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7,
+	XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14, XMM15
+} XmmRegister;
+
+//Flipping the low bit of a condition gives its inverse
+typedef enum
+{
+	CC_ALWAYS = -1,
+	CC_B = 0x2,
+	CC_AE = 0x3,
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_BE = 0x6,
+	CC_A = 0x7,
+	CC_S = 0x8,
+	CC_NS = 0x9,
+	CC_P = 0xA,
+	CC_NP = 0xB
+} Condition;
+
+typedef enum
+{
+	SSE_ADD = 0x58,
+	SSE_MULTIPLY = 0x59,
+	SSE_SUBTRACT = 0x5C,
+	SSE_DIVIDE = 0x5E
+} SseOp;
+
+//Native code keeps these live the whole time it runs. They're all callee saved, so the C helpers leave them alone
+#define FRAME				RBX
+#define SLOTS				R12
+#define STACK_TOP_ADDRESS	R13
+#define STACK_TOP			R14
+#define NAN_MASK			R15
+
+typedef struct
+{
+	int patch;
+	int target; //Whatever the compiler resolves it against, the baseline JIT uses bytecode offsets
+} Fixup;
+
+//An object's address built into the code, patched if a compaction moves the object, see RelocateCode
+typedef struct Reloc
+{
+	int offset; //Of the immediate
+	bool boxed; //A Value rather than a bare pointer
+} Reloc;
+
+typedef struct
+{
+	uint8_t* code;
+	int count;
+	int capacity;
+	uint32_t* offsets;
+	Fixup* fixups;
+	int fixupCount;
+	int fixupCapacity;
+	Reloc* relocs; //Handed to whatever keeps the finished code
+	int relocCount;
+	int relocCapacity;
+} Assembler;
+
+void* GrowBuffer(void* buffer, size_t size);
+
+void Byte(Assembler* as, uint8_t byte);
+void Int32(Assembler* as, int32_t value);
+void Int64(Assembler* as, uint64_t value);
+void Rex(Assembler* as, bool wide, int reg, int base);
+void Direct(Assembler* as, int reg, int rm);
+void Memory(Assembler* as, int reg, Register base, int32_t disp);
+
+void MovImm(Assembler* as, Register dst, uint64_t imm);
+//MovImm for anything that can be an object, which notes the immediate in as->relocs
+void MovValue(Assembler* as, Register dst, Value value);
+void MovObject(Assembler* as, Register dst, Obj* object);
+void Load(Assembler* as, Register dst, Register base, int32_t disp);
+void Store(Assembler* as, Register base, int32_t disp, Register src);
+//The int and bool fields, zero extended into the whole register except for LoadSigned32
+void Load32(Assembler* as, Register dst, Register base, int32_t disp);
+void LoadSigned32(Assembler* as, Register dst, Register base, int32_t disp);
+void LoadByte(Assembler* as, Register dst, Register base, int32_t disp);
+void Store32(Assembler* as, Register base, int32_t disp, Register src);
+void Move(Assembler* as, Register dst, Register src);
+void AddImm(Assembler* as, Register reg, int32_t imm);
+void Add(Assembler* as, Register dst, Register src);
+void Sub(Assembler* as, Register dst, Register src);
+void ShiftLeft(Assembler* as, Register reg, uint8_t count);
+void And(Assembler* as, Register dst, Register src);
+void Xor(Assembler* as, Register dst, Register src);
+void Cmp(Assembler* as, Register a, Register b);
+void Test(Assembler* as, Register a, Register b);
+void Cmov(Assembler* as, Condition cc, Register dst, Register src);
+
+void MovqToXmm(Assembler* as, XmmRegister dst, Register src);
+void MovqFromXmm(Assembler* as, Register dst, XmmRegister src);
+void LoadXmm(Assembler* as, XmmRegister dst, Register base, int32_t disp);
+void StoreXmm(Assembler* as, Register base, int32_t disp, XmmRegister src);
+void MoveXmm(Assembler* as, XmmRegister dst, XmmRegister src);
+void Sse(Assembler* as, SseOp op, XmmRegister dst, XmmRegister src);
+void Cvtsi2sd(Assembler* as, XmmRegister dst, Register src);
+void Ucomisd(Assembler* as, XmmRegister a, XmmRegister b);
+
+void PushReg(Assembler* as, Register reg);
+void PopReg(Assembler* as, Register reg);
+void CallReg(Assembler* as, Register reg);
+void JumpReg(Assembler* as, Register reg);
+int JumpForward(Assembler* as, Condition cc);
+void PatchJump(Assembler* as, int patch, int destination);
+void PatchHere(Assembler* as, int patch);
+void JumpTo(Assembler* as, Condition cc, int target);
+
+//Entered as a C function taking the CallFrame, saves the callee saved registers and loads the ones above
+void Prologue(Assembler* as);
+void Epilogue(Assembler* as);
+
+//Copies the finished code into executable memory and frees the assembler's buffer, NULL if the memory couldn't be mapped
+uint8_t* MakeExecutable(Assembler* as);
+void FreeExecutable(uint8_t* code, size_t size);
+//Points every noted immediate whose object has moved at its new address, the code is only writable meanwhile
+void RelocateCode(uint8_t* code, size_t size, Reloc* relocs, int relocCount);
+
+#endif //JIT_AVAILABLE
+
+#endif
@@ -41,6 +41,9 @@ void InitChunk(Chunk* chunk)
 	chunk->code = NULL;
 	InitLinesArray(&chunk->lines);
 	InitValueArray(&chunk->constants);
+	chunk->cacheCount = 0;
+	chunk->cacheCapacity = 0;
+	chunk->caches = NULL;
 }
 
 void FreeChunk(Chunk* chunk)
@@ -48,6 +51,7 @@ void FreeChunk(Chunk* chunk)
 	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
 	FREE_ARRAY(int, chunk->lines.lines, chunk->lines.capacity);
 	FreeValueArray(&chunk->constants);
+	FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
 	InitChunk(chunk);
 }
 
@@ -73,12 +77,47 @@ int AddConstant(Chunk* chunk, Value value)
 	return chunk->constants.count - 1;
 }
 
+int AddInlineCache(Chunk* chunk)
+{
+	if (chunk->cacheCapacity < chunk->cacheCount + 1)
+	{
+		int oldCapacity = chunk->cacheCapacity;
+		chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+	}
+
+	InlineCache* cache = &chunk->caches[chunk->cacheCount];
+	cache->count = 0;
+	cache->epoch = 0;
+	return chunk->cacheCount++;
+}
+
 void WriteConstant(Chunk* chunk, Value value, int line)
 {
 	WriteChunk(chunk, OP_CONSTANT, line);
 	WriteChunk(chunk, AddConstant(chunk, value), line);
 }
 
+//Drops every instruction from count on, along with their line runs
+void TruncateChunk(Chunk* chunk, int count)
+{
+	int excess = chunk->count - count;
+	while (excess > 0)
+	{
+		int* run = &chunk->lines.lines[chunk->lines.count - 2];
+		if (*run > excess)
+		{
+			*run -= excess;
+			break;
+		}
+
+		excess -= *run;
+		chunk->lines.count -= 2;
+	}
+
+	chunk->count = count;
+}
+
 int GetLine(Chunk* chunk, int instructionIdx)
 {
 	int idx = 0;
@@ -97,4 +136,203 @@ int GetLine(Chunk* chunk, int instructionIdx)
 	}
 
 	return chunk->lines.lines[idx + 1];
+}
+
+int InstructionLength(Chunk* chunk, int offset)
+{
+	switch (chunk->code[offset])
+	{
+	case OP_POPN:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_SET_LOCAL_POP:
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+	case OP_GET_SUPER:
+	case OP_CONSTANT:
+	case OP_ADD_CONSTANT:
+	case OP_SUBTRACT_CONSTANT:
+	case OP_LESS_CONSTANT:
+	case OP_CALL:
+	case OP_TAIL_CALL:
+	case OP_CLASS:
+	case OP_METHOD:
+	case OP_BUILD_STRING:
+		return 2;
+	case OP_GET_GLOBAL:
+	case OP_DEFINE_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_ADD_LOCALS:
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_JUMP_IF_FALSE_POP:
+	case OP_LOOP:
+	case OP_TRACE_LOOP:
+	case OP_COPY_LOCAL:
+	case OP_STORE_CONSTANT:
+		return 3;
+	case OP_GET_PROPERTY:
+	case OP_GET_FIELD:
+	case OP_GET_METHOD:
+	case OP_SET_PROPERTY:
+	case OP_ADD_LL:
+	case OP_ADD_LK:
+	case OP_SUBTRACT_LL:
+	case OP_SUBTRACT_LK:
+	case OP_MULTIPLY_LL:
+	case OP_MULTIPLY_LK:
+	case OP_DIVIDE_LL:
+	case OP_DIVIDE_LK:
+		return 4;
+	case OP_INVOKE:
+	case OP_SUPER_INVOKE:
+	case OP_TAIL_INVOKE:
+	case OP_TAIL_SUPER_INVOKE:
+	case OP_JUMP_IF_NOT_LESS_LL:
+	case OP_JUMP_IF_NOT_LESS_LK:
+	case OP_JUMP_IF_NOT_GREATER_LL:
+	case OP_JUMP_IF_NOT_GREATER_LK:
+		return 5;
+	case OP_CLOSURE:
+	{
+		ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+		return 2 + function->upvalueCount * 2;
+	}
+	default:
+		return 1;
+	}
+}
+
+static int StackEffect(Chunk* chunk, int offset)
+{
+	uint8_t* code = &chunk->code[offset];
+	switch (code[0])
+	{
+	case OP_CONSTANT:
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_GET_LOCAL:
+	case OP_GET_LOCAL_0:
+	case OP_GET_LOCAL_1:
+	case OP_GET_LOCAL_2:
+	case OP_GET_LOCAL_3:
+	case OP_ADD_LOCALS:
+	case OP_GET_GLOBAL:
+	case OP_GET_UPVALUE:
+	case OP_CLOSURE:
+	case OP_CLASS:
+		return 1;
+	case OP_POP:
+	case OP_DEFINE_GLOBAL:
+	case OP_SET_LOCAL_POP:
+	case OP_JUMP_IF_FALSE_POP:
+	case OP_CLOSE_UPVAL:
+	case OP_SET_PROPERTY:
+	case OP_GET_SUPER:
+	case OP_EQUAL:
+	case OP_NOT_EQUAL:
+	case OP_GREATER:
+	case OP_GREATER_EQUAL:
+	case OP_LESS:
+	case OP_LESS_EQUAL:
+	case OP_ADD:
+	case OP_ADD_NUMBER:
+	case OP_ADD_STRING:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_PRINT:
+	case OP_INHERIT:
+	case OP_METHOD:
+	case OP_RETURN:
+		return -1;
+	case OP_POPN:
+	case OP_CALL:
+	case OP_TAIL_CALL:
+		return -code[1];
+	case OP_INVOKE:
+	case OP_TAIL_INVOKE:
+		return -code[2];
+	case OP_SUPER_INVOKE:
+	case OP_TAIL_SUPER_INVOKE:
+		return -code[2] - 1;
+	case OP_BUILD_STRING:
+		return 1 - code[1];
+	default:
+		return 0;
+	}
+}
+
+//Slots a handler pushes past its own net effect before it settles. Every instruction that does has to be listed here,
+//build with DEBUG_CHECK_STACK to catch one that isn't
+static int TransientSlots(uint8_t instruction)
+{
+	switch (instruction)
+	{
+	case OP_ADD_LL:
+	case OP_ADD_LK:
+		return 2; //Both operands are pushed when Add has to concatenate
+	case OP_ADD_LOCALS: //Both locals are pushed when Add has to concatenate, one past the sum it leaves
+	case OP_ADD_CONSTANT:
+	case OP_SUBTRACT_CONSTANT:
+	case OP_LESS_CONSTANT: //The constant is pushed for the binary handler to pop
+	case OP_SET_PROPERTY: //Adding a field pushes the new shape while it's linked in
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int JumpTarget(Chunk* chunk, int offset)
+{
+	uint8_t* code = &chunk->code[offset];
+	switch (code[0])
+	{
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_JUMP_IF_FALSE_POP:
+		return offset + 3 + ((code[1] << 8) | code[2]);
+	case OP_JUMP_IF_NOT_LESS_LL:
+	case OP_JUMP_IF_NOT_LESS_LK:
+	case OP_JUMP_IF_NOT_GREATER_LL:
+	case OP_JUMP_IF_NOT_GREATER_LK:
+		return offset + 5 + ((code[3] << 8) | code[4]);
+	default:
+		return -1;
+	}
+}
+
+//Walks the finished chunk once. Jumps only go forward (loops jump back to code already walked), so the depth at a
+//jump target is known before it's reached and the code after a jump or return picks up from there
+int MaxStackDepth(Chunk* chunk, int arity)
+{
+	int* targetDepths = ALLOCATE(int, chunk->count);
+	for (int i = 0; i < chunk->count; i++)
+	{
+		targetDepths[i] = -1;
+	}
+
+	int depth = arity + 1; //The callee and its arguments
+	int maxDepth = depth;
+	for (int offset = 0; offset < chunk->count; offset += InstructionLength(chunk, offset))
+	{
+		if (targetDepths[offset] > depth) { depth = targetDepths[offset]; }
+
+		int before = depth;
+		depth += StackEffect(chunk, offset);
+		if (depth < 0) { depth = 0; } //Only unreachable code pops more than it pushed
+
+		int peak = (depth > before ? depth : before) + TransientSlots(chunk->code[offset]);
+		if (peak > maxDepth) { maxDepth = peak; }
+
+		int target = JumpTarget(chunk, offset);
+		if (target >= 0 && target < chunk->count && depth > targetDepths[target])
+		{
+			targetDepths[target] = depth;
+		}
+	}
+
+	FREE_ARRAY(int, targetDepths, chunk->count);
+	return maxDepth;
 }
\ No newline at end of file
@@ -36,14 +36,58 @@ typedef enum
 	OP_JUMP_IF_FALSE,
 	OP_LOOP,
 	OP_CALL,
+	OP_TAIL_CALL,
 	OP_INVOKE,
 	OP_SUPER_INVOKE,
+	OP_TAIL_INVOKE,
+	OP_TAIL_SUPER_INVOKE,
 	OP_CLOSURE,
 	OP_CLOSE_UPVAL,
 	OP_RETURN,
 	OP_CLASS,
 	OP_INHERIT,
-	OP_METHOD
+	OP_METHOD,
+	OP_BUILD_STRING,
+
+	//Superinstructions, only ever produced by the peephole pass
+	OP_GET_LOCAL_0,
+	OP_GET_LOCAL_1,
+	OP_GET_LOCAL_2,
+	OP_GET_LOCAL_3,
+	OP_SET_LOCAL_POP,
+	OP_ADD_LOCALS,
+	OP_ADD_CONSTANT,
+	OP_SUBTRACT_CONSTANT,
+	OP_LESS_CONSTANT,
+	OP_NOT_EQUAL,
+	OP_GREATER_EQUAL,
+	OP_LESS_EQUAL,
+	OP_JUMP_IF_FALSE_POP,
+
+	//Slot-form superinstructions for whole statements, operands name local slots (L) or constants (K) directly
+	OP_COPY_LOCAL,
+	OP_STORE_CONSTANT,
+	OP_ADD_LL,
+	OP_ADD_LK,
+	OP_SUBTRACT_LL,
+	OP_SUBTRACT_LK,
+	OP_MULTIPLY_LL,
+	OP_MULTIPLY_LK,
+	OP_DIVIDE_LL,
+	OP_DIVIDE_LK,
+	OP_JUMP_IF_NOT_LESS_LL,
+	OP_JUMP_IF_NOT_LESS_LK,
+	OP_JUMP_IF_NOT_GREATER_LL,
+	OP_JUMP_IF_NOT_GREATER_LK,
+
+	//Quickened forms, written over the generic instruction once it has seen one kind of operand and back on a miss
+	OP_ADD_NUMBER,
+	OP_ADD_STRING,
+	OP_GET_FIELD,
+	OP_GET_METHOD,
+
+	//Written over an OP_LOOP once the tracing JIT has compiled the loop it closes
+	OP_TRACE_LOOP
 } OpCode;
 
 typedef struct
@@ -53,6 +97,24 @@ typedef struct
 	int* lines;
 } Lines;
 
+#define INLINE_CACHE_ENTRIES 4
+
+//One resolved lookup, keyed on the receiver's shape (or the superclass for super calls)
+typedef struct
+{
+	Obj* key;
+	Obj* target; //The method closure, or the shape a field store transitions to
+	int slot; //Field slot, -1 for a method
+} CacheEntry;
+
+//Property and invoke instructions each own one of these, up to INLINE_CACHE_ENTRIES receivers
+typedef struct
+{
+	int count;
+	uint32_t epoch;
+	CacheEntry entries[INLINE_CACHE_ENTRIES];
+} InlineCache;
+
 typedef struct  
 {
 	int count;
@@ -60,6 +122,9 @@ typedef struct
 	uint8_t* code;
 	Lines lines;
 	ValueArray constants;
+	int cacheCount;
+	int cacheCapacity;
+	InlineCache* caches;
 } Chunk;
 
 void InitChunk(Chunk* chunk);
@@ -67,5 +132,9 @@ void FreeChunk(Chunk* chunk);
 void WriteChunk(Chunk* chunk, uint8_t byte, int line);
 void WriteConstant(Chunk* chunk, Value value, int line);
 int AddConstant(Chunk* chunk, Value value);
+int AddInlineCache(Chunk* chunk);
+void TruncateChunk(Chunk* chunk, int count);
 int GetLine(Chunk* chunk, int instructionIdx);
+int InstructionLength(Chunk* chunk, int offset);
+int MaxStackDepth(Chunk* chunk, int arity);
 #endif
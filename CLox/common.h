@@ -10,8 +10,24 @@
 
 #define NAN_BOXING
 
+//Threaded dispatch needs the GCC/Clang "labels as values" extension. Define NO_COMPUTED_GOTO to force the portable switch
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif //COMPUTED_GOTO
+
+//Baseline JIT, enabled at runtime with --jit. Compiled code works on NaN boxed values directly and is entered from the computed goto loop
+#if defined(__linux__) && defined(__x86_64__) && defined(NAN_BOXING) && defined(COMPUTED_GOTO) && !defined(NO_JIT)
+#define JIT_AVAILABLE
+#endif //JIT_AVAILABLE
+
+//Background marking and sweeping, enabled at runtime with --gc-thread. Needs C11 threads and atomics, define NO_GC_THREAD to leave it out
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__) && !defined(__STDC_NO_ATOMICS__) && !defined(NO_GC_THREAD)
+#define GC_THREAD_AVAILABLE
+#endif //GC_THREAD_AVAILABLE
+
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
+//#define DEBUG_CHECK_STACK
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
@@ -5,6 +5,7 @@
 #include "compiler.h"
 #include "scanner.h"
 #include "memory.h"
+#include "peephole.h"
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif //DEBUG_PRINT_CODE
@@ -15,6 +16,7 @@ typedef struct
 	Token previous;
 	bool hadError;
 	bool panicMode;
+	int operandStart; //Where the left operand of the infix rule being parsed starts in the chunk
 } Parser;
 
 typedef enum
@@ -72,6 +74,7 @@ typedef struct Compiler
 	int localsCount;
 	Upvalue upvalues[UINT8_COUNT];
 	int scopeDepth;
+	int lastCall; //Offset of the most recent call or invoke, so a return can tell if it's returning the call's result
 } Compiler;
 
 typedef struct ClassCompiler
@@ -85,8 +88,10 @@ Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
 Chunk* compilingChunk;
 
+//Everything the compiler changes in a function goes through here
 static Chunk* CurrentChunk()
 {
+	SnapshotBarrier((Obj*)current->function);
 	return &current->function->chunk;
 }
 
@@ -173,6 +178,18 @@ static void EmitBytes(uint8_t byte1, uint8_t byte2)
 	EmitByte(byte2);
 }
 
+//Gives the instruction just emitted its own inline cache
+static void EmitInlineCache()
+{
+	int cache = AddInlineCache(CurrentChunk());
+	if (cache > UINT16_MAX)
+	{
+		Error("Too many property accesses in one function.");
+	}
+
+	EmitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
 static void EmitLoop(int loopStart)
 {
 	EmitByte(OP_LOOP);
@@ -193,6 +210,7 @@ static int EmitJump(uint8_t instruction)
 static uint8_t MakeConstant(Value value)
 {
 	int constant = AddConstant(CurrentChunk(), value);
+	WriteBarrier((Obj*)current->function, value);
 	if (constant > UINT8_MAX)
 	{
 		Error("Too many constants in one chunk");
@@ -234,6 +252,101 @@ static void PatchJump(int offset)
 	CurrentChunk()->code[offset + 1] = jump & 0xff;
 }
 
+//How much of the chunk existed at some point, so anything compiled after it can be thrown away
+typedef struct
+{
+	int count;
+	int constantCount;
+	int cacheCount;
+} ChunkMark;
+
+static ChunkMark MarkChunk()
+{
+	Chunk* chunk = CurrentChunk();
+	return (ChunkMark) { chunk->count, chunk->constants.count, chunk->cacheCount };
+}
+
+static void DiscardCode(int offset)
+{
+	TruncateChunk(CurrentChunk(), offset);
+	if (current->lastCall >= offset)
+	{
+		current->lastCall = -1;
+	}
+}
+
+static void RewindChunk(ChunkMark mark)
+{
+	DiscardCode(mark.count);
+	CurrentChunk()->constants.count = mark.constantCount;
+	CurrentChunk()->cacheCount = mark.cacheCount;
+}
+
+//True if the code between start and end is a single constant load
+static bool ConstantCode(int start, int end, Value* value)
+{
+	Chunk* chunk = CurrentChunk();
+	if (start + 2 == end && chunk->code[start] == OP_CONSTANT)
+	{
+		*value = chunk->constants.values[chunk->code[start + 1]];
+		return true;
+	}
+
+	if (start + 1 == end)
+	{
+		switch (chunk->code[start])
+		{
+		case OP_NIL:	*value = NIL_VAL; return true;
+		case OP_TRUE:	*value = BOOL_VAL(true); return true;
+		case OP_FALSE:	*value = BOOL_VAL(false); return true;
+		default:		return false;
+		}
+	}
+
+	return false;
+}
+
+//Drops a constant load ConstantCode matched, along with its pool entry if nothing has been added after it
+static void DiscardConstant(int start)
+{
+	Chunk* chunk = CurrentChunk();
+	if (chunk->code[start] == OP_CONSTANT && chunk->code[start + 1] == chunk->constants.count - 1)
+	{
+		chunk->constants.count--;
+	}
+
+	DiscardCode(start);
+}
+
+static void EmitValue(Value value)
+{
+	if (IS_NIL(value))
+	{
+		EmitByte(OP_NIL);
+	}
+	else if (IS_BOOL(value))
+	{
+		EmitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+	}
+	else
+	{
+		EmitConstant(value);
+	}
+}
+
+static bool IsFalseyConstant(Value value)
+{
+	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+//Code that can never run is still compiled so it gets checked for errors, then thrown away
+static void CompileDead(void (*compile)())
+{
+	ChunkMark mark = MarkChunk();
+	compile();
+	RewindChunk(mark);
+}
+
 static void InitCompiler(Compiler* compiler, FunctionType type)
 {
 	compiler->enclosing = current;
@@ -241,12 +354,16 @@ static void InitCompiler(Compiler* compiler, FunctionType type)
 	compiler->type = type;
 	compiler->localsCount = 0;
 	compiler->scopeDepth = 0;
+	compiler->lastCall = -1;
 	compiler->function = NewFunction();
 
 	current = compiler;
 	if (type != TYPE_SCRIPT)
 	{
-		current->function->name = CopyString(parser.previous.start, parser.previous.length);
+		ObjString* name = CopyString(parser.previous.start, parser.previous.length);
+		SnapshotBarrier((Obj*)current->function);
+		current->function->name = name;
+		WriteBarrier((Obj*)current->function, OBJ_VAL(name));
 	}
 
 	Local* local = &current->locals[current->localsCount++];
@@ -269,6 +386,8 @@ static ObjFunction* EndCompiler()
 {
 	EmitReturn();
 	ObjFunction* function = current->function;
+	PeepholeOptimise(CurrentChunk());
+	function->maxStack = MaxStackDepth(CurrentChunk(), function->arity);
 
 #ifdef DEBUG_PRINT_CODE
 	if (!parser.hadError)
@@ -433,6 +552,19 @@ static void AddLocal(Token name)
 	local->isCaptured = false;
 }
 
+//Globals are resolved to a slot in the VM's global array as soon as they are named
+static int GlobalVariable(Token* name)
+{
+	int slot = GlobalSlot(CopyString(name->start, name->length));
+	if (slot > UINT16_MAX)
+	{
+		Error("Too many global variables.");
+		return 0;
+	}
+
+	return slot;
+}
+
 static void DeclareVariable()
 {
 	if (current->scopeDepth == 0)
@@ -444,13 +576,13 @@ static void DeclareVariable()
 	AddLocal(*name);
 }
 
-static uint8_t ParseVariable(const char* errorMessage)
+static int ParseVariable(const char* errorMessage)
 {
 	Consume(TOKEN_IDENTIFIER, errorMessage);
 
 	DeclareVariable();
 	if (current->scopeDepth > 0) { return 0; }
-	return IdentifierConstant(&parser.previous);
+	return GlobalVariable(&parser.previous);
 }
 
 static void MarkInitialised()
@@ -480,12 +612,81 @@ static uint8_t ArgumentList()
 	return count;
 }
 
+//Evaluates an operator on two constants the way the VM would, false if it would be a runtime error
+static bool FoldBinary(TokenType operatorType, Value a, Value b, Value* result)
+{
+	switch (operatorType)
+	{
+	case TOKEN_EQUAL_EQUAL:	*result = BOOL_VAL(ValuesEqual(a, b)); return true;
+	case TOKEN_BANG_EQUAL:	*result = BOOL_VAL(!ValuesEqual(a, b)); return true;
+	default:
+		break;
+	}
+
+	if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b))
+	{
+		ObjString* left = AS_STRING(a);
+		ObjString* right = AS_STRING(b);
+		ObjString* string = NewString(left->length + right->length);
+		memcpy(string->chars, left->chars, left->length);
+		memcpy(string->chars + left->length, right->chars, right->length);
+		*result = OBJ_VAL(InternString(string));
+		return true;
+	}
+
+	if (!IS_NUMBER(a) || !IS_NUMBER(b))
+	{
+		return false;
+	}
+
+	if (IS_INTEGER(a) && IS_INTEGER(b))
+	{
+		int32_t i = AS_INTEGER(a);
+		int32_t j = AS_INTEGER(b);
+		switch (operatorType)
+		{
+		case TOKEN_PLUS:			*result = IntegerSum(i, j); return true;
+		case TOKEN_MINUS:			*result = IntegerDifference(i, j); return true;
+		case TOKEN_STAR:			*result = IntegerProduct(i, j); return true;
+		default:					break;
+		}
+	}
+
+	double x = AS_NUMBER(a);
+	double y = AS_NUMBER(b);
+	switch (operatorType)
+	{
+	case TOKEN_GREATER:			*result = BOOL_VAL(x > y); return true;
+	case TOKEN_GREATER_EQUAL:	*result = BOOL_VAL(!(x < y)); return true;
+	case TOKEN_LESS:			*result = BOOL_VAL(x < y); return true;
+	case TOKEN_LESS_EQUAL:		*result = BOOL_VAL(!(x > y)); return true;
+	case TOKEN_PLUS:			*result = NUMBER_VAL(x + y); return true;
+	case TOKEN_MINUS:			*result = NUMBER_VAL(x - y); return true;
+	case TOKEN_STAR:			*result = NUMBER_VAL(x * y); return true;
+	case TOKEN_SLASH:			*result = NUMBER_VAL(x / y); return true;
+	default:					return false;
+	}
+}
+
 static void Binary(bool canAssign)
 {
 	TokenType operatorType = parser.previous.type;
 	ParseRule* rule = GetRule(operatorType);
+	int leftStart = parser.operandStart;
+	int rightStart = CurrentChunk()->count;
+	Value a, b, result;
+	bool leftConstant = ConstantCode(leftStart, rightStart, &a);
 	ParsePrecedence((Precedence)rule->precedence + 1);
 
+	//Both operands stay in the pool until the result is made, so a collection while making it can't free them
+	if (leftConstant && ConstantCode(rightStart, CurrentChunk()->count, &b) && FoldBinary(operatorType, a, b, &result))
+	{
+		DiscardConstant(rightStart);
+		DiscardConstant(leftStart);
+		EmitValue(result);
+		return;
+	}
+
 	switch (operatorType)
 	{
 	case TOKEN_BANG_EQUAL:		EmitBytes(OP_EQUAL, OP_NOT); break;
@@ -505,6 +706,7 @@ static void Binary(bool canAssign)
 static void Call(bool canAssign)
 {
 	uint8_t arity = ArgumentList();
+	current->lastCall = CurrentChunk()->count;
 	EmitBytes(OP_CALL, arity);
 }
 
@@ -517,16 +719,20 @@ static void Dot(bool canAssign)
 	{
 		Expression();
 		EmitBytes(OP_SET_PROPERTY, name);
+		EmitInlineCache();
 	}
 	else if (Match(TOKEN_LEFT_PAREN))
 	{
 		uint8_t argCount = ArgumentList();
+		current->lastCall = CurrentChunk()->count;
 		EmitBytes(OP_INVOKE, name);
 		EmitByte(argCount);
+		EmitInlineCache();
 	}
 	else
 	{
 		EmitBytes(OP_GET_PROPERTY, name);
+		EmitInlineCache();
 	}
 }
 
@@ -550,11 +756,44 @@ static void Grouping(bool canAssign)
 static void Number(bool canAssign)
 {
 	double value = strtod(parser.previous.start, NULL);
-	EmitConstant(NUMBER_VAL(value));
+	if (value >= INT32_MIN && value <= INT32_MAX && value == (int32_t)value)
+	{
+		EmitConstant(INTEGER_VAL((int32_t)value));
+	}
+	else
+	{
+		EmitConstant(NUMBER_VAL(value));
+	}
+}
+
+static void ParseAnd()
+{
+	ParsePrecedence(PREC_AND);
+}
+
+static void ParseOr()
+{
+	ParsePrecedence(PREC_OR);
 }
 
 static void And(bool canAssign)
 {
+	//A constant left operand decides statically whether the right one runs
+	Value left;
+	if (ConstantCode(parser.operandStart, CurrentChunk()->count, &left))
+	{
+		if (IsFalseyConstant(left))
+		{
+			CompileDead(ParseAnd);
+		}
+		else
+		{
+			DiscardConstant(parser.operandStart);
+			ParseAnd();
+		}
+		return;
+	}
+
 	int endJump = EmitJump(OP_JUMP_IF_FALSE);
 
 	EmitByte(OP_POP);
@@ -565,6 +804,21 @@ static void And(bool canAssign)
 
 static void Or(bool canAssign)
 {
+	Value left;
+	if (ConstantCode(parser.operandStart, CurrentChunk()->count, &left))
+	{
+		if (IsFalseyConstant(left))
+		{
+			DiscardConstant(parser.operandStart);
+			ParseOr();
+		}
+		else
+		{
+			CompileDead(ParseOr);
+		}
+		return;
+	}
+
 	int elseJump = EmitJump(OP_JUMP_IF_FALSE);
 	int endJump = EmitJump(OP_JUMP);
 
@@ -580,6 +834,40 @@ static void String(bool canAssign)
 	EmitConstant(OBJ_VAL(CopyString(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
+//Empty pieces of an interpolated string aren't worth pushing, returns how many values were
+static int StringPart(const char* chars, int length)
+{
+	if (length == 0)
+	{
+		return 0;
+	}
+
+	EmitConstant(OBJ_VAL(CopyString(chars, length)));
+	return 1;
+}
+
+//"a${x}b${y}c" is scanned as "a${ and }b${, each followed by its expression, and then }c".
+//The pieces are pushed in order and joined by one OP_BUILD_STRING
+static void Interpolation(bool canAssign)
+{
+	int count = 0;
+	do
+	{
+		count += StringPart(parser.previous.start + 1, parser.previous.length - 3);
+		Expression();
+		count++;
+	} while (Match(TOKEN_INTERPOLATION));
+
+	Consume(TOKEN_STRING, "Expect end of string after interpolation");
+	count += StringPart(parser.previous.start + 1, parser.previous.length - 2);
+	if (count > UINT8_MAX)
+	{
+		Error("Can't interpolate more than 255 pieces");
+	}
+
+	EmitBytes(OP_BUILD_STRING, (uint8_t)count);
+}
+
 static void NamedVariable(Token name, bool canAssign)
 {
 	uint8_t getOp, setOp;
@@ -596,19 +884,26 @@ static void NamedVariable(Token name, bool canAssign)
 	}
 	else
 	{
-		arg = IdentifierConstant(&name);
+		arg = GlobalVariable(&name);
 		getOp = OP_GET_GLOBAL;
 		setOp = OP_SET_GLOBAL;
 	}
 	
+	uint8_t op = getOp;
 	if (canAssign && Match(TOKEN_EQUAL))
 	{
 		Expression();
-		EmitBytes(setOp, (uint8_t)arg);
+		op = setOp;
+	}
+
+	if (getOp == OP_GET_GLOBAL)
+	{
+		EmitByte(op);
+		EmitBytes((arg >> 8) & 0xff, arg & 0xff);
 	}
 	else
 	{
-		EmitBytes(getOp, (uint8_t)arg);
+		EmitBytes(op, (uint8_t)arg);
 	}
 }
 
@@ -645,8 +940,10 @@ static void Super(bool canAssign)
 	{
 		uint8_t argCount = ArgumentList();
 		NamedVariable(SyntheticToken("super"), false);
+		current->lastCall = CurrentChunk()->count;
 		EmitBytes(OP_SUPER_INVOKE, name);
 		EmitByte(argCount);
+		EmitInlineCache();
 	}
 	else
 	{
@@ -669,10 +966,35 @@ static void This(bool canAssign)
 static void Unary(bool canAssign)
 {
 	TokenType operatorType = parser.previous.type;
+	int operandStart = CurrentChunk()->count;
 
 	//compile the operand
 	ParsePrecedence(PREC_UNARY);
 
+	Value operand;
+	if (ConstantCode(operandStart, CurrentChunk()->count, &operand))
+	{
+		if (operatorType == TOKEN_BANG)
+		{
+			DiscardConstant(operandStart);
+			EmitValue(BOOL_VAL(IsFalseyConstant(operand)));
+			return;
+		}
+		else if (operatorType == TOKEN_MINUS && IS_NUMBER(operand))
+		{
+			DiscardConstant(operandStart);
+			if (IS_INTEGER(operand) && AS_INTEGER(operand) != 0 && AS_INTEGER(operand) != INT32_MIN)
+			{
+				EmitValue(INTEGER_VAL(-AS_INTEGER(operand)));
+			}
+			else
+			{
+				EmitValue(NUMBER_VAL(-AS_NUMBER(operand)));
+			}
+			return;
+		}
+	}
+
 	switch (operatorType)
 	{
 	case TOKEN_BANG:	EmitByte(OP_NOT); break;
@@ -706,6 +1028,7 @@ ParseRule rules[] =
   [TOKEN_IDENTIFIER]	= {Variable, NULL,   PREC_NONE},
   [TOKEN_STRING]		= {String,   NULL,   PREC_NONE},
   [TOKEN_NUMBER]		= {Number,   NULL,   PREC_NONE},
+  [TOKEN_INTERPOLATION]	= {Interpolation, NULL, PREC_NONE},
   [TOKEN_AND]			= {NULL,     And,    PREC_AND},
   [TOKEN_CLASS]			= {NULL,     NULL,   PREC_NONE},
   [TOKEN_ELSE]			= {NULL,     NULL,   PREC_NONE},
@@ -742,12 +1065,14 @@ static void ParsePrecedence(Precedence precedence)
 	}
 
 	bool canAssign = precedence <= PREC_ASSIGNMENT;
+	int start = CurrentChunk()->count;
 	prefixRule(canAssign);
 
 	while (precedence < GetRule(parser.current.type)->precedence)
 	{
 		Advance();
 		ParseFn infixRule = GetRule(parser.previous.type)->infix;
+		parser.operandStart = start;
 		infixRule(canAssign);
 	}
 
@@ -757,7 +1082,7 @@ static void ParsePrecedence(Precedence precedence)
 	}
 }
 
-static void DefineVariable(uint8_t global)
+static void DefineVariable(int global)
 {
 	if (current->scopeDepth > 0) 
 	{
@@ -765,7 +1090,8 @@ static void DefineVariable(uint8_t global)
 		return;
 	}
 
-	EmitBytes(OP_DEFINE_GLOBAL, global);
+	EmitByte(OP_DEFINE_GLOBAL);
+	EmitBytes((global >> 8) & 0xff, global & 0xff);
 }
 
 static void Expression()
@@ -775,7 +1101,7 @@ static void Expression()
 
 static void VarDeclaration()
 {
-	uint8_t global = ParseVariable("Expect variable name");
+	int global = ParseVariable("Expect variable name");
 
 	if (Match(TOKEN_EQUAL))
 	{
@@ -818,16 +1144,29 @@ static void ForStatement()
 	int loopStart = CurrentChunk()->count;
 	//Condition
 	int exitJump = -1;
+	bool neverRuns = false;
 	if (!Match(TOKEN_SEMICOLON))
 	{
 		Expression();
 
 		Consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-		exitJump = EmitJump(OP_JUMP_IF_FALSE);
-		EmitByte(OP_POP);
+		Value condition;
+		if (ConstantCode(loopStart, CurrentChunk()->count, &condition))
+		{
+			DiscardConstant(loopStart);
+			neverRuns = IsFalseyConstant(condition);
+		}
+		else
+		{
+			exitJump = EmitJump(OP_JUMP_IF_FALSE);
+			EmitByte(OP_POP);
+		}
 	}
 
+	//Only the initialiser is kept for a loop that can never run
+	ChunkMark loopMark = MarkChunk();
+
 	//Increment
 	if (!Match(TOKEN_SEMICOLON))
 	{
@@ -845,6 +1184,11 @@ static void ForStatement()
 	Statement();
 	EmitLoop(loopStart);
 
+	if (neverRuns)
+	{
+		RewindChunk(loopMark);
+	}
+
 	if (exitJump != -1)
 	{
 		PatchJump(exitJump);
@@ -857,9 +1201,38 @@ static void ForStatement()
 static void IfStatement()
 {
 	Consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+	int conditionStart = CurrentChunk()->count;
 	Expression();
 	Consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+	Value condition;
+	if (ConstantCode(conditionStart, CurrentChunk()->count, &condition))
+	{
+		DiscardConstant(conditionStart);
+		bool taken = !IsFalseyConstant(condition);
+		if (taken)
+		{
+			Statement();
+		}
+		else
+		{
+			CompileDead(Statement);
+		}
+
+		if (Match(TOKEN_ELSE))
+		{
+			if (taken)
+			{
+				CompileDead(Statement);
+			}
+			else
+			{
+				Statement();
+			}
+		}
+		return;
+	}
+
 	int thenJump = EmitJump(OP_JUMP_IF_FALSE);
 	EmitByte(OP_POP);
 	Statement();
@@ -905,6 +1278,14 @@ static void ReturnStatement()
 
 		Expression();
 		Consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+		//Returning a call's result lets the callee take over this frame. The OP_RETURN stays for callees that can't
+		Chunk* chunk = CurrentChunk();
+		if (current->lastCall >= 0 && current->lastCall + InstructionLength(chunk, current->lastCall) == chunk->count)
+		{
+			uint8_t* call = &chunk->code[current->lastCall];
+			*call = *call == OP_CALL ? OP_TAIL_CALL : *call == OP_INVOKE ? OP_TAIL_INVOKE : OP_TAIL_SUPER_INVOKE;
+		}
 		EmitByte(OP_RETURN);
 	}
 }
@@ -916,6 +1297,21 @@ static void WhileStatement()
 	Expression();
 	Consume(TOKEN_RIGHT_PAREN, "Expect ')' after 'while' condition.");
 
+	Value condition;
+	if (ConstantCode(loopStart, CurrentChunk()->count, &condition))
+	{
+		DiscardConstant(loopStart);
+		if (IsFalseyConstant(condition))
+		{
+			CompileDead(Statement);
+			return;
+		}
+
+		Statement();
+		EmitLoop(loopStart);
+		return;
+	}
+
 	int exitJump = EmitJump(OP_JUMP_IF_FALSE);
 	EmitByte(OP_POP);
 	Statement();
@@ -957,9 +1353,19 @@ static void Synchronise()
 
 static void Block()
 {
+	bool reachable = true;
 	while (!Check(TOKEN_RIGHT_BRACE) && !Check(TOKEN_EOF))
 	{
-		Declaration();
+		//Nothing can jump past a return into the rest of its block
+		if (reachable)
+		{
+			reachable = !Check(TOKEN_RETURN);
+			Declaration();
+		}
+		else
+		{
+			CompileDead(Declaration);
+		}
 	}
 
 	Consume(TOKEN_RIGHT_BRACE, "Expect '}' after block");
@@ -983,7 +1389,7 @@ static void Function(FunctionType type)
 			}
 
 
-			uint8_t constant = ParseVariable("Expect parameter name.");
+			int constant = ParseVariable("Expect parameter name.");
 			DefineVariable(constant);
 		} while (Match(TOKEN_COMMA));
 	}
@@ -1023,9 +1429,10 @@ static void ClassDeclaration()
 	Token className = parser.previous;
 	uint8_t nameConstant = IdentifierConstant(&parser.previous);
 	DeclareVariable();
+	int global = current->scopeDepth > 0 ? 0 : GlobalVariable(&className);
 
 	EmitBytes(OP_CLASS, nameConstant);
-	DefineVariable(nameConstant);
+	DefineVariable(global);
 
 	ClassCompiler classCompiler;
 	classCompiler.enclosing = currentClass;
@@ -1071,7 +1478,7 @@ static void ClassDeclaration()
 
 static void FunDeclaration()
 {
-	uint8_t global = ParseVariable("Expect function name");
+	int global = ParseVariable("Expect function name");
 	MarkInitialised();
 	Function(TYPE_FUNCTION);
 	DefineVariable(global);
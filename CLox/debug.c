@@ -2,6 +2,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void DisassembleChunk(Chunk* chunk, const char* name)
 {
@@ -35,12 +36,96 @@ static int InvokeInstruction(const char* name, Chunk* chunk, int offset)
 {
 	uint8_t constant = chunk->code[offset + 1];
 	uint8_t argCount = chunk->code[offset + 2];
+	uint16_t cache = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
 	printf_s("%-16s (%d args) %4d '", name, argCount, constant);
 	PrintValue(chunk->constants.values[constant]);
+	printf_s("' ic %d\n", cache);
+	return offset + 5;
+}
+
+static int PropertyInstruction(const char* name, Chunk* chunk, int offset)
+{
+	uint8_t constant = chunk->code[offset + 1];
+	uint16_t cache = (uint16_t)((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+	printf_s("%-16s %4d '", name, constant);
+	PrintValue(chunk->constants.values[constant]);
+	printf_s("' ic %d\n", cache);
+	return offset + 4;
+}
+
+static int GlobalInstruction(const char* name, Chunk* chunk, int offset)
+{
+	uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+	printf_s("%-16s %4d '", name, slot);
+	PrintValue(vm.globalNames.values[slot]);
 	printf_s("'\n");
 	return offset + 3;
 }
 
+static int LocalsInstruction(const char* name, Chunk* chunk, int offset)
+{
+	uint8_t slotA = chunk->code[offset + 1];
+	uint8_t slotB = chunk->code[offset + 2];
+	printf_s("%-16s %4d %4d\n", name, slotA, slotB);
+	return offset + 3;
+}
+
+static int CopyLocalInstruction(const char* name, Chunk* chunk, int offset)
+{
+	uint8_t dst = chunk->code[offset + 1];
+	uint8_t src = chunk->code[offset + 2];
+	printf_s("%-16s %4d %4d\n", name, dst, src);
+	return offset + 3;
+}
+
+static int StoreConstantInstruction(const char* name, Chunk* chunk, int offset)
+{
+	uint8_t dst = chunk->code[offset + 1];
+	uint8_t constant = chunk->code[offset + 2];
+	printf_s("%-16s %4d %4d '", name, dst, constant);
+	PrintValue(chunk->constants.values[constant]);
+	printf_s("'\n");
+	return offset + 3;
+}
+
+static int SlotArithmeticInstruction(const char* name, bool isConstant, Chunk* chunk, int offset)
+{
+	uint8_t dst = chunk->code[offset + 1];
+	uint8_t srcA = chunk->code[offset + 2];
+	uint8_t srcB = chunk->code[offset + 3];
+	if (isConstant)
+	{
+		printf_s("%-16s %4d %4d %4d '", name, dst, srcA, srcB);
+		PrintValue(chunk->constants.values[srcB]);
+		printf_s("'\n");
+	}
+	else
+	{
+		printf_s("%-16s %4d %4d %4d\n", name, dst, srcA, srcB);
+	}
+
+	return offset + 4;
+}
+
+static int SlotJumpInstruction(const char* name, bool isConstant, Chunk* chunk, int offset)
+{
+	uint8_t srcA = chunk->code[offset + 1];
+	uint8_t srcB = chunk->code[offset + 2];
+	uint16_t jump = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+	if (isConstant)
+	{
+		printf_s("%-16s %4d '", name, srcA);
+		PrintValue(chunk->constants.values[srcB]);
+		printf_s("' %4d -> %d\n", offset, offset + 5 + jump);
+	}
+	else
+	{
+		printf_s("%-16s %4d %4d %4d -> %d\n", name, srcA, srcB, offset, offset + 5 + jump);
+	}
+
+	return offset + 5;
+}
+
 static int SimpleInstruction(const char* name, int offset)
 {
 	printf_s("%s\n", name);
@@ -88,19 +173,23 @@ int DisassembleInstruction(Chunk* chunk, int offset)
 	case OP_SET_LOCAL:
 		return ByteInstruction("OP_SET_LOCAL", chunk, offset);
 	case OP_GET_GLOBAL:
-		return ConstantInstruction("OP_GET_GLOBAL", chunk, offset);
+		return GlobalInstruction("OP_GET_GLOBAL", chunk, offset);
 	case OP_DEFINE_GLOBAL:
-		return ConstantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+		return GlobalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
 	case OP_SET_GLOBAL:
-		return ConstantInstruction("OP_SET_GLOBAL", chunk, offset);
+		return GlobalInstruction("OP_SET_GLOBAL", chunk, offset);
 	case OP_GET_UPVALUE:
 		return ByteInstruction("OP_GET_UPVALUE", chunk, offset);
 	case OP_SET_UPVALUE:
 		return ByteInstruction("OP_SET_UPVALUE", chunk, offset);
 	case OP_GET_PROPERTY:
-		return ConstantInstruction("OP_GET_PROPERTY", chunk, offset);
+		return PropertyInstruction("OP_GET_PROPERTY", chunk, offset);
+	case OP_GET_FIELD:
+		return PropertyInstruction("OP_GET_FIELD", chunk, offset);
+	case OP_GET_METHOD:
+		return PropertyInstruction("OP_GET_METHOD", chunk, offset);
 	case OP_SET_PROPERTY:
-		return ConstantInstruction("OP_SET_PROPERTY", chunk, offset);
+		return PropertyInstruction("OP_SET_PROPERTY", chunk, offset);
 	case OP_GET_SUPER:
 		return ConstantInstruction("OP_GET_SUPER", chunk, offset);
 	case OP_EQUAL:
@@ -111,6 +200,10 @@ int DisassembleInstruction(Chunk* chunk, int offset)
 		return SimpleInstruction("OP_LESS", offset);
 	case OP_ADD:
 		return SimpleInstruction("OP_ADD", offset);
+	case OP_ADD_NUMBER:
+		return SimpleInstruction("OP_ADD_NUMBER", offset);
+	case OP_ADD_STRING:
+		return SimpleInstruction("OP_ADD_STRING", offset);
 	case OP_SUBTRACT:
 		return SimpleInstruction("OP_SUBTRACT", offset);
 	case OP_MULTIPLY:
@@ -129,12 +222,20 @@ int DisassembleInstruction(Chunk* chunk, int offset)
 		return JumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
 	case OP_LOOP:
 		return JumpInstruction("OP_LOOP", -1, chunk, offset);
+	case OP_TRACE_LOOP:
+		return JumpInstruction("OP_TRACE_LOOP", -1, chunk, offset);
 	case OP_CALL:
 		return ByteInstruction("OP_CALL", chunk, offset);
+	case OP_TAIL_CALL:
+		return ByteInstruction("OP_TAIL_CALL", chunk, offset);
 	case OP_INVOKE:
 		return InvokeInstruction("OP_INVOKE", chunk, offset);
 	case OP_SUPER_INVOKE:
 		return InvokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+	case OP_TAIL_INVOKE:
+		return InvokeInstruction("OP_TAIL_INVOKE", chunk, offset);
+	case OP_TAIL_SUPER_INVOKE:
+		return InvokeInstruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
 	case OP_CLOSURE:
 		offset++;
 		uint8_t constant = chunk->code[offset++];
@@ -162,6 +263,62 @@ int DisassembleInstruction(Chunk* chunk, int offset)
 		return SimpleInstruction("OP_INHERIT", offset);
 	case OP_METHOD:
 		return ConstantInstruction("OP_METHOD", chunk, offset);
+	case OP_BUILD_STRING:
+		return ByteInstruction("OP_BUILD_STRING", chunk, offset);
+	case OP_GET_LOCAL_0:
+		return SimpleInstruction("OP_GET_LOCAL_0", offset);
+	case OP_GET_LOCAL_1:
+		return SimpleInstruction("OP_GET_LOCAL_1", offset);
+	case OP_GET_LOCAL_2:
+		return SimpleInstruction("OP_GET_LOCAL_2", offset);
+	case OP_GET_LOCAL_3:
+		return SimpleInstruction("OP_GET_LOCAL_3", offset);
+	case OP_SET_LOCAL_POP:
+		return ByteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+	case OP_ADD_LOCALS:
+		return LocalsInstruction("OP_ADD_LOCALS", chunk, offset);
+	case OP_ADD_CONSTANT:
+		return ConstantInstruction("OP_ADD_CONSTANT", chunk, offset);
+	case OP_SUBTRACT_CONSTANT:
+		return ConstantInstruction("OP_SUBTRACT_CONSTANT", chunk, offset);
+	case OP_LESS_CONSTANT:
+		return ConstantInstruction("OP_LESS_CONSTANT", chunk, offset);
+	case OP_NOT_EQUAL:
+		return SimpleInstruction("OP_NOT_EQUAL", offset);
+	case OP_GREATER_EQUAL:
+		return SimpleInstruction("OP_GREATER_EQUAL", offset);
+	case OP_LESS_EQUAL:
+		return SimpleInstruction("OP_LESS_EQUAL", offset);
+	case OP_JUMP_IF_FALSE_POP:
+		return JumpInstruction("OP_JUMP_IF_FALSE_POP", 1, chunk, offset);
+	case OP_COPY_LOCAL:
+		return CopyLocalInstruction("OP_COPY_LOCAL", chunk, offset);
+	case OP_STORE_CONSTANT:
+		return StoreConstantInstruction("OP_STORE_CONSTANT", chunk, offset);
+	case OP_ADD_LL:
+		return SlotArithmeticInstruction("OP_ADD_LL", false, chunk, offset);
+	case OP_ADD_LK:
+		return SlotArithmeticInstruction("OP_ADD_LK", true, chunk, offset);
+	case OP_SUBTRACT_LL:
+		return SlotArithmeticInstruction("OP_SUBTRACT_LL", false, chunk, offset);
+	case OP_SUBTRACT_LK:
+		return SlotArithmeticInstruction("OP_SUBTRACT_LK", true, chunk, offset);
+	case OP_MULTIPLY_LL:
+		return SlotArithmeticInstruction("OP_MULTIPLY_LL", false, chunk, offset);
+	case OP_MULTIPLY_LK:
+		return SlotArithmeticInstruction("OP_MULTIPLY_LK", true, chunk, offset);
+	case OP_DIVIDE_LL:
+		return SlotArithmeticInstruction("OP_DIVIDE_LL", false, chunk, offset);
+	case OP_DIVIDE_LK:
+		return SlotArithmeticInstruction("OP_DIVIDE_LK", true, chunk, offset);
+	case OP_JUMP_IF_NOT_LESS_LL:
+		return SlotJumpInstruction("OP_JUMP_IF_NOT_LESS_LL", false, chunk, offset);
+	case OP_JUMP_IF_NOT_LESS_LK:
+		return SlotJumpInstruction("OP_JUMP_IF_NOT_LESS_LK", true, chunk, offset);
+	case OP_JUMP_IF_NOT_GREATER_LL:
+		return SlotJumpInstruction("OP_JUMP_IF_NOT_GREATER_LL", false, chunk, offset);
+	case OP_JUMP_IF_NOT_GREATER_LK:
+		return SlotJumpInstruction("OP_JUMP_IF_NOT_GREATER_LK", true, chunk, offset);
 	default:
 		printf_s("Unknown opcode %d\n", instruction);
 		return offset + 1;
@@ -0,0 +1,886 @@
+#include "common.h"
+
+#ifdef JIT_AVAILABLE
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "chunk.h"
+#include "jit.h"
+#include "trace.h"
+
+#define EXIT_TARGET -1
+#define RESUME_TARGET -2
+
+typedef JitStatus(*JitEntry)(CallFrame* frame, uint8_t* resume);
+
+//Returned in RAX and RDX, so the code can load both without going through memory
+typedef struct
+{
+	CallFrame* frame;
+	uint8_t* resume;
+} JitTransfer;
+
+static void PushValue(Assembler* as, Register reg)
+{
+	Store(as, STACK_TOP, 0, reg);
+	AddImm(as, STACK_TOP, sizeof(Value));
+}
+
+static void PopValue(Assembler* as, Register reg)
+{
+	AddImm(as, STACK_TOP, -(int32_t)sizeof(Value));
+	Load(as, reg, STACK_TOP, 0);
+}
+
+static void PushConstant(Assembler* as, Value value)
+{
+	MovValue(as, RAX, value);
+	PushValue(as, RAX);
+}
+
+//The helper's arguments must already be in place. Anything but JIT_CONTINUE leaves the compiled code,
+//otherwise the helper may have moved the stack so both cached pointers are reloaded
+static void CallHelper(Assembler* as, void* helper)
+{
+	Store(as, STACK_TOP_ADDRESS, 0, STACK_TOP);
+	MovImm(as, RAX, (uint64_t)(uintptr_t)helper);
+	CallReg(as, RAX);
+	Byte(as, 0x85); //test eax, eax
+	Byte(as, 0xC0);
+	JumpTo(as, CC_NE, EXIT_TARGET);
+	Load(as, STACK_TOP, STACK_TOP_ADDRESS, 0);
+	Load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+}
+
+//For the helpers that push or pop a frame. JIT_FRAME_CHANGED goes to the code's resume stub rather than leaving it, see
+//ResumeFrame
+static void CallTransferHelper(Assembler* as, void* helper)
+{
+	Store(as, STACK_TOP_ADDRESS, 0, STACK_TOP);
+	MovImm(as, RAX, (uint64_t)(uintptr_t)helper);
+	CallReg(as, RAX);
+	Byte(as, 0x85); //test eax, eax
+	Byte(as, 0xC0);
+	int done = JumpForward(as, CC_E);
+	Byte(as, 0x83); //cmp eax, JIT_FRAME_CHANGED
+	Byte(as, 0xF8);
+	Byte(as, JIT_FRAME_CHANGED);
+	JumpTo(as, CC_E, RESUME_TARGET);
+	JumpTo(as, CC_ALWAYS, EXIT_TARGET);
+	PatchHere(as, done);
+	Load(as, STACK_TOP, STACK_TOP_ADDRESS, 0);
+	Load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+}
+
+//The new top frame picks up straight from here when its function is compiled too, so calls and returns between
+//compiled functions never leave native code. A null frame goes back through runCompiled instead, which is also where a
+//pending compaction gets its safepoint
+static JitTransfer ResumeFrame()
+{
+	JitTransfer transfer = { NULL, NULL };
+	CallFrame* frame = &vm.frames[vm.frameCount - 1];
+	ObjFunction* function = frame->closure->function;
+	if (function->jit != NULL && !vm.compactPending)
+	{
+		transfer.frame = frame;
+		transfer.resume = function->jit->code + function->jit->offsets[frame->ip - function->chunk.code];
+	}
+
+	return transfer;
+}
+
+static void CallErrorHelper(Assembler* as, void* helper, uint8_t* ip)
+{
+	MovImm(as, RDI, (uint64_t)(uintptr_t)ip);
+	CallHelper(as, helper);
+}
+
+//Moves the number in reg into xmm, widening an integer to a double, and returns the patch taken when
+//it isn't a number at all. Clobbers RCX and RSI
+static int NumberOperand(Assembler* as, Register reg, XmmRegister xmm)
+{
+	Move(as, RCX, reg);
+	And(as, RCX, NAN_MASK);
+	Cmp(as, RCX, NAN_MASK);
+	int isDouble = JumpForward(as, CC_NE);
+	MovImm(as, RCX, INTEGER_MASK);
+	And(as, RCX, reg);
+	MovImm(as, RSI, QNAN | TAG_INTEGER);
+	Cmp(as, RCX, RSI);
+	int slow = JumpForward(as, CC_NE);
+	Cvtsi2sd(as, xmm, reg);
+	int done = JumpForward(as, CC_ALWAYS);
+
+	PatchHere(as, isDouble);
+	MovqToXmm(as, xmm, reg);
+	PatchHere(as, done);
+	return slow;
+}
+
+//a in RAX and b in RDX become XMM0 and XMM1, or the code jumps to one of the slow patches.
+//Compiled code works in doubles throughout, so its results are never integers
+static void NumberOperands(Assembler* as, int slow[2])
+{
+	slow[0] = NumberOperand(as, RAX, XMM0);
+	slow[1] = NumberOperand(as, RDX, XMM1);
+}
+
+static void StackArithmetic(Assembler* as, SseOp op, uint8_t* ip)
+{
+	int slow[2];
+	Load(as, RAX, STACK_TOP, -2 * (int32_t)sizeof(Value));
+	Load(as, RDX, STACK_TOP, -(int32_t)sizeof(Value));
+	NumberOperands(as, slow);
+	Sse(as, op, XMM0, XMM1);
+	MovqFromXmm(as, RAX, XMM0);
+	Store(as, STACK_TOP, -2 * (int32_t)sizeof(Value), RAX);
+	AddImm(as, STACK_TOP, -(int32_t)sizeof(Value));
+	int done = JumpForward(as, CC_ALWAYS);
+
+	PatchHere(as, slow[0]);
+	PatchHere(as, slow[1]);
+	CallErrorHelper(as, op == SSE_ADD ? (void*)JitAdd : (void*)JitOperandsError, ip);
+	PatchHere(as, done);
+}
+
+//The interpreter's >= and <= are !(a < b) and !(a > b), "below or equal" keeps their answer for NaN
+static void StackComparison(Assembler* as, bool swap, Condition cc, uint8_t* ip)
+{
+	int slow[2];
+	Load(as, RAX, STACK_TOP, -2 * (int32_t)sizeof(Value));
+	Load(as, RDX, STACK_TOP, -(int32_t)sizeof(Value));
+	NumberOperands(as, slow);
+	Ucomisd(as, swap ? XMM1 : XMM0, swap ? XMM0 : XMM1);
+	MovImm(as, RAX, FALSE_VAL);
+	MovImm(as, RDX, TRUE_VAL);
+	Cmov(as, cc, RAX, RDX);
+	Store(as, STACK_TOP, -2 * (int32_t)sizeof(Value), RAX);
+	AddImm(as, STACK_TOP, -(int32_t)sizeof(Value));
+	int done = JumpForward(as, CC_ALWAYS);
+
+	PatchHere(as, slow[0]);
+	PatchHere(as, slow[1]);
+	CallErrorHelper(as, JitOperandsError, ip);
+	PatchHere(as, done);
+}
+
+static void SlotOperands(Assembler* as, Chunk* chunk, uint8_t a, uint8_t b, bool isConstant)
+{
+	Load(as, RAX, SLOTS, a * (int32_t)sizeof(Value));
+	if (isConstant)
+	{
+		MovValue(as, RDX, chunk->constants.values[b]);
+	}
+	else
+	{
+		Load(as, RDX, SLOTS, b * (int32_t)sizeof(Value));
+	}
+}
+
+static void SlotArithmetic(Assembler* as, Chunk* chunk, SseOp op, bool isConstant, uint8_t* operands, uint8_t* ip)
+{
+	int slow[2];
+	int32_t dst = operands[0] * (int32_t)sizeof(Value);
+	SlotOperands(as, chunk, operands[1], operands[2], isConstant);
+	NumberOperands(as, slow);
+	Sse(as, op, XMM0, XMM1);
+	MovqFromXmm(as, RAX, XMM0);
+	Store(as, SLOTS, dst, RAX);
+	int done = JumpForward(as, CC_ALWAYS);
+
+	PatchHere(as, slow[0]);
+	PatchHere(as, slow[1]);
+	if (op == SSE_ADD)
+	{
+		PushValue(as, RAX);
+		PushValue(as, RDX);
+		CallErrorHelper(as, JitAdd, ip);
+		PopValue(as, RAX);
+		Store(as, SLOTS, dst, RAX);
+	}
+	else
+	{
+		CallErrorHelper(as, JitOperandsError, ip);
+	}
+
+	PatchHere(as, done);
+}
+
+static void SlotBranch(Assembler* as, Chunk* chunk, bool swap, bool isConstant, uint8_t* operands, int target, uint8_t* ip)
+{
+	int slow[2];
+	SlotOperands(as, chunk, operands[0], operands[1], isConstant);
+	NumberOperands(as, slow);
+	Ucomisd(as, swap ? XMM1 : XMM0, swap ? XMM0 : XMM1);
+	JumpTo(as, CC_BE, target);
+	int done = JumpForward(as, CC_ALWAYS);
+
+	PatchHere(as, slow[0]);
+	PatchHere(as, slow[1]);
+	CallErrorHelper(as, JitOperandsError, ip);
+	PatchHere(as, done);
+}
+
+static void JumpIfFalse(Assembler* as, bool pop, int target)
+{
+	Load(as, RAX, STACK_TOP, -(int32_t)sizeof(Value));
+	if (pop)
+	{
+		AddImm(as, STACK_TOP, -(int32_t)sizeof(Value));
+	}
+
+	MovImm(as, RDX, NIL_VAL);
+	Cmp(as, RAX, RDX);
+	JumpTo(as, CC_E, target);
+	MovImm(as, RDX, FALSE_VAL);
+	Cmp(as, RAX, RDX);
+	JumpTo(as, CC_E, target);
+}
+
+static void Not(Assembler* as)
+{
+	Load(as, RAX, STACK_TOP, -(int32_t)sizeof(Value));
+	MovImm(as, RDX, NIL_VAL);
+	Cmp(as, RAX, RDX);
+	int isNil = JumpForward(as, CC_E);
+	MovImm(as, RDX, FALSE_VAL);
+	Cmp(as, RAX, RDX);
+	int isFalse = JumpForward(as, CC_E);
+	MovImm(as, RAX, FALSE_VAL);
+	int done = JumpForward(as, CC_ALWAYS);
+
+	PatchHere(as, isNil);
+	PatchHere(as, isFalse);
+	MovImm(as, RAX, TRUE_VAL);
+	PatchHere(as, done);
+	Store(as, STACK_TOP, -(int32_t)sizeof(Value), RAX);
+}
+
+static void Negate(Assembler* as, uint8_t* ip)
+{
+	Load(as, RAX, STACK_TOP, -(int32_t)sizeof(Value));
+	int slow = NumberOperand(as, RAX, XMM0);
+	MovqFromXmm(as, RAX, XMM0);
+	MovImm(as, RDX, SIGN_BIT);
+	Xor(as, RAX, RDX);
+	Store(as, STACK_TOP, -(int32_t)sizeof(Value), RAX);
+	int done = JumpForward(as, CC_ALWAYS);
+
+	PatchHere(as, slow);
+	CallErrorHelper(as, JitOperandError, ip);
+	PatchHere(as, done);
+}
+
+//Leaves the address of the global slot in RDX, and the value in RAX after checking it's been defined
+static void LoadGlobal(Assembler* as, uint16_t slot, uint8_t* ip)
+{
+	MovImm(as, RDX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+	Load(as, RDX, RDX, 0);
+	AddImm(as, RDX, slot * (int32_t)sizeof(Value));
+	Load(as, RAX, RDX, 0);
+	MovImm(as, RCX, UNDEFINED_VAL);
+	Cmp(as, RAX, RCX);
+	int defined = JumpForward(as, CC_NE);
+	MovImm(as, RDI, slot);
+	MovImm(as, RSI, (uint64_t)(uintptr_t)ip);
+	CallHelper(as, JitUndefinedGlobal);
+	PatchHere(as, defined);
+}
+
+//Leaves the upvalue's location in RDX
+static void LoadUpvalue(Assembler* as, uint8_t slot)
+{
+	Load(as, RDX, FRAME, offsetof(CallFrame, closure));
+	Load(as, RDX, RDX, (int32_t)(offsetof(ObjClosure, upvalues) + slot * sizeof(ObjUpvalue*)));
+	Load(as, RDX, RDX, offsetof(ObjUpvalue, location));
+}
+
+//The guards of an inline fast path, all patched to the helper call that follows it
+typedef struct
+{
+	int patches[16];
+	int count;
+} SlowPath;
+
+static void Guard(Assembler* as, SlowPath* slow, Condition cc)
+{
+	slow->patches[slow->count++] = JumpForward(as, cc);
+}
+
+static void PatchSlowPath(Assembler* as, SlowPath* slow)
+{
+	for (int idx = 0; idx < slow->count; idx++)
+	{
+		PatchHere(as, slow->patches[idx]);
+	}
+}
+
+//Turns the Value in reg into the object's address, or takes the slow path if it isn't an object of that type.
+//Clobbers RCX and RDX
+static void ObjectOfType(Assembler* as, Register reg, ObjType type, SlowPath* slow)
+{
+	MovImm(as, RCX, QNAN | SIGN_BIT);
+	Move(as, RDX, reg);
+	And(as, RDX, RCX);
+	Cmp(as, RDX, RCX);
+	Guard(as, slow, CC_NE);
+	MovImm(as, RCX, ~(QNAN | SIGN_BIT));
+	And(as, reg, RCX);
+	Load32(as, RDX, reg, offsetof(Obj, type));
+	MovImm(as, RCX, type);
+	Cmp(as, RDX, RCX);
+	Guard(as, slow, CC_NE);
+}
+
+//Leaves the cache in RCX, and takes the slow path unless its first entry is for the shape of the instance in RAX.
+//Clobbers RDX and RSI
+static void CacheGuard(Assembler* as, InlineCache* cache, SlowPath* slow)
+{
+	MovImm(as, RCX, (uint64_t)(uintptr_t)cache);
+	Load32(as, RDX, RCX, offsetof(InlineCache, count));
+	Test(as, RDX, RDX);
+	Guard(as, slow, CC_E);
+	Load(as, RDX, RCX, offsetof(InlineCache, entries[0].key));
+	Load(as, RSI, RAX, offsetof(ObjInstance, shape));
+	Cmp(as, RDX, RSI);
+	Guard(as, slow, CC_NE);
+}
+
+//Calls the closure in RAX the way Call does, jumping straight into its compiled code. Whatever Call would have to do
+//more than that, compiling the function, growing a stack or reporting an error, takes the slow path instead
+static void EnterClosure(Assembler* as, int argCount, uint8_t* ip, SlowPath* slow)
+{
+	Load(as, RSI, RAX, offsetof(ObjClosure, function));
+	Load32(as, RDX, RSI, offsetof(ObjFunction, arity));
+	MovImm(as, RCX, argCount);
+	Cmp(as, RDX, RCX);
+	Guard(as, slow, CC_NE);
+	Load(as, RDI, RSI, offsetof(ObjFunction, jit));
+	Test(as, RDI, RDI);
+	Guard(as, slow, CC_E);
+
+	MovImm(as, R8, (uint64_t)(uintptr_t)&vm.frameCount);
+	Load32(as, RDX, R8, 0);
+	MovImm(as, RCX, (uint64_t)(uintptr_t)&vm.frameCapacity);
+	Load32(as, RCX, RCX, 0);
+	Cmp(as, RDX, RCX);
+	Guard(as, slow, CC_AE);
+	MovImm(as, RCX, (uint64_t)(uintptr_t)&vm.maxFrames);
+	Load32(as, RCX, RCX, 0);
+	Cmp(as, RDX, RCX);
+	Guard(as, slow, CC_AE);
+
+	//The callee's slots in R9, they have to fit in the stack as it is
+	Move(as, R9, STACK_TOP);
+	AddImm(as, R9, -(argCount + 1) * (int32_t)sizeof(Value));
+	Load32(as, R10, RSI, offsetof(ObjFunction, maxStack));
+	ShiftLeft(as, R10, 3);
+	Add(as, R10, R9);
+	MovImm(as, R11, (uint64_t)(uintptr_t)&vm.stack);
+	Load(as, R11, R11, 0);
+	MovImm(as, RCX, (uint64_t)(uintptr_t)&vm.stackCapacity);
+	Load32(as, RCX, RCX, 0);
+	ShiftLeft(as, RCX, 3);
+	Add(as, RCX, R11);
+	Cmp(as, R10, RCX);
+	Guard(as, slow, CC_A);
+
+	MovImm(as, RCX, (uint64_t)(uintptr_t)ip);
+	Store(as, FRAME, offsetof(CallFrame, ip), RCX);
+	AddImm(as, RDX, 1);
+	Store32(as, R8, 0, RDX);
+	AddImm(as, FRAME, sizeof(CallFrame));
+	Store(as, FRAME, offsetof(CallFrame, closure), RAX);
+	Load(as, RCX, RSI, offsetof(ObjFunction, chunk.code));
+	Store(as, FRAME, offsetof(CallFrame, ip), RCX);
+	Store(as, FRAME, offsetof(CallFrame, slots), R9);
+	Move(as, SLOTS, R9);
+
+	Load(as, RCX, RDI, offsetof(JitCode, offsets));
+	Load32(as, RCX, RCX, 0);
+	Load(as, RDX, RDI, offsetof(JitCode, code));
+	Add(as, RDX, RCX);
+	JumpReg(as, RDX);
+}
+
+static void CompileCall(Assembler* as, int argCount, uint8_t* ip)
+{
+	SlowPath slow = { 0 };
+	Load(as, RAX, STACK_TOP, -(argCount + 1) * (int32_t)sizeof(Value));
+	ObjectOfType(as, RAX, OBJ_CLOSURE, &slow);
+	EnterClosure(as, argCount, ip, &slow);
+
+	PatchSlowPath(as, &slow);
+	MovImm(as, RDI, argCount);
+	MovImm(as, RSI, (uint64_t)(uintptr_t)ip);
+	CallTransferHelper(as, JitCall);
+}
+
+//A method the cache already has for the receiver's shape is called without looking anything up
+static void CompileInvoke(Assembler* as, Chunk* chunk, uint8_t* operands, uint8_t* ip)
+{
+	SlowPath slow = { 0 };
+	int argCount = operands[1];
+	InlineCache* cache = &chunk->caches[(operands[2] << 8) | operands[3]];
+	Load(as, RAX, STACK_TOP, -(argCount + 1) * (int32_t)sizeof(Value));
+	ObjectOfType(as, RAX, OBJ_INSTANCE, &slow);
+	CacheGuard(as, cache, &slow);
+	Load32(as, RDX, RCX, offsetof(InlineCache, epoch));
+	MovImm(as, RSI, (uint64_t)(uintptr_t)&vm.methodEpoch);
+	Load32(as, RSI, RSI, 0);
+	Cmp(as, RDX, RSI);
+	Guard(as, &slow, CC_NE);
+	LoadSigned32(as, RDX, RCX, offsetof(InlineCache, entries[0].slot));
+	Test(as, RDX, RDX);
+	Guard(as, &slow, CC_NS);
+	Load(as, RAX, RCX, offsetof(InlineCache, entries[0].target));
+	EnterClosure(as, argCount, ip, &slow);
+
+	PatchSlowPath(as, &slow);
+	MovObject(as, RDI, AS_OBJ(chunk->constants.values[operands[0]]));
+	MovImm(as, RSI, argCount);
+	MovImm(as, RDX, (uint64_t)(uintptr_t)cache);
+	MovImm(as, RCX, (uint64_t)(uintptr_t)ip);
+	CallTransferHelper(as, JitInvoke);
+}
+
+//Pops the frame the way PopFrame does and carries on in the caller's compiled code. Open upvalues to close, the script
+//returning, a caller that isn't compiled or a compaction waiting for its safepoint take the slow path
+static void CompileReturn(Assembler* as)
+{
+	SlowPath slow = { 0 };
+	MovImm(as, RCX, (uint64_t)(uintptr_t)&vm.openUpvalues);
+	Load(as, RCX, RCX, 0);
+	Test(as, RCX, RCX);
+	int closed = JumpForward(as, CC_E);
+	Load(as, RCX, RCX, offsetof(ObjUpvalue, location));
+	Cmp(as, RCX, SLOTS);
+	Guard(as, &slow, CC_AE);
+	PatchHere(as, closed);
+	MovImm(as, RCX, (uint64_t)(uintptr_t)&vm.compactPending);
+	LoadByte(as, RCX, RCX, 0);
+	Test(as, RCX, RCX);
+	Guard(as, &slow, CC_NE);
+
+	MovImm(as, R8, (uint64_t)(uintptr_t)&vm.frameCount);
+	Load32(as, RDX, R8, 0);
+	MovImm(as, RCX, 1);
+	Cmp(as, RDX, RCX);
+	Guard(as, &slow, CC_BE);
+	Move(as, RSI, FRAME);
+	AddImm(as, RSI, -(int32_t)sizeof(CallFrame));
+	Load(as, RDI, RSI, offsetof(CallFrame, closure));
+	Load(as, RDI, RDI, offsetof(ObjClosure, function));
+	Load(as, R9, RDI, offsetof(ObjFunction, jit));
+	Test(as, R9, R9);
+	Guard(as, &slow, CC_E);
+
+	Load(as, RAX, STACK_TOP, -(int32_t)sizeof(Value));
+	AddImm(as, RDX, -1);
+	Store32(as, R8, 0, RDX);
+	Move(as, STACK_TOP, SLOTS);
+	PushValue(as, RAX);
+	Move(as, FRAME, RSI);
+	Load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+
+	//The caller resumes at jit->offsets[ip - code]
+	Load(as, RCX, FRAME, offsetof(CallFrame, ip));
+	Load(as, RDX, RDI, offsetof(ObjFunction, chunk.code));
+	Sub(as, RCX, RDX);
+	ShiftLeft(as, RCX, 2);
+	Load(as, RDX, R9, offsetof(JitCode, offsets));
+	Add(as, RCX, RDX);
+	Load32(as, RCX, RCX, 0);
+	Load(as, RDX, R9, offsetof(JitCode, code));
+	Add(as, RDX, RCX);
+	JumpReg(as, RDX);
+
+	PatchSlowPath(as, &slow);
+	Move(as, RDI, FRAME);
+	CallTransferHelper(as, JitReturn);
+}
+
+//A field the cache already has for the receiver's shape is read straight out of its slot
+static void GetField(Assembler* as, InlineCache* cache, SlowPath* slow)
+{
+	Load(as, RAX, STACK_TOP, -(int32_t)sizeof(Value));
+	ObjectOfType(as, RAX, OBJ_INSTANCE, slow);
+	CacheGuard(as, cache, slow);
+	LoadSigned32(as, RDX, RCX, offsetof(InlineCache, entries[0].slot));
+	Test(as, RDX, RDX);
+	Guard(as, slow, CC_S);
+	Load(as, RSI, RAX, offsetof(ObjInstance, slots));
+	ShiftLeft(as, RDX, 3);
+	Add(as, RSI, RDX);
+	Load(as, RAX, RSI, 0);
+	Store(as, STACK_TOP, -(int32_t)sizeof(Value), RAX);
+}
+
+//Overwrites a field the cache already has. Storing an object needs the write barrier, and while the marker thread
+//runs so does any store, so those take the slow path
+static void SetField(Assembler* as, InlineCache* cache, SlowPath* slow)
+{
+	Load(as, R8, STACK_TOP, -(int32_t)sizeof(Value));
+	MovImm(as, RCX, QNAN | SIGN_BIT);
+	Move(as, RDX, R8);
+	And(as, RDX, RCX);
+	Cmp(as, RDX, RCX);
+	Guard(as, slow, CC_E);
+#ifdef GC_THREAD_AVAILABLE
+	MovImm(as, RCX, (uint64_t)(uintptr_t)&vm.gcMarking);
+	LoadByte(as, RCX, RCX, 0);
+	Test(as, RCX, RCX);
+	Guard(as, slow, CC_NE);
+#endif //GC_THREAD_AVAILABLE
+
+	Load(as, RAX, STACK_TOP, -2 * (int32_t)sizeof(Value));
+	ObjectOfType(as, RAX, OBJ_INSTANCE, slow);
+	CacheGuard(as, cache, slow);
+	Load(as, RDX, RCX, offsetof(InlineCache, entries[0].target));
+	Test(as, RDX, RDX);
+	Guard(as, slow, CC_NE);
+	LoadSigned32(as, RDX, RCX, offsetof(InlineCache, entries[0].slot));
+	Test(as, RDX, RDX);
+	Guard(as, slow, CC_S);
+	Load(as, RSI, RAX, offsetof(ObjInstance, slots));
+	ShiftLeft(as, RDX, 3);
+	Add(as, RSI, RDX);
+	Store(as, RSI, 0, R8);
+	AddImm(as, STACK_TOP, -(int32_t)sizeof(Value));
+	Store(as, STACK_TOP, -(int32_t)sizeof(Value), R8);
+}
+
+static void CompileProperty(Assembler* as, Chunk* chunk, int offset, uint8_t* operands, uint8_t* ip)
+{
+	SlowPath slow = { 0 };
+	bool isSet = chunk->code[offset] == OP_SET_PROPERTY;
+	InlineCache* cache = &chunk->caches[(operands[1] << 8) | operands[2]];
+	if (isSet)
+	{
+		SetField(as, cache, &slow);
+	}
+	else
+	{
+		GetField(as, cache, &slow);
+	}
+	int done = JumpForward(as, CC_ALWAYS);
+
+	PatchSlowPath(as, &slow);
+	MovObject(as, RDI, AS_OBJ(chunk->constants.values[operands[0]]));
+	MovImm(as, RSI, (uint64_t)(uintptr_t)cache);
+	MovImm(as, RDX, (uint64_t)(uintptr_t)ip);
+	CallHelper(as, isSet ? (void*)JitSetProperty : (void*)JitGetProperty);
+	PatchHere(as, done);
+}
+
+static void* InvokeHelper(uint8_t instruction)
+{
+	switch (instruction)
+	{
+	case OP_SUPER_INVOKE:	return (void*)JitSuperInvoke;
+	case OP_TAIL_INVOKE:	return (void*)JitTailInvoke;
+	default:				return (void*)JitTailSuperInvoke;
+	}
+}
+
+static void CompileInstruction(Assembler* as, Chunk* chunk, int offset, int length)
+{
+	uint8_t* operands = chunk->code + offset + 1;
+	uint8_t* ip = chunk->code + offset + length;
+#define constant (chunk->constants.values[operands[0]])
+#define operandShort ((uint16_t)((operands[0] << 8) | operands[1]))
+
+	switch (chunk->code[offset])
+	{
+	case OP_CONSTANT:	PushConstant(as, constant); break;
+	case OP_NIL:		PushConstant(as, NIL_VAL); break;
+	case OP_TRUE:		PushConstant(as, TRUE_VAL); break;
+	case OP_FALSE:		PushConstant(as, FALSE_VAL); break;
+	case OP_POP:		AddImm(as, STACK_TOP, -(int32_t)sizeof(Value)); break;
+	case OP_POPN:		AddImm(as, STACK_TOP, -operands[0] * (int32_t)sizeof(Value)); break;
+	case OP_GET_LOCAL_0:
+	case OP_GET_LOCAL_1:
+	case OP_GET_LOCAL_2:
+	case OP_GET_LOCAL_3:
+		Load(as, RAX, SLOTS, (chunk->code[offset] - OP_GET_LOCAL_0) * (int32_t)sizeof(Value));
+		PushValue(as, RAX);
+		break;
+	case OP_GET_LOCAL:
+		Load(as, RAX, SLOTS, operands[0] * (int32_t)sizeof(Value));
+		PushValue(as, RAX);
+		break;
+	case OP_SET_LOCAL:
+		Load(as, RAX, STACK_TOP, -(int32_t)sizeof(Value));
+		Store(as, SLOTS, operands[0] * (int32_t)sizeof(Value), RAX);
+		break;
+	case OP_SET_LOCAL_POP:
+		PopValue(as, RAX);
+		Store(as, SLOTS, operands[0] * (int32_t)sizeof(Value), RAX);
+		break;
+	case OP_GET_GLOBAL:
+		LoadGlobal(as, operandShort, ip);
+		PushValue(as, RAX);
+		break;
+	case OP_SET_GLOBAL:
+		LoadGlobal(as, operandShort, ip);
+		Load(as, RAX, STACK_TOP, -(int32_t)sizeof(Value));
+		Store(as, RDX, 0, RAX);
+		break;
+	case OP_DEFINE_GLOBAL:
+		MovImm(as, RDX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+		Load(as, RDX, RDX, 0);
+		PopValue(as, RAX);
+		Store(as, RDX, operandShort * (int32_t)sizeof(Value), RAX);
+		break;
+	case OP_GET_UPVALUE:
+		LoadUpvalue(as, operands[0]);
+		Load(as, RAX, RDX, 0);
+		PushValue(as, RAX);
+		break;
+	case OP_SET_UPVALUE:
+	{
+#ifdef GC_THREAD_AVAILABLE
+		//While the marker thread runs the upvalue is scanned before it changes, see SnapshotBarrier
+		MovImm(as, RCX, (uint64_t)(uintptr_t)&vm.gcMarking);
+		Load(as, RCX, RCX, 0);
+		MovImm(as, RDX, 0xFF); //The flag is only the low byte of the load
+		And(as, RCX, RDX);
+		int notMarking = JumpForward(as, CC_E);
+		Move(as, RDI, FRAME);
+		MovImm(as, RSI, operands[0]);
+		CallHelper(as, JitUpvalueSnapshot);
+		PatchHere(as, notMarking);
+#endif //GC_THREAD_AVAILABLE
+
+		LoadUpvalue(as, operands[0]);
+		Load(as, RAX, STACK_TOP, -(int32_t)sizeof(Value));
+		Store(as, RDX, 0, RAX);
+
+		//Only storing an object can need the write barrier
+		MovImm(as, RCX, QNAN | SIGN_BIT);
+		And(as, RCX, RAX);
+		MovImm(as, RDX, QNAN | SIGN_BIT);
+		Cmp(as, RCX, RDX);
+		int notObject = JumpForward(as, CC_NE);
+		Move(as, RDI, FRAME);
+		MovImm(as, RSI, operands[0]);
+		CallHelper(as, JitUpvalueBarrier);
+		PatchHere(as, notObject);
+		break;
+	}
+	case OP_GET_PROPERTY:
+	case OP_GET_FIELD:
+	case OP_GET_METHOD:
+	case OP_SET_PROPERTY:
+		CompileProperty(as, chunk, offset, operands, ip);
+		break;
+	case OP_GET_SUPER:
+		MovObject(as, RDI, AS_OBJ(constant));
+		MovImm(as, RSI, (uint64_t)(uintptr_t)ip);
+		CallHelper(as, JitGetSuper);
+		break;
+	case OP_EQUAL:
+	case OP_NOT_EQUAL:
+		MovImm(as, RDI, chunk->code[offset] == OP_NOT_EQUAL);
+		CallHelper(as, JitEqual);
+		break;
+	case OP_GREATER:		StackComparison(as, false, CC_A, ip); break;
+	case OP_LESS:			StackComparison(as, true, CC_A, ip); break;
+	case OP_GREATER_EQUAL:	StackComparison(as, true, CC_BE, ip); break;
+	case OP_LESS_EQUAL:		StackComparison(as, false, CC_BE, ip); break;
+	case OP_ADD:
+	case OP_ADD_NUMBER:
+	case OP_ADD_STRING:		StackArithmetic(as, SSE_ADD, ip); break;
+	case OP_SUBTRACT:		StackArithmetic(as, SSE_SUBTRACT, ip); break;
+	case OP_MULTIPLY:		StackArithmetic(as, SSE_MULTIPLY, ip); break;
+	case OP_DIVIDE:			StackArithmetic(as, SSE_DIVIDE, ip); break;
+	case OP_ADD_CONSTANT:
+		PushConstant(as, constant);
+		StackArithmetic(as, SSE_ADD, ip);
+		break;
+	case OP_SUBTRACT_CONSTANT:
+		PushConstant(as, constant);
+		StackArithmetic(as, SSE_SUBTRACT, ip);
+		break;
+	case OP_LESS_CONSTANT:
+		PushConstant(as, constant);
+		StackComparison(as, true, CC_A, ip);
+		break;
+	case OP_ADD_LOCALS:
+		Load(as, RAX, SLOTS, operands[0] * (int32_t)sizeof(Value));
+		PushValue(as, RAX);
+		Load(as, RAX, SLOTS, operands[1] * (int32_t)sizeof(Value));
+		PushValue(as, RAX);
+		StackArithmetic(as, SSE_ADD, ip);
+		break;
+	case OP_NOT:		Not(as); break;
+	case OP_NEGATE:		Negate(as, ip); break;
+	case OP_PRINT:		CallHelper(as, JitPrint); break;
+	case OP_JUMP:		JumpTo(as, CC_ALWAYS, offset + length + operandShort); break;
+	case OP_LOOP:
+	case OP_TRACE_LOOP:	JumpTo(as, CC_ALWAYS, offset + length - operandShort); break;
+	case OP_JUMP_IF_FALSE:		JumpIfFalse(as, false, offset + length + operandShort); break;
+	case OP_JUMP_IF_FALSE_POP:	JumpIfFalse(as, true, offset + length + operandShort); break;
+	case OP_CALL:		CompileCall(as, operands[0], ip); break;
+	case OP_TAIL_CALL:
+		MovImm(as, RDI, operands[0]);
+		MovImm(as, RSI, (uint64_t)(uintptr_t)ip);
+		CallTransferHelper(as, JitTailCall);
+		break;
+	case OP_INVOKE:		CompileInvoke(as, chunk, operands, ip); break;
+	case OP_SUPER_INVOKE:
+	case OP_TAIL_INVOKE:
+	case OP_TAIL_SUPER_INVOKE:
+		MovObject(as, RDI, AS_OBJ(constant));
+		MovImm(as, RSI, operands[1]);
+		MovImm(as, RDX, (uint64_t)(uintptr_t)&chunk->caches[(operands[2] << 8) | operands[3]]);
+		MovImm(as, RCX, (uint64_t)(uintptr_t)ip);
+		CallTransferHelper(as, InvokeHelper(chunk->code[offset]));
+		break;
+	case OP_CLOSURE:
+		Move(as, RDI, FRAME);
+		MovImm(as, RSI, (uint64_t)(uintptr_t)operands);
+		CallHelper(as, JitClosure);
+		break;
+	case OP_CLOSE_UPVAL:
+		CallHelper(as, JitCloseUpvalue);
+		break;
+	case OP_RETURN:		CompileReturn(as); break;
+	case OP_CLASS:
+	case OP_METHOD:
+		MovObject(as, RDI, AS_OBJ(constant));
+		CallHelper(as, chunk->code[offset] == OP_CLASS ? (void*)JitClass : (void*)JitMethod);
+		break;
+	case OP_INHERIT:
+		MovImm(as, RDI, (uint64_t)(uintptr_t)ip);
+		CallHelper(as, JitInherit);
+		break;
+	case OP_BUILD_STRING:
+		MovImm(as, RDI, operands[0]);
+		MovImm(as, RSI, (uint64_t)(uintptr_t)ip);
+		CallHelper(as, JitBuildString);
+		break;
+	case OP_COPY_LOCAL:
+		Load(as, RAX, SLOTS, operands[1] * (int32_t)sizeof(Value));
+		Store(as, SLOTS, operands[0] * (int32_t)sizeof(Value), RAX);
+		break;
+	case OP_STORE_CONSTANT:
+		MovValue(as, RAX, chunk->constants.values[operands[1]]);
+		Store(as, SLOTS, operands[0] * (int32_t)sizeof(Value), RAX);
+		break;
+	case OP_ADD_LL:			SlotArithmetic(as, chunk, SSE_ADD, false, operands, ip); break;
+	case OP_ADD_LK:			SlotArithmetic(as, chunk, SSE_ADD, true, operands, ip); break;
+	case OP_SUBTRACT_LL:	SlotArithmetic(as, chunk, SSE_SUBTRACT, false, operands, ip); break;
+	case OP_SUBTRACT_LK:	SlotArithmetic(as, chunk, SSE_SUBTRACT, true, operands, ip); break;
+	case OP_MULTIPLY_LL:	SlotArithmetic(as, chunk, SSE_MULTIPLY, false, operands, ip); break;
+	case OP_MULTIPLY_LK:	SlotArithmetic(as, chunk, SSE_MULTIPLY, true, operands, ip); break;
+	case OP_DIVIDE_LL:		SlotArithmetic(as, chunk, SSE_DIVIDE, false, operands, ip); break;
+	case OP_DIVIDE_LK:		SlotArithmetic(as, chunk, SSE_DIVIDE, true, operands, ip); break;
+	case OP_JUMP_IF_NOT_LESS_LL:
+	case OP_JUMP_IF_NOT_LESS_LK:
+	case OP_JUMP_IF_NOT_GREATER_LL:
+	case OP_JUMP_IF_NOT_GREATER_LK:
+	{
+		uint8_t op = chunk->code[offset];
+		bool isLess = op == OP_JUMP_IF_NOT_LESS_LL || op == OP_JUMP_IF_NOT_LESS_LK;
+		bool isConstant = op == OP_JUMP_IF_NOT_LESS_LK || op == OP_JUMP_IF_NOT_GREATER_LK;
+		uint16_t jump = (uint16_t)((operands[2] << 8) | operands[3]);
+		SlotBranch(as, chunk, isLess, isConstant, operands, offset + length + jump, ip);
+		break;
+	}
+	}
+
+#undef constant
+#undef operandShort
+}
+
+void JitCompile(ObjFunction* function)
+{
+	Chunk* chunk = &function->chunk;
+	Assembler as = { 0 };
+	as.offsets = (uint32_t*)GrowBuffer(NULL, sizeof(uint32_t) * ((size_t)chunk->count + 1));
+
+	Prologue(&as);
+	Byte(&as, 0xFF); //jmp rsi, to wherever the frame is resuming
+	Direct(&as, 4, RSI);
+	for (int offset = 0; offset < chunk->count;)
+	{
+		int length = InstructionLength(chunk, offset);
+		as.offsets[offset] = as.count;
+		CompileInstruction(&as, chunk, offset, length);
+		offset += length;
+	}
+
+	//Switches to the new top frame's code, or leaves with JIT_FRAME_CHANGED for runCompiled to sort out
+	int resumeOffset = as.count;
+	MovImm(&as, RAX, (uint64_t)(uintptr_t)ResumeFrame);
+	CallReg(&as, RAX);
+	Test(&as, RAX, RAX);
+	int leave = JumpForward(&as, CC_E);
+	Move(&as, FRAME, RAX);
+	Load(&as, SLOTS, FRAME, offsetof(CallFrame, slots));
+	Load(&as, STACK_TOP, STACK_TOP_ADDRESS, 0);
+	JumpReg(&as, RDX);
+	PatchHere(&as, leave);
+	MovImm(&as, RAX, JIT_FRAME_CHANGED);
+
+	int exitOffset = as.count;
+	Epilogue(&as);
+
+	for (int idx = 0; idx < as.fixupCount; idx++)
+	{
+		Fixup* fixup = &as.fixups[idx];
+		int target = fixup->target == EXIT_TARGET ? exitOffset : fixup->target == RESUME_TARGET ? resumeOffset : (int)as.offsets[fixup->target];
+		PatchJump(&as, fixup->patch, target);
+	}
+
+	free(as.fixups);
+
+	uint8_t* code = MakeExecutable(&as);
+	if (code == NULL)
+	{
+		free(as.offsets);
+		free(as.relocs);
+		return;
+	}
+
+	JitCode* jit = (JitCode*)GrowBuffer(NULL, sizeof(JitCode));
+	jit->code = code;
+	jit->size = as.count;
+	jit->offsets = as.offsets;
+	jit->relocs = as.relocs;
+	jit->relocCount = as.relocCount;
+	function->jit = jit;
+}
+
+JitStatus JitRun(CallFrame* frame)
+{
+	ObjFunction* function = frame->closure->function;
+	JitCode* jit = function->jit;
+	JitEntry entry = (JitEntry)(uintptr_t)jit->code;
+	return entry(frame, jit->code + jit->offsets[frame->ip - function->chunk.code]);
+}
+
+void FreeJitCode(JitCode* jit)
+{
+	FreeExecutable(jit->code, jit->size);
+	free(jit->offsets);
+	free(jit->relocs);
+	free(jit);
+}
+
+void RelocateFunction(ObjFunction* function)
+{
+	if (function->jit != NULL)
+	{
+		RelocateCode(function->jit->code, function->jit->size, function->jit->relocs, function->jit->relocCount);
+	}
+
+	for (Trace* trace = function->traces; trace != NULL; trace = trace->next)
+	{
+		RelocateCode(trace->code, trace->size, trace->relocs, trace->relocCount);
+	}
+}
+
+#endif //JIT_AVAILABLE
@@ -0,0 +1,67 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+
+#ifdef JIT_AVAILABLE
+#include "object.h"
+#include "vm.h"
+
+//How many calls a function gets in the interpreter before it's compiled
+#define JIT_CALL_THRESHOLD 1
+
+typedef enum
+{
+	JIT_CONTINUE,
+	JIT_FRAME_CHANGED,
+	JIT_FINISHED,
+	JIT_ERROR
+} JitStatus;
+
+typedef struct JitCode
+{
+	uint8_t* code;
+	size_t size;
+	uint32_t* offsets; //Bytecode offset -> native offset, so a frame can be resumed after a call
+	struct Reloc* relocs;
+	int relocCount;
+} JitCode;
+
+void JitCompile(ObjFunction* function);
+JitStatus JitRun(CallFrame* frame);
+void FreeJitCode(JitCode* jit);
+//Patches the objects a compaction moved into the function's compiled code and traces
+void RelocateFunction(ObjFunction* function);
+
+//Slow paths for compiled code, these live in vm.c next to the interpreter they share code with.
+//ip is always the bytecode just past the instruction, as the interpreter would have it
+JitStatus JitAdd(uint8_t* ip);
+JitStatus JitOperandsError(uint8_t* ip);
+JitStatus JitOperandError(uint8_t* ip);
+JitStatus JitUndefinedGlobal(int slot, uint8_t* ip);
+JitStatus JitEqual(bool negate);
+JitStatus JitPrint();
+JitStatus JitBuildString(int count, uint8_t* ip);
+JitStatus JitCall(int argCount, uint8_t* ip);
+JitStatus JitTailCall(int argCount, uint8_t* ip);
+JitStatus JitInvoke(ObjString* name, int argCount, InlineCache* cache, uint8_t* ip);
+JitStatus JitSuperInvoke(ObjString* name, int argCount, InlineCache* cache, uint8_t* ip);
+JitStatus JitTailInvoke(ObjString* name, int argCount, InlineCache* cache, uint8_t* ip);
+JitStatus JitTailSuperInvoke(ObjString* name, int argCount, InlineCache* cache, uint8_t* ip);
+JitStatus JitGetProperty(ObjString* name, InlineCache* cache, uint8_t* ip);
+JitStatus JitSetProperty(ObjString* name, InlineCache* cache, uint8_t* ip);
+JitStatus JitGetSuper(ObjString* name, uint8_t* ip);
+JitStatus JitClosure(CallFrame* frame, uint8_t* ip);
+JitStatus JitCloseUpvalue();
+JitStatus JitUpvalueBarrier(CallFrame* frame, int slot);
+#ifdef GC_THREAD_AVAILABLE
+JitStatus JitUpvalueSnapshot(CallFrame* frame, int slot);
+#endif //GC_THREAD_AVAILABLE
+JitStatus JitReturn(CallFrame* frame);
+JitStatus JitClass(ObjString* name);
+JitStatus JitInherit(uint8_t* ip);
+JitStatus JitMethod(ObjString* name);
+
+#endif //JIT_AVAILABLE
+
+#endif
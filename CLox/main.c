@@ -65,23 +65,83 @@ static void RunFile(const char* path)
 	if (result == INTERPRET_RUNTIME_ERROR) { exit(70); }
 }
 
+static void Usage()
+{
+	fprintf_s(stderr, "Usage: clox [--jit] [--trace] [--max-frames=N] [--gc-pause=N] [--gc-thread] [--gc-compact] [path]\n");
+	exit(64);
+}
+
 int main(int argc, char** argv)
 {
 	InitVM();
 
-	if (argc == 1)
+	int arg = 1;
+	for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++)
+	{
+		if (strcmp(argv[arg], "--jit") == 0)
+		{
+#ifdef JIT_AVAILABLE
+			vm.jitEnabled = true;
+#else
+			fprintf_s(stderr, "The JIT isn't available on this platform, interpreting instead.\n");
+#endif //JIT_AVAILABLE
+		}
+		else if (strcmp(argv[arg], "--trace") == 0)
+		{
+#ifdef JIT_AVAILABLE
+			vm.tracingEnabled = true;
+#else
+			fprintf_s(stderr, "The tracing JIT isn't available on this platform, interpreting instead.\n");
+#endif //JIT_AVAILABLE
+		}
+		else if (strncmp(argv[arg], "--max-frames=", 13) == 0)
+		{
+			int maxFrames = atoi(argv[arg] + 13);
+			if (maxFrames < 1)
+			{
+				Usage();
+			}
+			vm.maxFrames = maxFrames;
+		}
+		else if (strncmp(argv[arg], "--gc-pause=", 11) == 0)
+		{
+			int gcPause = atoi(argv[arg] + 11);
+			if (gcPause < 0)
+			{
+				Usage();
+			}
+			vm.gcPause = gcPause;
+		}
+		else if (strcmp(argv[arg], "--gc-thread") == 0)
+		{
+#ifdef GC_THREAD_AVAILABLE
+			vm.gcThread = true;
+#else
+			fprintf_s(stderr, "Background marking and sweeping aren't available on this platform, collecting inline instead.\n");
+#endif //GC_THREAD_AVAILABLE
+		}
+		else if (strcmp(argv[arg], "--gc-compact") == 0)
+		{
+			vm.gcCompact = true;
+		}
+		else
+		{
+			Usage();
+		}
+	}
+
+	if (argc == arg)
 	{
 		Repl();
 	}
-	else if (argc == 2)
+	else if (argc == arg + 1)
 	{
-		RunFile(argv[1]);
+		RunFile(argv[arg]);
 
 	}
 	else
 	{
-		fprintf_s(stderr, "Usage: clox [path]\n");
-		exit(64);
+		Usage();
 	}
 
 	FreeVM();
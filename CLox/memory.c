@@ -1,7 +1,11 @@
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
+#include "trace.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
@@ -9,26 +13,229 @@
 #include "debug.h"
 #endif //DEBUG_LOC_GC
 
+#ifdef GC_THREAD_AVAILABLE
+#include <stdatomic.h>
+#include <threads.h>
+#endif //GC_THREAD_AVAILABLE
+
 #define GC_HEAP_GROW_FACTOR 2
+#define NURSERY_SIZE (256 * 1024) //Bytes allocated between minor collections
+#define GC_SLICE_BYTES (64 * 1024) //Bytes allocated between incremental slices
+#define GC_SLICE_CHECK 32 //Objects or pages handled between looks at the clock
+#define MARKER_HANDOFF 1024 //Queued objects worth handing back to the marker rather than scanning in the final pause
+#define COMPACT_FRACTION 4 //Pages less than this fraction full are emptied by a compaction
 
-void* Reallocate(void* pointer, size_t oldSize, size_t newSize)
+//Freed cells are kept on a list per size class, for survivors copied out of the nursery and objects moved by compaction
+#define SIZE_CLASSES (CELL_MAX / CELL_GRANULE)
+#define SIZE_CLASS(size) (((size) + CELL_GRANULE - 1) / CELL_GRANULE - 1)
+#define PAGE_HEADER ((sizeof(Page) + CELL_GRANULE - 1) / CELL_GRANULE * CELL_GRANULE)
+#define PAGES_PER_BLOCK 16 //malloc has no portable way to align, so pages are carved from bigger blocks
+
+//With --gc-thread every full cycle marks on a thread of its own
+#ifdef GC_THREAD_AVAILABLE
+#define MARKS_CONCURRENTLY() (vm.gcThread)
+#else
+#define MARKS_CONCURRENTLY() false
+#endif //GC_THREAD_AVAILABLE
+
+typedef struct Cell
+{
+	struct Cell* next;
+	int sizeClass; //So a walk over the page can step over it, and a nursery page's holes know their free list
+} Cell;
+
+typedef struct Block
+{
+	struct Block* next;
+	int pageCount;
+	int freePages; //How many of its pages are in freePages
+} Block;
+
+static Block* blocks = NULL;
+static Page* freePages = NULL;
+static Page* pages = NULL; //Every page that's been given to the nursery
+static Cell* freeCells[SIZE_CLASSES];
+
+//The nursery's bump region. nurseryPages are the pages only young objects have been put on since the last minor
+//collection and spareNursery the empty ones it kept. The bump page stays the bump page even once it's retired
+static Page* nurseryPages = NULL;
+static Page* spareNursery = NULL;
+static int spareCount = 0;
+static bool nurseryCopyDue = false; //The nursery is full and waiting for a safepoint to be copied out, see CopyNursery
+static bool compactDue = false; //A full collection has finished with --gc-compact, see CompactPages
+static Page* promotionPage = NULL; //Where survivors are copied when there's no free cell for them, see CopyNursery
+static Page* bumpPage = NULL;
+static char* bumpNext = NULL;
+static char* bumpEnd = NULL;
+
+//The steps of a release, in order, see ReleaseEmptyPages
+typedef enum
+{
+	RELEASE_RESET,
+	RELEASE_COUNT,
+	RELEASE_UNLINK,
+	RELEASE_PAGES,
+	RELEASE_BLOCKS
+} ReleaseStep;
+
+static ReleaseStep releaseStep;
+static int releaseClass; //The size class whose free list is being counted or unlinked
+static Page* resetCursor;
+static Cell* countCursor;
+static Cell** unlinkLink;
+static Page** pageLink;
+static Block** blockLink;
+
+static void StartCycle();
+static void StartRelease();
+static void CollectSlice(int pause);
+static bool MarkerBusy(size_t overshoot);
+
+#ifdef GC_THREAD_AVAILABLE
+static void StartMarking();
+
+//The marker's own queue, handed over from vm.greyStack when it starts. The mutator queues what its scans find on
+//vm.greyStack meanwhile, and only touches the marker's state while no marker is running, bar markDone
+static thread_local bool onMarker = false;
+static thrd_t marker;
+static bool markerRunning = false;
+static atomic_bool markDone;
+static Obj** markStack = NULL;
+static int markCount = 0;
+static int markCapacity = 0;
+
+//The sweeper's state is only touched by the mutator while no sweeper is running, bar sweepDone
+static thread_local bool onSweeper = false;
+static thrd_t sweeper;
+static bool sweeping = false;
+static atomic_bool sweepDone;
+static Page* sweepPages; //The pages as they were when the sweeper started, any made since go on in front
+static Obj* sweepList;
+static Obj* sweepTail;
+static size_t sweptBytes;
+static Cell* sweptCells[SIZE_CLASSES]; //Cells the sweeper freed, handed to freeCells when it's joined
+static Cell* sweptTails[SIZE_CLASSES];
+static bool releasePending = false; //The sweeper was joined after its cycle ended, so that cycle's release is still to run
+#endif //GC_THREAD_AVAILABLE
+
+//A cycle owns the mark bits and the nursery until its sweep of the old pages starts
+static bool NurseryCollectable()
+{
+	return vm.gcPhase == GC_IDLE || vm.gcPhase == GC_SWEEP;
+}
+
+//Survivors are only copied at a safepoint, where nothing outside the roots can be holding a young object
+static void RequestNurseryCopy()
+{
+	if (NurseryCollectable())
+	{
+		nurseryCopyDue = true;
+		vm.compactPending = true;
+	}
+}
+
+//Counts the change in size and runs whatever collection is due
+static void Account(size_t oldSize, size_t newSize)
 {
 	vm.bytesAllocated += newSize - oldSize;
 #ifdef DEBUG_LOG_GC
 	printf_s("Total bytes allocated %zu\n", vm.bytesAllocated);
 #endif //#ifdef DEBUG_LOG_GC
 
+	//Only collect when growing, frees happen during the sweep itself
 	if (newSize > oldSize)
 	{
+		vm.nurseryBytes += newSize - oldSize;
+
 #ifdef DEBUG_STRESS_GC
-		CollectGarbage();
+		//Mostly minor collections, since a full one would cover up a missing write barrier
+		static int stressCount = 0;
+		static int minorCount = 0;
+		if (vm.gcPause > 0)
+		{
+			if (vm.gcPhase == GC_IDLE && !MARKS_CONCURRENTLY())
+			{
+				StartCycle();
+			}
+
+			if (!MarkerBusy(1))
+			{
+				CollectSlice(vm.gcPause);
+			}
+		}
+		else if (++stressCount % 64 == 0)
+		{
+			CollectGarbage();
+		}
+
+		//Copied at every safepoint, and now and then promoted where they are as though none had come
+		if (++minorCount % 16 == 0)
+		{
+			CollectNursery();
+		}
+		RequestNurseryCopy();
 #endif //DEBUG_STRESS_GC
+
+		if (vm.gcPhase != GC_IDLE)
+		{
+			vm.sliceBytes += newSize - oldSize;
+			if (vm.sliceBytes > GC_SLICE_BYTES)
+			{
+				vm.sliceBytes = 0;
+
+				//A mutator that's outrunning the slices gets longer ones, in step with how far past the threshold it has grown
+				size_t overshoot = vm.bytesAllocated / (vm.nextGC > 0 ? vm.nextGC : 1);
+				if (!MarkerBusy(overshoot))
+				{
+					CollectSlice(vm.gcPause * (int)(overshoot > 1 ? overshoot : 1));
+				}
+			}
+		}
+		//With the marker thread a cycle starts as an object is allocated instead, see AllocateCell
+		else if (vm.bytesAllocated > vm.nextGC && !MARKS_CONCURRENTLY())
+		{
+			if (vm.gcPause > 0)
+			{
+				StartCycle();
+			}
+			else
+			{
+				CollectGarbage();
+			}
+		}
+#ifdef GC_THREAD_AVAILABLE
+		else if (releasePending)
+		{
+			StartRelease();
+		}
+#endif //GC_THREAD_AVAILABLE
+
+		//A safepoint is usually a few instructions away. One that's slow to come, in a compiled loop or a long native,
+		//gets a collection that promotes the survivors where they are instead, so the nursery can't grow without bound
+		if (vm.nurseryBytes > NURSERY_SIZE * 2)
+		{
+			CollectNursery();
+		}
+		else if (vm.nurseryBytes > NURSERY_SIZE)
+		{
+			RequestNurseryCopy();
+		}
 	}
+}
 
-	if (vm.bytesAllocated > vm.nextGC)
+void* Reallocate(void* pointer, size_t oldSize, size_t newSize)
+{
+#ifdef GC_THREAD_AVAILABLE
+	//The sweeper only ever frees, and keeps its own count so vm.bytesAllocated stays the mutator's
+	if (onSweeper)
 	{
-		CollectGarbage();
+		sweptBytes += oldSize;
+		free(pointer);
+		return NULL;
 	}
+#endif //GC_THREAD_AVAILABLE
+
+	Account(oldSize, newSize);
 
 	if (newSize == 0)
 	{
@@ -46,6 +253,325 @@ void* Reallocate(void* pointer, size_t oldSize, size_t newSize)
 	return result;
 }
 
+static Page* BlockPage(Block* block, int idx)
+{
+	uintptr_t first = ((uintptr_t)((char*)block + sizeof(Block)) + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+	return (Page*)(first + (uintptr_t)idx * PAGE_SIZE);
+}
+
+static void PushFreePage(Page* page)
+{
+	page->previous = NULL;
+	page->next = freePages;
+	if (freePages != NULL)
+	{
+		freePages->previous = page;
+	}
+	freePages = page;
+}
+
+static void UnlinkFreePage(Page* page)
+{
+	if (page->previous != NULL)
+	{
+		page->previous->next = page->next;
+	}
+	else
+	{
+		freePages = page->next;
+	}
+
+	if (page->next != NULL)
+	{
+		page->next->previous = page->previous;
+	}
+}
+
+static Page* NewPage()
+{
+	if (freePages == NULL)
+	{
+		char* raw = (char*)malloc(sizeof(Block) + (size_t)(PAGES_PER_BLOCK + 1) * PAGE_SIZE);
+		if (raw == NULL)
+		{
+			exit(1);
+		}
+
+		Block* block = (Block*)raw;
+		block->next = blocks;
+		block->pageCount = PAGES_PER_BLOCK;
+		block->freePages = PAGES_PER_BLOCK;
+		blocks = block;
+
+		for (int idx = PAGES_PER_BLOCK - 1; idx >= 0; idx--)
+		{
+			Page* page = BlockPage(block, idx);
+			page->block = block;
+			PushFreePage(page);
+		}
+	}
+
+	Page* page = freePages;
+	UnlinkFreePage(page);
+	page->block->freePages--;
+	page->inNursery = true;
+	page->used = 0;
+	page->youngBytes = 0;
+	page->holes = NULL;
+	page->freeBytes = 0;
+	page->evacuating = false;
+	page->inSweep = false;
+	memset((void*)page->marks, 0, sizeof(page->marks));
+	page->next = pages;
+	pages = page;
+	return page;
+}
+
+//Moves the bump pointer onto an empty page, one a minor collection kept if there is one
+static void NextNurseryPage()
+{
+	if (bumpPage != NULL)
+	{
+		bumpPage->used = (int)(bumpNext - ((char*)bumpPage + PAGE_HEADER));
+	}
+
+	Page* page = spareNursery;
+	if (page != NULL)
+	{
+		spareNursery = page->nurseryNext;
+		spareCount--;
+	}
+	else
+	{
+		page = NewPage();
+	}
+
+	page->nurseryNext = nurseryPages;
+	nurseryPages = page;
+	bumpPage = page;
+	bumpNext = (char*)page + PAGE_HEADER;
+	bumpEnd = (char*)page + PAGE_SIZE;
+}
+
+void* AllocateCell(size_t size)
+{
+#ifdef GC_THREAD_AVAILABLE
+	//Nothing is part way through a change while an object is allocated, so it's where the marker thread can start.
+	//A table or array being regrown could be read half done
+#ifdef DEBUG_STRESS_GC
+	if (vm.gcThread && vm.gcPhase == GC_IDLE)
+#else
+	if (vm.gcThread && vm.gcPhase == GC_IDLE && vm.bytesAllocated > vm.nextGC)
+#endif //DEBUG_STRESS_GC
+	{
+		StartMarking();
+	}
+#endif //GC_THREAD_AVAILABLE
+
+	if (size > CELL_MAX)
+	{
+		char* raw = (char*)Reallocate(NULL, 0, size + CELL_GRANULE);
+		STORE_MARK(((LargeHeader*)raw)->mark, 0);
+		return raw + CELL_GRANULE;
+	}
+
+	//Collect first, a minor collection can empty the page the cell would have been bumped from
+	Account(0, size);
+
+	//Young objects only ever go on nursery pages, so a minor collection can empty them all and no sweep of the old pages
+	//comes across one. Free cells are for the survivors, see CopyNursery
+	int sizeClass = SIZE_CLASS(size);
+	size_t cellSize = (size_t)(sizeClass + 1) * CELL_GRANULE;
+	if ((size_t)(bumpEnd - bumpNext) < cellSize)
+	{
+		NextNurseryPage();
+	}
+
+	void* result = bumpNext;
+	bumpNext += cellSize;
+	bumpPage->youngBytes += (int)cellSize;
+	return result;
+}
+
+void FreeCell(void* pointer, size_t size)
+{
+	if (size > CELL_MAX)
+	{
+		Reallocate((char*)pointer - CELL_GRANULE, size + CELL_GRANULE, 0);
+		return;
+	}
+
+	int sizeClass = SIZE_CLASS(size);
+	Cell* cell = (Cell*)pointer;
+	cell->sizeClass = sizeClass;
+	STORE_MARK(PAGE_OF(cell)->marks[CELL_INDEX(cell)], MARK_FREE);
+
+#ifdef GC_THREAD_AVAILABLE
+	if (onSweeper)
+	{
+		sweptBytes += size;
+		cell->next = sweptCells[sizeClass];
+		sweptCells[sizeClass] = cell;
+		if (sweptTails[sizeClass] == NULL)
+		{
+			sweptTails[sizeClass] = cell;
+		}
+		return;
+	}
+#endif //GC_THREAD_AVAILABLE
+
+	vm.bytesAllocated -= size;
+	Page* page = PAGE_OF(cell);
+	if (page->inNursery)
+	{
+		page->youngBytes -= (sizeClass + 1) * CELL_GRANULE;
+		cell->next = page->holes;
+		page->holes = cell;
+		return;
+	}
+
+	cell->next = freeCells[sizeClass];
+	freeCells[sizeClass] = cell;
+}
+
+//Runs once every young object has been freed or promoted, or with retireAll once the young objects have been handed
+//to a cycle's sweep. A nursery page with nothing left on it is emptied for the bump pointer to use again, pages beyond
+//what a minor collection needs are left to the next release. A page with survivors is retired to the old heap, its holes
+//join the free lists, and the bump pointer moves off it so the next young object still goes on a nursery page
+static void RecycleNursery(bool retireAll)
+{
+	Page* page = nurseryPages;
+	nurseryPages = NULL;
+	while (page != NULL)
+	{
+		Page* next = page->nurseryNext;
+		if (retireAll || page->youngBytes > 0)
+		{
+			page->inNursery = false;
+			while (page->holes != NULL)
+			{
+				Cell* hole = page->holes;
+				page->holes = hole->next;
+				hole->next = freeCells[hole->sizeClass];
+				freeCells[hole->sizeClass] = hole;
+			}
+		}
+		else
+		{
+			page->holes = NULL;
+			memset((void*)page->marks, 0, sizeof(page->marks));
+			if (page == bumpPage)
+			{
+				bumpNext = (char*)page + PAGE_HEADER;
+				page->nurseryNext = nurseryPages;
+				nurseryPages = page;
+			}
+			else if (spareCount < NURSERY_SIZE / PAGE_SIZE)
+			{
+				page->used = 0;
+				page->nurseryNext = spareNursery;
+				spareNursery = page;
+				spareCount++;
+			}
+			else
+			{
+				page->inNursery = false;
+				page->used = 0;
+			}
+		}
+
+		page = next;
+	}
+
+	if (bumpPage != NULL && !bumpPage->inNursery)
+	{
+		NextNurseryPage();
+	}
+}
+
+//Only cells on the free lists are counted, so a page is empty once they cover everything bumped on it
+static bool PageIsEmpty(Page* page)
+{
+	return !page->inNursery && page != bumpPage && page->freeBytes == page->used;
+}
+
+//Objects stay where they are unless compacted, so memory is only given back by finding pages with nothing left on them.
+//Those go back to the page pool, and blocks whose pages are all unused go back to malloc. A release runs as the last
+//phase of a cycle, a step at a time: reset the counts, count the free cells per page, drop the cells on empty pages from
+//the free lists, hand the empty pages back, then free the empty blocks. Minor collections, the only other users of the
+//free lists, wait until it's done, so the counts can't change under it
+static void StartRelease()
+{
+	promotionPage = NULL;
+	vm.gcPhase = GC_RELEASE;
+	releaseStep = RELEASE_RESET;
+	resetCursor = pages;
+#ifdef GC_THREAD_AVAILABLE
+	releasePending = false;
+#endif //GC_THREAD_AVAILABLE
+}
+
+//For collections that aren't incremental, the whole release in one go
+static void ReleaseEmptyPages()
+{
+	StartRelease();
+	CollectSlice(0);
+}
+
+//What the object's cell was allocated for
+static size_t ObjectSize(Obj* object)
+{
+	switch (object->type)
+	{
+	case OBJ_BOUND_METHOD:	return sizeof(ObjBoundMethod);
+	case OBJ_CLASS:			return sizeof(ObjClass);
+	case OBJ_CLOSURE:		return sizeof(ObjClosure) + sizeof(ObjUpvalue*) * ((ObjClosure*)object)->upvalueCount;
+	case OBJ_FUNCTION:		return sizeof(ObjFunction);
+	case OBJ_INSTANCE:		return sizeof(ObjInstance);
+	case OBJ_NATIVE:		return sizeof(ObjNative);
+	case OBJ_ROPE:			return sizeof(ObjRope);
+	case OBJ_SHAPE:			return sizeof(ObjShape);
+	case OBJ_SLICE:			return sizeof(ObjSlice);
+	case OBJ_STRING:		return sizeof(ObjString) + (size_t)((ObjString*)object)->length + 1;
+	case OBJ_UPVALUE:		return sizeof(ObjUpvalue);
+	}
+
+	return 0;
+}
+
+//A page's cells run from its header to wherever bumping stopped, which on the bump page is still moving
+static char* FirstCell(Page* page)
+{
+	return (char*)page + PAGE_HEADER;
+}
+
+static char* PageEnd(Page* page)
+{
+	return page == bumpPage ? bumpNext : (char*)page + PAGE_HEADER + page->used;
+}
+
+static bool IsFreeCell(char* cell)
+{
+	return LOAD_MARK(PAGE_OF(cell)->marks[CELL_INDEX(cell)]) == MARK_FREE;
+}
+
+//Steps over a cell, whose size is in its header if it's an object or kept in the cell once it's been freed
+static char* NextCell(char* cell)
+{
+	int sizeClass = IsFreeCell(cell) ? ((Cell*)cell)->sizeClass : (int)SIZE_CLASS(ObjectSize((Obj*)cell));
+	return cell + (sizeClass + 1) * CELL_GRANULE;
+}
+
+//Every object goes back to white, freed cells stay free
+static void ClearMarks(Page* page)
+{
+	uint8_t* marks = (uint8_t*)page->marks;
+	for (int idx = 0; idx < PAGE_CELLS; idx++)
+	{
+		marks[idx] = marks[idx] == MARK_FREE ? MARK_FREE : MARK_WHITE;
+	}
+}
+
 void FreeObject(Obj* object)
 {
 #ifdef DEBUG_LOG_GC
@@ -55,51 +581,131 @@ void FreeObject(Obj* object)
 	switch (object->type)
 	{
 	case OBJ_BOUND_METHOD:
-		FREE(ObjBoundMethod, object);
+		FREE_OBJ(ObjBoundMethod, object);
 		break;
 	case OBJ_CLASS:
 	{
 		ObjClass* klass = (ObjClass*)object;
 		FreeTable(&klass->methods);
-		FREE(ObjClass, object);
+		FREE_OBJ(ObjClass, object);
 		break;
 	}
 	case OBJ_INSTANCE:
 		ObjInstance* instance = (ObjInstance*)object;
+		FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
 		FreeTable(&instance->fields);
-		FREE(ObjInstance, object);
+		FREE_OBJ(ObjInstance, object);
 		break;
 	case OBJ_CLOSURE:
 		ObjClosure* closure = (ObjClosure*)object;
-		FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-		FREE(ObjClosure, object);
+		FreeCell(object, sizeof(ObjClosure) + sizeof(ObjUpvalue*) * closure->upvalueCount);
 		break;
 	case OBJ_FUNCTION:
 	{
 		ObjFunction* function = (ObjFunction*)object;
+#ifdef JIT_AVAILABLE
+		if (function->jit != NULL)
+		{
+			FreeJitCode(function->jit);
+		}
+
+		FreeTraces(function->traces);
+#endif //JIT_AVAILABLE
 		FreeChunk(&function->chunk);
-		FREE(ObjFunction, object);
+		FREE_OBJ(ObjFunction, object);
 		break;
 	}
 	case OBJ_NATIVE:
-		FREE(ObjNative, object);
+		FREE_OBJ(ObjNative, object);
+		break;
+	case OBJ_ROPE:
+		FREE_OBJ(ObjRope, object);
 		break;
+	case OBJ_SLICE:
+		FREE_OBJ(ObjSlice, object);
+		break;
+	case OBJ_SHAPE:
+	{
+		ObjShape* shape = (ObjShape*)object;
+		FreeTable(&shape->transitions);
+		FREE_OBJ(ObjShape, object);
+		break;
+	}
 	case OBJ_UPVALUE:
-		FREE(ObjUpvalue, object);
+		FREE_OBJ(ObjUpvalue, object);
 		break;
 	case OBJ_STRING:
 	{
 		ObjString* string = (ObjString*)object;
-		FREE_ARRAY(char, string->chars, string->length + 1);
-		FREE(ObjString, object);
+		FreeCell(object, sizeof(ObjString) + (size_t)string->length + 1);
 		break;
 	}
 	}
 }
 
+static void PushOnto(Obj*** stack, int* count, int* capacity, Obj* object)
+{
+	if (*capacity < *count + 1)
+	{
+		*capacity = GROW_CAPACITY(*capacity);
+		*stack = (Obj**)realloc(*stack, sizeof(Obj*) * *capacity);
+
+		if (*stack == NULL)
+		{
+			exit(1);
+		}
+	}
+
+	(*stack)[(*count)++] = object;
+}
+
+static void PushGrey(Obj* object)
+{
+#ifdef GC_THREAD_AVAILABLE
+	if (onMarker)
+	{
+		PushOnto(&markStack, &markCount, &markCapacity, object);
+		return;
+	}
+#endif //GC_THREAD_AVAILABLE
+
+	PushOnto(&vm.greyStack, &vm.greyCount, &vm.greyCapacity, object);
+}
+
+static void SetMark(Obj* object, MarkState state)
+{
+	if (object->isLarge)
+	{
+		STORE_MARK(LARGE_HEADER(object)->mark, vm.markEpoch + state);
+	}
+	else
+	{
+		STORE_MARK(PAGE_OF(object)->marks[CELL_INDEX(object)], state);
+	}
+}
+
+#ifdef GC_THREAD_AVAILABLE
+//Moves the mark from one state to the next, false if the other thread got there first
+static bool ClaimMark(Obj* object, MarkState from, MarkState to)
+{
+	if (object->isLarge)
+	{
+		MarkWord* mark = &LARGE_HEADER(object)->mark;
+		unsigned int expected = atomic_load_explicit(mark, memory_order_acquire);
+		MarkState state = expected - (expected % MARK_EPOCH_STEP) == vm.markEpoch ? (MarkState)(expected % MARK_EPOCH_STEP) : MARK_WHITE;
+		return state == from && atomic_compare_exchange_strong_explicit(mark, &expected, vm.markEpoch + to,
+			memory_order_acq_rel, memory_order_acquire);
+	}
+
+	unsigned char expected = (unsigned char)from;
+	return atomic_compare_exchange_strong_explicit(&PAGE_OF(object)->marks[CELL_INDEX(object)], &expected, (unsigned char)to,
+		memory_order_acq_rel, memory_order_acquire);
+}
+#endif //GC_THREAD_AVAILABLE
+
 void MarkObject(Obj* object)
 {
-	if (object == NULL || object->isMarked)
+	if (object == NULL || IsMarked(object))
 	{
 		return;
 	}
@@ -110,20 +716,43 @@ void MarkObject(Obj* object)
 	printf_s("\n");
 #endif //DEBUG_LOG_GC
 
-	object->isMarked = true;
+#ifdef GC_THREAD_AVAILABLE
+	//The marker and the mutator can reach the same object at once, only one of them queues it
+	if (vm.gcMarking)
+	{
+		if (ClaimMark(object, MARK_WHITE, MARK_GREY))
+		{
+			PushGrey(object);
+		}
+		return;
+	}
+#endif //GC_THREAD_AVAILABLE
+
+	SetMark(object, MARK_GREY);
+	PushGrey(object);
+}
+
+void RememberObject(Obj* object)
+{
+	if (!IsMarked(object) || object->isRemembered)
+	{
+		return;
+	}
 
-	if (vm.greyCapacity < vm.greyCount + 1)
+	object->isRemembered = true;
+
+	if (vm.rememberedCapacity < vm.rememberedCount + 1)
 	{
-		vm.greyCapacity = GROW_CAPACITY(vm.greyCapacity);
-		vm.greyStack = (Obj**)realloc(vm.greyStack, sizeof(Obj*) * vm.greyCapacity);
+		vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+		vm.remembered = (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
 
-		if (vm.greyStack == NULL)
+		if (vm.remembered == NULL)
 		{
 			exit(1);
 		}
 	}
 
-	vm.greyStack[vm.greyCount++] = object;
+	vm.remembered[vm.rememberedCount++] = object;
 }
 
 void MarkValue(Value value)
@@ -163,6 +792,7 @@ static void BlackenObject(Obj* object)
 	{
 		ObjClass* klass = (ObjClass*)object;
 		MarkObject((Obj*)klass->name);
+		MarkObject((Obj*)klass->rootShape);
 		MarkTable(&klass->methods);
 		break;
 	}
@@ -170,9 +800,26 @@ static void BlackenObject(Obj* object)
 	{
 		ObjInstance* instance = (ObjInstance*)object;
 		MarkObject((Obj*)instance->klass);
+		if (instance->shape != NULL)
+		{
+			MarkObject((Obj*)instance->shape);
+			for (int idx = 0; idx < instance->shape->slotCount; idx++)
+			{
+				MarkValue(instance->slots[idx]);
+			}
+		}
+
 		MarkTable(&instance->fields);
 		break;
 	}
+	case OBJ_SHAPE:
+	{
+		ObjShape* shape = (ObjShape*)object;
+		MarkObject((Obj*)shape->parent);
+		MarkObject((Obj*)shape->key);
+		MarkTable(&shape->transitions);
+		break;
+	}
 	case OBJ_CLOSURE:
 	{
 		ObjClosure* closure = (ObjClosure*)object;
@@ -187,10 +834,30 @@ static void BlackenObject(Obj* object)
 		ObjFunction* function = (ObjFunction*)object;
 		MarkObject((Obj*)function->name);
 		MarkArray(&function->chunk.constants);
-		break;
+		for (int idx = 0; idx < function->chunk.cacheCount; idx++)
+		{
+			InlineCache* cache = &function->chunk.caches[idx];
+			for (int entry = 0; entry < cache->count; entry++)
+			{
+				MarkObject(cache->entries[entry].key);
+				MarkObject(cache->entries[entry].target);
+			}
+		}
+		break;
 	case OBJ_UPVALUE:
 		MarkValue(((ObjUpvalue*)object)->closed);
 		break;
+	case OBJ_ROPE:
+	{
+		ObjRope* rope = (ObjRope*)object;
+		MarkObject(rope->left);
+		MarkObject(rope->right);
+		MarkObject((Obj*)rope->flat);
+		break;
+	}
+	case OBJ_SLICE:
+		MarkObject((Obj*)((ObjSlice*)object)->parent);
+		break;
 	case OBJ_NATIVE:
 	case OBJ_STRING:
 		break;
@@ -214,9 +881,16 @@ static void MarkRoots()
 		MarkObject((Obj*)upval);
 	}
 
-	MarkTable(&vm.globals);
+	MarkArray(&vm.globalValues);
+	MarkArray(&vm.globalNames);
+	MarkTable(&vm.globalSlots);
 	MarkCompilerRoots();
 	MarkObject((Obj*)vm.initString);
+
+	for (int idx = 0; idx < vm.handleCount; idx++)
+	{
+		MarkValue(vm.handles[idx]);
+	}
 }
 
 static void TraceReferences()
@@ -228,15 +902,62 @@ static void TraceReferences()
 	}
 }
 
-static void Sweep()
+//Scans a queued object, unless the other thread has claimed it since
+static void ScanGrey(Obj* object)
+{
+#ifdef GC_THREAD_AVAILABLE
+	if (vm.gcMarking)
+	{
+		if (ClaimMark(object, MARK_GREY, MARK_SCANNING))
+		{
+			BlackenObject(object);
+			SetMark(object, MARK_BLACK);
+		}
+		return;
+	}
+#endif //GC_THREAD_AVAILABLE
+
+	BlackenObject(object);
+}
+
+//Every young object has been freed or promoted by now and the nursery pages hold only new ones, so it's the old pages
+//that are walked. Nothing new goes on one until the sweep is done, not even a survivor, see EvacuationCell
+static void StartPageSweep()
+{
+	promotionPage = NULL;
+	for (Page* page = pages; page != NULL; page = page->next)
+	{
+		page->inSweep = !page->inNursery;
+	}
+}
+
+//A cell on an old page is either an object or free, so a white mark is all it takes to know an object is garbage.
+//The walk goes through the page in order instead of chasing a list from one page to the next
+static void SweepPage(Page* page)
+{
+	char* end = (char*)page + PAGE_HEADER + page->used;
+	for (char* cell = FirstCell(page); cell < end;)
+	{
+		MarkState mark = (MarkState)LOAD_MARK(page->marks[CELL_INDEX(cell)]);
+		int sizeClass = mark == MARK_FREE ? ((Cell*)cell)->sizeClass : (int)SIZE_CLASS(ObjectSize((Obj*)cell));
+		if (mark == MARK_WHITE)
+		{
+			FreeObject((Obj*)cell);
+		}
+
+		cell += (sizeClass + 1) * CELL_GRANULE;
+	}
+}
+
+//Large objects have no page to be found on, so the old generation keeps a list of them
+static void SweepLarge()
 {
 	Obj* previous = NULL;
 	Obj* object = vm.objects;
 	while (object != NULL)
 	{
-		if (object->isMarked)
+		if (IsMarked(object))
 		{
-			object->isMarked = false;
 			previous = object;
 			object = object->next;
 		}
@@ -259,35 +980,1319 @@ static void Sweep()
 	}
 }
 
-void CollectGarbage()
+//Old objects that survive keep their mark, it's cleared again at the start of the next full collection
+static void Sweep()
+{
+	StartPageSweep();
+	for (Page* page = pages; page != NULL; page = page->next)
+	{
+		if (page->inSweep)
+		{
+			SweepPage(page);
+		}
+	}
+
+	SweepLarge();
+}
+
+//Young survivors are promoted where they are by keeping their mark, a small one is found on its page from then on
+static void SweepNursery()
+{
+	Obj* object = vm.nursery;
+	while (object != NULL)
+	{
+		Obj* next = object->next;
+		if (!IsMarked(object))
+		{
+			FreeObject(object);
+		}
+		else if (object->isLarge)
+		{
+			object->next = vm.objects;
+			vm.objects = object;
+		}
+
+		object = next;
+	}
+
+	vm.nursery = NULL;
+	vm.nurseryBytes = 0;
+	nurseryCopyDue = false;
+	RecycleNursery(false);
+}
+
+#ifdef GC_THREAD_AVAILABLE
+//Nothing on the old pages or the detached list is reachable unless it's marked, and the mutator only reads a marked
+//object's header, so the sweeper can free the rest and relink the survivors without any locking
+static int SweepThread(void* unused)
+{
+	(void)unused;
+	onSweeper = true;
+
+	for (Page* page = sweepPages; page != NULL; page = page->next)
+	{
+		if (page->inSweep)
+		{
+			SweepPage(page);
+		}
+	}
+
+	Obj* survivors = NULL;
+	Obj* tail = NULL;
+	Obj* object = sweepList;
+	while (object != NULL)
+	{
+		Obj* next = object->next;
+		if (IsMarked(object))
+		{
+			object->next = survivors;
+			survivors = object;
+			if (tail == NULL)
+			{
+				tail = object;
+			}
+		}
+		else
+		{
+			FreeObject(object);
+		}
+
+		object = next;
+	}
+
+	sweepList = survivors;
+	sweepTail = tail;
+	atomic_store(&sweepDone, true);
+	return 0;
+}
+
+//Hands the old pages and the large list to the sweeper, minor collections promote onto a fresh list in the meantime
+static void StartSweeper()
+{
+	StartPageSweep();
+	sweepPages = pages;
+	sweepList = vm.objects;
+	sweepTail = NULL;
+	sweptBytes = 0;
+	for (int sizeClass = 0; sizeClass < SIZE_CLASSES; sizeClass++)
+	{
+		sweptCells[sizeClass] = NULL;
+		sweptTails[sizeClass] = NULL;
+	}
+	atomic_store(&sweepDone, false);
+	vm.objects = NULL;
+
+	if (thrd_create(&sweeper, SweepThread, NULL) != thrd_success)
+	{
+		vm.objects = sweepList;
+		Sweep();
+		return;
+	}
+
+	sweeping = true;
+}
+
+//Splices the survivors back onto the old list, waiting for the sweeper if asked to
+static void JoinSweeper(bool wait)
+{
+	if (!sweeping || (!wait && !atomic_load(&sweepDone)))
+	{
+		return;
+	}
+
+	thrd_join(sweeper, NULL);
+	sweeping = false;
+
+	if (sweepTail != NULL)
+	{
+		sweepTail->next = vm.objects;
+		vm.objects = sweepList;
+	}
+
+	for (int sizeClass = 0; sizeClass < SIZE_CLASSES; sizeClass++)
+	{
+		if (sweptTails[sizeClass] != NULL)
+		{
+			sweptTails[sizeClass]->next = freeCells[sizeClass];
+			freeCells[sizeClass] = sweptCells[sizeClass];
+		}
+	}
+
+	vm.bytesAllocated -= sweptBytes;
+	vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+
+	//An incremental collector releases in slices, starting from the next allocation
+	if (vm.gcPause > 0)
+	{
+		releasePending = true;
+	}
+	else
+	{
+		ReleaseEmptyPages();
+	}
+}
+#endif //GC_THREAD_AVAILABLE
+
+//Only traces from the roots and the remembered old objects, every other old object is already marked and stops the trace.
+//Survivors are promoted where they are, which is only for when no safepoint has come to copy them, see CopyNursery
+void CollectNursery()
 {
 #ifdef DEBUG_LOG_GC
-	printf_s("-- gc begin\n");
+	printf_s("-- minor gc begin\n");
 	size_t before = vm.bytesAllocated;
 #endif //DEBUG_LOG_GC
 
+	if (!NurseryCollectable())
+	{
+		return;
+	}
+
+#ifdef GC_THREAD_AVAILABLE
+	JoinSweeper(false);
+#endif //GC_THREAD_AVAILABLE
+
 	MarkRoots();
+	for (int idx = 0; idx < vm.rememberedCount; idx++)
+	{
+		vm.remembered[idx]->isRemembered = false;
+		BlackenObject(vm.remembered[idx]);
+	}
+
+	vm.rememberedCount = 0;
 	TraceReferences();
 	TableRemoveWhite(&vm.strings);
-	Sweep();
-
-	vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+	SweepNursery();
 
 #ifdef DEBUG_LOG_GC
-	printf_s("-- gc end\n");
+	printf_s("-- minor gc end\n");
 	printf_s("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
 #endif //DEBUG_LOG_GC
 }
 
-void FreeObjects()
+//Incremental cycles run the same full collection in slices: clear the old marks, mark from the roots, drop the dead strings,
+//sweep the nursery, then sweep the old pages. The write barrier re-greys any black object that's handed a white one, and
+//marking only ends in a slice where marking the roots again finds nothing new.
+static void StartCycle()
 {
-	Obj* object = vm.objects;
-	while (object != NULL)
+#ifdef DEBUG_LOG_GC
+	printf_s("-- incremental gc begin\n");
+#endif //DEBUG_LOG_GC
+
+#ifdef GC_THREAD_AVAILABLE
+	JoinSweeper(true);
+#endif //GC_THREAD_AVAILABLE
+
+	vm.gcPhase = GC_CLEAR;
+	vm.clearCursor = pages;
+	vm.markEpoch += MARK_EPOCH_STEP;
+	vm.sliceBytes = 0;
+}
+
+static void ForgetRemembered()
+{
+	for (int idx = 0; idx < vm.rememberedCount; idx++)
 	{
-		Obj* next = object->next;
-		FreeObject(object);
-		object = next;
+		vm.remembered[idx]->isRemembered = false;
+	}
+
+	vm.rememberedCount = 0;
+}
+
+static void GreyRemembered()
+{
+	for (int idx = 0; idx < vm.rememberedCount; idx++)
+	{
+		vm.remembered[idx]->isRemembered = false;
+		PushGrey(vm.remembered[idx]);
+	}
+
+	vm.rememberedCount = 0;
+}
+
+#ifdef GC_THREAD_AVAILABLE
+static int MarkThread(void* unused)
+{
+	(void)unused;
+	onMarker = true;
+	while (markCount > 0)
+	{
+		ScanGrey(markStack[--markCount]);
+	}
+
+	atomic_store(&markDone, true);
+	return 0;
+}
+
+//Hands everything queued on vm.greyStack to the marker. If the thread can't be started it stays queued for this
+//thread to scan, which the final pause does anyway
+static void StartMarker()
+{
+	Obj** stack = markStack;
+	int capacity = markCapacity;
+	markStack = vm.greyStack;
+	markCount = vm.greyCount;
+	markCapacity = vm.greyCapacity;
+	vm.greyStack = stack;
+	vm.greyCount = 0;
+	vm.greyCapacity = capacity;
+	atomic_store(&markDone, false);
+
+	if (thrd_create(&marker, MarkThread, NULL) != thrd_success)
+	{
+		vm.greyStack = markStack;
+		vm.greyCount = markCount;
+		vm.greyCapacity = markCapacity;
+		markStack = stack;
+		markCount = 0;
+		markCapacity = capacity;
+		return;
+	}
+
+	markerRunning = true;
+}
+
+static void JoinMarker()
+{
+	if (!markerRunning)
+	{
+		return;
+	}
+
+	thrd_join(marker, NULL);
+	markerRunning = false;
+}
+
+//A snapshot at the beginning: the roots are marked in this pause, objects made from here on start black, and anything
+//changed before the marker scans it is scanned by SnapshotBarrier first. So whatever was reachable now ends up marked
+static void StartMarking()
+{
+#ifdef DEBUG_LOG_GC
+	printf_s("-- concurrent gc begin\n");
+#endif //DEBUG_LOG_GC
+
+	JoinSweeper(true);
+
+	for (Page* page = pages; page != NULL; page = page->next)
+	{
+		ClearMarks(page);
+	}
+
+	vm.markEpoch += MARK_EPOCH_STEP;
+	vm.sliceBytes = 0;
+	ForgetRemembered();
+	vm.gcPhase = GC_MARK;
+	vm.gcMarking = true;
+	MarkRoots();
+	StartMarker();
+}
+
+void ScanBeforeWrite(Obj* object)
+{
+	for (;;)
+	{
+		MarkState state = MarkOf(object);
+		if (state == MARK_BLACK)
+		{
+			return;
+		}
+
+		//The marker is part way through it, and one object doesn't take long
+		if (state == MARK_SCANNING)
+		{
+			thrd_yield();
+			continue;
+		}
+
+		if (ClaimMark(object, state, MARK_SCANNING))
+		{
+			break;
+		}
+	}
+
+	BlackenObject(object);
+	SetMark(object, MARK_BLACK);
+}
+#endif //GC_THREAD_AVAILABLE
+
+//The marker runs alongside the mutator until it's out of objects, or the heap has doubled while it ran. What the mutator's
+//own scans queued meanwhile goes back to it while there's plenty, so the final pause only has the remainder and the roots
+static bool MarkerBusy(size_t overshoot)
+{
+#ifdef GC_THREAD_AVAILABLE
+	if (!markerRunning || (!atomic_load(&markDone) && overshoot < 2))
+	{
+		return markerRunning;
+	}
+
+	JoinMarker();
+	if (vm.greyCount > MARKER_HANDOFF && overshoot < 2)
+	{
+		StartMarker();
+		return true;
+	}
+#endif //GC_THREAD_AVAILABLE
+
+	return false;
+}
+
+//vm.strings doesn't keep its strings alive, so one it hands out while the marker runs may be one marking has passed by
+void MarkInterned(Obj* object)
+{
+#ifdef GC_THREAD_AVAILABLE
+	if (vm.gcMarking)
+	{
+		MarkObject(object);
+	}
+#endif //GC_THREAD_AVAILABLE
+}
+
+//Anything allocated from here until the nursery sweep starts is marked as it's made, see MarkAllocation
+static void FinishMarking()
+{
+#ifdef GC_THREAD_AVAILABLE
+	vm.gcMarking = false;
+#endif //GC_THREAD_AVAILABLE
+	vm.gcPhase = GC_STRINGS;
+	vm.stringCursor = 0;
+	vm.stringCapacity = vm.strings.capacity;
+}
+
+static void StartNurserySweep()
+{
+	vm.gcPhase = GC_NURSERY;
+	vm.nurseryCursor = vm.nursery;
+	vm.nursery = NULL;
+	vm.nurseryBytes = 0;
+	nurseryCopyDue = false;
+	RecycleNursery(true);
+}
+
+static void StartSweep()
+{
+	vm.gcPhase = GC_SWEEP;
+	vm.sweepLink = &vm.objects;
+	vm.liveBytes = vm.bytesAllocated;
+
+#ifdef GC_THREAD_AVAILABLE
+	//Leaves the incremental sweep no pages and an empty list, so the cycle ends straight away
+	if (vm.gcThread)
+	{
+		StartSweeper();
+		vm.sweepCursor = NULL;
+		return;
+	}
+#endif //GC_THREAD_AVAILABLE
+
+	StartPageSweep();
+	vm.sweepCursor = pages;
+}
+
+//Every white object is garbage once marking has ended, so new ones start black until the nursery they're on is swept.
+//After that they're on a fresh one the cycle leaves alone, and stay white so a minor collection can tell they're young.
+//The marker thread never sees objects made after it started, so they start black while it runs too
+void MarkAllocation(Obj* object)
+{
+#ifdef GC_THREAD_AVAILABLE
+	if (vm.gcMarking)
+	{
+		SetMark(object, MARK_BLACK);
+		return;
+	}
+#endif //GC_THREAD_AVAILABLE
+
+	if (vm.gcPhase == GC_STRINGS)
+	{
+		SetMark(object, MARK_BLACK);
+	}
+}
+
+//Objects promoted while the sweep ran are left out of the next threshold, most of them are already garbage
+static void FinishCycle()
+{
+	vm.gcPhase = GC_IDLE;
+	vm.nextGC = vm.liveBytes * GC_HEAP_GROW_FACTOR;
+	compactDue = vm.gcCompact;
+	vm.compactPending = vm.compactPending || compactDue;
+
+#ifdef DEBUG_LOG_GC
+	printf_s("-- incremental gc end\n");
+	printf_s("   %zu bytes allocated, next at %zu\n", vm.bytesAllocated, vm.nextGC);
+#endif //DEBUG_LOG_GC
+
+#ifdef GC_THREAD_AVAILABLE
+	//A sweeper that's still running leaves the release until it's joined
+	if (sweeping)
+	{
+		return;
+	}
+#endif //GC_THREAD_AVAILABLE
+	StartRelease();
+}
+
+//Does up to pause microseconds of work, or runs the cycle to the end when pause is 0
+static void CollectSlice(int pause)
+{
+	clock_t deadline = clock() + (clock_t)((double)pause * CLOCKS_PER_SEC / 1000000);
+	int work = 0;
+
+#define OUT_OF_TIME() (pause > 0 && ++work % GC_SLICE_CHECK == 0 && clock() >= deadline)
+
+	if (vm.gcPhase == GC_CLEAR)
+	{
+		while (vm.clearCursor != NULL)
+		{
+			ClearMarks(vm.clearCursor);
+			vm.clearCursor = vm.clearCursor->next;
+
+			if (OUT_OF_TIME()) { return; }
+		}
+
+		ForgetRemembered();
+		vm.gcPhase = GC_MARK;
+		MarkRoots();
 	}
 
+	if (vm.gcPhase == GC_MARK)
+	{
+#ifdef GC_THREAD_AVAILABLE
+		//The final pause: what the mutator queued since the marker last started, then the roots again
+		JoinMarker();
+#endif //GC_THREAD_AVAILABLE
+
+		for (;;)
+		{
+			GreyRemembered();
+			while (vm.greyCount > 0)
+			{
+				ScanGrey(vm.greyStack[--vm.greyCount]);
+
+				if (OUT_OF_TIME()) { return; }
+			}
+
+			MarkRoots();
+			GreyRemembered();
+			if (vm.greyCount == 0) { break; }
+		}
+
+		FinishMarking();
+	}
+
+	if (vm.gcPhase == GC_STRINGS)
+	{
+		//Growing rehashes the table, which can move an entry behind the cursor
+		if (vm.strings.capacity != vm.stringCapacity)
+		{
+			vm.stringCursor = 0;
+			vm.stringCapacity = vm.strings.capacity;
+		}
+
+		while (vm.stringCursor < vm.strings.capacity)
+		{
+			Entry* entry = &vm.strings.entries[vm.stringCursor++];
+			if (entry->key != NULL && !IsMarked((Obj*)entry->key))
+			{
+				TableDelete(&vm.strings, entry->key);
+			}
+
+			if (OUT_OF_TIME()) { return; }
+		}
+
+		StartNurserySweep();
+	}
+
+	if (vm.gcPhase == GC_NURSERY)
+	{
+		while (vm.nurseryCursor != NULL)
+		{
+			Obj* object = vm.nurseryCursor;
+			vm.nurseryCursor = object->next;
+			if (!IsMarked(object))
+			{
+				FreeObject(object);
+			}
+			else if (object->isLarge)
+			{
+				object->next = vm.objects;
+				vm.objects = object;
+			}
+
+			if (OUT_OF_TIME()) { return; }
+		}
+
+		StartSweep();
+	}
+
+	if (vm.gcPhase == GC_SWEEP)
+	{
+		while (vm.sweepCursor != NULL)
+		{
+			Page* page = vm.sweepCursor;
+			vm.sweepCursor = page->next;
+			if (page->inSweep)
+			{
+				size_t before = vm.bytesAllocated;
+				SweepPage(page);
+				vm.liveBytes -= before - vm.bytesAllocated;
+			}
+
+			if (OUT_OF_TIME()) { return; }
+		}
+
+		while (*vm.sweepLink != NULL)
+		{
+			Obj* object = *vm.sweepLink;
+			if (IsMarked(object))
+			{
+				vm.sweepLink = &object->next;
+			}
+			else
+			{
+				size_t before = vm.bytesAllocated;
+				*vm.sweepLink = object->next;
+				FreeObject(object);
+				vm.liveBytes -= before - vm.bytesAllocated;
+			}
+
+			if (OUT_OF_TIME()) { return; }
+		}
+
+		FinishCycle();
+	}
+
+	if (vm.gcPhase == GC_RELEASE)
+	{
+		if (releaseStep == RELEASE_RESET)
+		{
+			while (resetCursor != NULL)
+			{
+				resetCursor->freeBytes = 0;
+				resetCursor = resetCursor->next;
+
+				if (OUT_OF_TIME()) { return; }
+			}
+
+			releaseStep = RELEASE_COUNT;
+			releaseClass = 0;
+			countCursor = freeCells[0];
+		}
+
+		if (releaseStep == RELEASE_COUNT)
+		{
+			while (releaseClass < SIZE_CLASSES)
+			{
+				if (countCursor == NULL)
+				{
+					if (++releaseClass < SIZE_CLASSES)
+					{
+						countCursor = freeCells[releaseClass];
+					}
+					continue;
+				}
+
+				PAGE_OF(countCursor)->freeBytes += (releaseClass + 1) * CELL_GRANULE;
+				countCursor = countCursor->next;
+
+				if (OUT_OF_TIME()) { return; }
+			}
+
+			releaseStep = RELEASE_UNLINK;
+			releaseClass = 0;
+			unlinkLink = &freeCells[0];
+		}
+
+		if (releaseStep == RELEASE_UNLINK)
+		{
+			while (releaseClass < SIZE_CLASSES)
+			{
+				if (*unlinkLink == NULL)
+				{
+					if (++releaseClass < SIZE_CLASSES)
+					{
+						unlinkLink = &freeCells[releaseClass];
+					}
+					continue;
+				}
+
+				if (PageIsEmpty(PAGE_OF(*unlinkLink)))
+				{
+					*unlinkLink = (*unlinkLink)->next;
+				}
+				else
+				{
+					unlinkLink = &(*unlinkLink)->next;
+				}
+
+				if (OUT_OF_TIME()) { return; }
+			}
+
+			releaseStep = RELEASE_PAGES;
+			pageLink = &pages;
+		}
+
+		//New pages only ever go on the front of the list, behind the cursor, and start with no free cells counted
+		if (releaseStep == RELEASE_PAGES)
+		{
+			while (*pageLink != NULL)
+			{
+				Page* page = *pageLink;
+				if (PageIsEmpty(page))
+				{
+					*pageLink = page->next;
+					PushFreePage(page);
+					page->block->freePages++;
+				}
+				else
+				{
+					pageLink = &page->next;
+				}
+
+				if (OUT_OF_TIME()) { return; }
+			}
+
+			releaseStep = RELEASE_BLOCKS;
+			blockLink = &blocks;
+		}
+
+		if (releaseStep == RELEASE_BLOCKS)
+		{
+			while (*blockLink != NULL)
+			{
+				Block* block = *blockLink;
+				if (block->freePages == block->pageCount)
+				{
+					*blockLink = block->next;
+					for (int idx = 0; idx < block->pageCount; idx++)
+					{
+						UnlinkFreePage(BlockPage(block, idx));
+					}
+					free(block);
+				}
+				else
+				{
+					blockLink = &block->next;
+				}
+
+				if (OUT_OF_TIME()) { return; }
+			}
+
+			vm.gcPhase = GC_IDLE;
+		}
+	}
+
+#undef OUT_OF_TIME
+}
+
+void CollectGarbage()
+{
+	//Finishing the running cycle is as good as a new collection, and cheaper
+	if (vm.gcPhase != GC_IDLE)
+	{
+		CollectSlice(0);
+		return;
+	}
+
+#ifdef GC_THREAD_AVAILABLE
+	JoinSweeper(true);
+#endif //GC_THREAD_AVAILABLE
+
+#ifdef DEBUG_LOG_GC
+	printf_s("-- gc begin\n");
+	size_t before = vm.bytesAllocated;
+#endif //DEBUG_LOG_GC
+
+	for (Page* page = pages; page != NULL; page = page->next)
+	{
+		ClearMarks(page);
+	}
+
+	vm.markEpoch += MARK_EPOCH_STEP;
+	ForgetRemembered();
+	MarkRoots();
+	TraceReferences();
+	TableRemoveWhite(&vm.strings);
+#ifdef GC_THREAD_AVAILABLE
+	if (vm.gcThread)
+	{
+		SweepNursery();
+		StartSweeper();
+	}
+	else
+	{
+		SweepNursery();
+		Sweep();
+		ReleaseEmptyPages();
+	}
+#else
+	SweepNursery();
+	Sweep();
+	ReleaseEmptyPages();
+#endif //GC_THREAD_AVAILABLE
+
+	vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+	compactDue = vm.gcCompact;
+	vm.compactPending = vm.compactPending || compactDue;
+
+#ifdef DEBUG_LOG_GC
+	printf_s("-- gc end\n");
+	printf_s("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+#endif //DEBUG_LOG_GC
+}
+
+//A cell for an object being moved off an evacuating page or out of the nursery, from the free lists or else from fresh
+//pages of its own. Nothing is counted, the object is only changing places. The free cells are on pages a sweep could be
+//walking, so while one runs only a fresh page will do
+static void* EvacuationCell(size_t size, Page** target)
+{
+	bool listsBusy = vm.gcPhase == GC_SWEEP;
+#ifdef GC_THREAD_AVAILABLE
+	listsBusy = listsBusy || sweeping;
+#endif //GC_THREAD_AVAILABLE
+
+	int sizeClass = SIZE_CLASS(size);
+	Cell* cell = freeCells[sizeClass];
+	if (cell != NULL && !listsBusy)
+	{
+		freeCells[sizeClass] = cell->next;
+		return cell;
+	}
+
+	int cellSize = (sizeClass + 1) * CELL_GRANULE;
+	if (*target == NULL || PAGE_SIZE - (int)PAGE_HEADER - (*target)->used < cellSize)
+	{
+		*target = NewPage();
+		(*target)->inNursery = false;
+	}
+
+	void* result = (char*)*target + PAGE_HEADER + (*target)->used;
+	(*target)->used += cellSize;
+	return result;
+}
+
+static Obj* Forward(Obj* object)
+{
+	return object != NULL && object->isForwarded ? object->next : object;
+}
+
+#define FORWARD(pointer) ((pointer) = (void*)Forward((Obj*)(pointer)))
+
+//The copy keeps the mark, and the original's next becomes the forwarding address
+static Obj* MoveObject(Obj* object, Page** target)
+{
+	size_t size = ObjectSize(object);
+	Obj* copy = (Obj*)EvacuationCell(size, target);
+	memcpy(copy, object, size);
+	STORE_MARK(PAGE_OF(copy)->marks[CELL_INDEX(copy)], LOAD_MARK(PAGE_OF(object)->marks[CELL_INDEX(object)]));
+	if (object->type == OBJ_UPVALUE && ((ObjUpvalue*)object)->location == &((ObjUpvalue*)object)->closed)
+	{
+		((ObjUpvalue*)copy)->location = &((ObjUpvalue*)copy)->closed;
+	}
+
+	object->isForwarded = true;
+	object->next = copy;
+	return copy;
+}
+
+static void ForwardValue(Value* value)
+{
+	if (IS_OBJ(*value))
+	{
+		*value = OBJ_VAL(Forward(AS_OBJ(*value)));
+	}
+}
+
+static void ForwardArray(ValueArray* array)
+{
+	for (int idx = 0; idx < array->count; idx++)
+	{
+		ForwardValue(&array->values[idx]);
+	}
+}
+
+//Keys keep their hash when they move, so each entry stays where it is
+static void ForwardTable(Table* table)
+{
+	for (int idx = 0; idx < table->capacity; idx++)
+	{
+		FORWARD(table->entries[idx].key);
+		ForwardValue(&table->entries[idx].value);
+	}
+}
+
+//The same references BlackenObject follows
+static void ForwardFields(Obj* object)
+{
+	switch (object->type)
+	{
+	case OBJ_BOUND_METHOD:
+	{
+		ObjBoundMethod* bound = (ObjBoundMethod*)object;
+		ForwardValue(&bound->receiver);
+		FORWARD(bound->method);
+		break;
+	}
+	case OBJ_CLASS:
+	{
+		ObjClass* klass = (ObjClass*)object;
+		FORWARD(klass->name);
+		FORWARD(klass->rootShape);
+		ForwardTable(&klass->methods);
+		break;
+	}
+	case OBJ_INSTANCE:
+	{
+		ObjInstance* instance = (ObjInstance*)object;
+		FORWARD(instance->klass);
+		FORWARD(instance->shape);
+		if (instance->shape != NULL)
+		{
+			for (int idx = 0; idx < instance->shape->slotCount; idx++)
+			{
+				ForwardValue(&instance->slots[idx]);
+			}
+		}
+
+		ForwardTable(&instance->fields);
+		break;
+	}
+	case OBJ_SHAPE:
+	{
+		ObjShape* shape = (ObjShape*)object;
+		FORWARD(shape->parent);
+		FORWARD(shape->key);
+		ForwardTable(&shape->transitions);
+		break;
+	}
+	case OBJ_CLOSURE:
+	{
+		ObjClosure* closure = (ObjClosure*)object;
+		FORWARD(closure->function);
+		for (int idx = 0; idx < closure->upvalueCount; idx++)
+		{
+			FORWARD(closure->upvalues[idx]);
+		}
+		break;
+	}
+	case OBJ_FUNCTION:
+	{
+		ObjFunction* function = (ObjFunction*)object;
+		FORWARD(function->name);
+		ForwardArray(&function->chunk.constants);
+		for (int idx = 0; idx < function->chunk.cacheCount; idx++)
+		{
+			InlineCache* cache = &function->chunk.caches[idx];
+			for (int entry = 0; entry < cache->count; entry++)
+			{
+				FORWARD(cache->entries[entry].key);
+				FORWARD(cache->entries[entry].target);
+			}
+		}
+#ifdef JIT_AVAILABLE
+		RelocateFunction(function);
+#endif //JIT_AVAILABLE
+		break;
+	}
+	case OBJ_UPVALUE:
+	{
+		ObjUpvalue* upvalue = (ObjUpvalue*)object;
+		ForwardValue(&upvalue->closed);
+		FORWARD(upvalue->next);
+		break;
+	}
+	case OBJ_ROPE:
+	{
+		ObjRope* rope = (ObjRope*)object;
+		FORWARD(rope->left);
+		FORWARD(rope->right);
+		FORWARD(rope->flat);
+		break;
+	}
+	case OBJ_SLICE:
+		FORWARD(((ObjSlice*)object)->parent);
+		break;
+	case OBJ_NATIVE:
+	case OBJ_STRING:
+		break;
+	}
+}
+
+static void ForwardRoots()
+{
+	for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
+	{
+		ForwardValue(slot);
+	}
+
+	for (int idx = 0; idx < vm.frameCount; idx++)
+	{
+		FORWARD(vm.frames[idx].closure);
+	}
+
+	FORWARD(vm.openUpvalues);
+	ForwardArray(&vm.globalValues);
+	ForwardArray(&vm.globalNames);
+	ForwardTable(&vm.globalSlots);
+	ForwardTable(&vm.strings);
+	FORWARD(vm.initString);
+
+	for (int idx = 0; idx < vm.handleCount; idx++)
+	{
+		ForwardValue(&vm.handles[idx]);
+	}
+}
+
+//The minor collection proper. Survivors are copied into old cells, leaving a forwarding address behind, so every nursery
+//page comes back empty instead of being retired with a few survivors scattered over it. Only the roots, the remembered
+//objects and the young objects themselves can refer to a young object, so they're all that has to be pointed at the
+//copies. A large survivor has no page to leave and is promoted where it is
+static void CopyNursery()
+{
+	nurseryCopyDue = false;
+	if (!NurseryCollectable())
+	{
+		return;
+	}
+
+#ifdef DEBUG_LOG_GC
+	printf_s("-- minor gc begin\n");
+	size_t before = vm.bytesAllocated;
+#endif //DEBUG_LOG_GC
+
+#ifdef GC_THREAD_AVAILABLE
+	JoinSweeper(false);
+#endif //GC_THREAD_AVAILABLE
+
+	MarkRoots();
+	for (int idx = 0; idx < vm.rememberedCount; idx++)
+	{
+		BlackenObject(vm.remembered[idx]);
+	}
+
+	TraceReferences();
+	TableRemoveWhite(&vm.strings);
+
+	//The copies are chained through their next, which an old object on a page has no use for
+	Obj* copies = NULL;
+	Obj* unreached = NULL;
+	Obj* large = vm.objects;
+	Obj* object = vm.nursery;
+	while (object != NULL)
+	{
+		Obj* next = object->next;
+		if (!IsMarked(object))
+		{
+			object->next = unreached;
+			unreached = object;
+		}
+		else if (object->isLarge)
+		{
+			object->next = vm.objects;
+			vm.objects = object;
+		}
+		else
+		{
+			Obj* copy = MoveObject(object, &promotionPage);
+			copy->next = copies;
+			copies = copy;
+			PAGE_OF(object)->youngBytes -= (SIZE_CLASS(ObjectSize(object)) + 1) * CELL_GRANULE;
+		}
+
+		object = next;
+	}
+
+	ForwardRoots();
+
+	//Open upvalues are linked to each other without a write barrier, the list is kept alive as a root instead
+	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = (ObjUpvalue*)upvalue->next)
+	{
+		FORWARD(upvalue->next);
+	}
+
+	for (int idx = 0; idx < vm.rememberedCount; idx++)
+	{
+		vm.remembered[idx]->isRemembered = false;
+		ForwardFields(vm.remembered[idx]);
+	}
+
+	vm.rememberedCount = 0;
+	for (Obj* copy = copies; copy != NULL; copy = copy->next)
+	{
+		ForwardFields(copy);
+	}
+
+	for (Obj* promoted = vm.objects; promoted != large; promoted = promoted->next)
+	{
+		ForwardFields(promoted);
+	}
+
+	while (unreached != NULL)
+	{
+		Obj* next = unreached->next;
+		FreeObject(unreached);
+		unreached = next;
+	}
+
+	vm.nursery = NULL;
+	vm.nurseryBytes = 0;
+	RecycleNursery(false);
+
+#ifdef DEBUG_LOG_GC
+	printf_s("-- minor gc end\n");
+	printf_s("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+#endif //DEBUG_LOG_GC
+}
+
+//Objects never move otherwise, so a page that's mostly empty after a full collection stays that way until everything
+//on it dies. With --gc-compact the next safepoint after one finishes moves what's left on the sparsest pages into cells
+//elsewhere, leaving a forwarding address behind, and hands those pages back. A minor collection first means every
+//object on a page is old and everything it refers to is still allocated. Then every reference is pointed at the copy:
+//the roots, every object's fields, the inline caches and the objects built into compiled code
+static void CompactPages()
+{
+#ifdef GC_THREAD_AVAILABLE
+	JoinSweeper(true);
+#endif //GC_THREAD_AVAILABLE
+
+	if (vm.gcPhase == GC_RELEASE)
+	{
+		CollectSlice(0);
+	}
+
+	//Another cycle has started already, the compaction waits for it to finish
+	if (vm.gcPhase != GC_IDLE)
+	{
+		vm.compactPending = true;
+		return;
+	}
+
+	compactDue = false;
+	CopyNursery();
+	promotionPage = NULL;
+
+	for (Page* page = pages; page != NULL; page = page->next)
+	{
+		page->liveBytes = 0;
+	}
+
+	//Every young object has just been freed or copied, so whatever isn't free on a page is live
+	for (Page* page = pages; page != NULL; page = page->next)
+	{
+		char* end = PageEnd(page);
+		for (char* cell = FirstCell(page); cell < end;)
+		{
+			char* next = NextCell(cell);
+			if (!IsFreeCell(cell))
+			{
+				page->liveBytes += (int)(next - cell);
+			}
+
+			cell = next;
+		}
+	}
+
+	int evacuating = 0;
+	for (Page* page = pages; page != NULL; page = page->next)
+	{
+#ifdef DEBUG_STRESS_GC
+		//Everything old moves, so a reference that isn't updated shows up straight away
+		page->evacuating = !page->inNursery && page->used > 0;
+#else
+		page->evacuating = !page->inNursery && page->used > 0 &&
+			page->liveBytes * COMPACT_FRACTION < page->used;
+#endif //DEBUG_STRESS_GC
+		evacuating += page->evacuating;
+	}
+
+	if (evacuating == 0)
+	{
+		return;
+	}
+
+#ifdef DEBUG_LOG_GC
+	printf_s("-- compact begin\n");
+	int moved = 0;
+#endif //DEBUG_LOG_GC
+
+	//Nothing may be moved onto a page that's being emptied
+	for (int sizeClass = 0; sizeClass < SIZE_CLASSES; sizeClass++)
+	{
+		Cell** link = &freeCells[sizeClass];
+		while (*link != NULL)
+		{
+			if (PAGE_OF(*link)->evacuating)
+			{
+				*link = (*link)->next;
+			}
+			else
+			{
+				link = &(*link)->next;
+			}
+		}
+	}
+
+	Page* target = NULL;
+	for (Page* page = pages; page != NULL; page = page->next)
+	{
+		if (!page->evacuating)
+		{
+			continue;
+		}
+
+		char* end = PageEnd(page);
+		for (char* cell = FirstCell(page); cell < end; cell = NextCell(cell))
+		{
+			if (IsFreeCell(cell))
+			{
+				continue;
+			}
+
+			MoveObject((Obj*)cell, &target);
+#ifdef DEBUG_LOG_GC
+			moved++;
+#endif //DEBUG_LOG_GC
+		}
+	}
+
+	//The copies are on the pages that stay, among the objects that never moved
+	ForwardRoots();
+	for (Page* page = pages; page != NULL; page = page->next)
+	{
+		if (page->evacuating)
+		{
+			continue;
+		}
+
+		char* end = PageEnd(page);
+		for (char* cell = FirstCell(page); cell < end; cell = NextCell(cell))
+		{
+			if (!IsFreeCell(cell))
+			{
+				ForwardFields((Obj*)cell);
+			}
+		}
+	}
+
+	for (Obj* object = vm.objects; object != NULL; object = object->next)
+	{
+		ForwardFields(object);
+	}
+
+	for (int idx = 0; idx < vm.rememberedCount; idx++)
+	{
+		FORWARD(vm.remembered[idx]);
+	}
+
+	for (Page** link = &pages; *link != NULL;)
+	{
+		Page* page = *link;
+		if (page->evacuating)
+		{
+			*link = page->next;
+			PushFreePage(page);
+			page->block->freePages++;
+		}
+		else
+		{
+			link = &page->next;
+		}
+	}
+
+	//Hands back the blocks that left empty, and any other empty pages while it's at it
+	ReleaseEmptyPages();
+
+#ifdef DEBUG_LOG_GC
+	printf_s("-- compact end\n");
+	printf_s("   moved %d objects off %d pages\n", moved, evacuating);
+#endif //DEBUG_LOG_GC
+}
+
+//Objects only move here, at a safepoint, where the interpreter holds nothing but what's in the roots and a native keeps
+//its objects in handles
+void Compact()
+{
+	vm.compactPending = false;
+	if (nurseryCopyDue)
+	{
+		CopyNursery();
+	}
+
+	if (compactDue)
+	{
+		CompactPages();
+	}
+}
+
+//Only the large objects on a list, the small ones are freed with their pages
+static void FreeLarge(Obj* object)
+{
+	while (object != NULL)
+	{
+		Obj* next = object->next;
+		if (object->isLarge)
+		{
+			FreeObject(object);
+		}
+
+		object = next;
+	}
+}
+
+void FreeObjects()
+{
+#ifdef GC_THREAD_AVAILABLE
+	JoinMarker();
+	free(markStack);
+	markStack = NULL;
+	markCount = 0;
+	markCapacity = 0;
+	vm.gcMarking = false;
+	JoinSweeper(true);
+#endif //GC_THREAD_AVAILABLE
+
+	FreeLarge(vm.objects);
+	FreeLarge(vm.nursery);
+	if (vm.gcPhase == GC_NURSERY)
+	{
+		FreeLarge(vm.nurseryCursor);
+	}
+
+	for (Page* page = pages; page != NULL; page = page->next)
+	{
+		char* end = PageEnd(page);
+		for (char* cell = FirstCell(page); cell < end;)
+		{
+			char* next = NextCell(cell);
+			if (!IsFreeCell(cell))
+			{
+				FreeObject((Obj*)cell);
+			}
+
+			cell = next;
+		}
+	}
+
+	while (blocks != NULL)
+	{
+		Block* next = blocks->next;
+		free(blocks);
+		blocks = next;
+	}
+
+	pages = NULL;
+	freePages = NULL;
+	nurseryPages = NULL;
+	spareNursery = NULL;
+	spareCount = 0;
+	bumpPage = NULL;
+	bumpNext = NULL;
+	bumpEnd = NULL;
+	promotionPage = NULL;
+	nurseryCopyDue = false;
+	compactDue = false;
+
+	for (int sizeClass = 0; sizeClass < SIZE_CLASSES; sizeClass++)
+	{
+		freeCells[sizeClass] = NULL;
+	}
 	free(vm.greyStack);
+	free(vm.remembered);
 }
\ No newline at end of file
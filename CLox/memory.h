@@ -2,12 +2,20 @@
 #define clox_memory_h
 
 #include "object.h"
+#include "vm.h"
+
+#ifdef GC_THREAD_AVAILABLE
+#include <stdatomic.h>
+#endif //GC_THREAD_AVAILABLE
 
 #define ALLOCATE(type, count) \
 	(type*)Reallocate(NULL, 0, sizeof(type) * (count))
 
 #define FREE(type, pointer) Reallocate(pointer, sizeof(type), 0)
 
+//Objects come from the size-classed cell heap rather than straight from realloc
+#define FREE_OBJ(type, pointer) FreeCell(pointer, sizeof(type))
+
 #define GROW_CAPACITY(capacity) \
 	((capacity) < 8 ? 8 : (capacity) * 2)
 
@@ -17,10 +25,121 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
 	Reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+//Objects up to CELL_MAX bytes live in cells carved from PAGE_SIZE aligned pages, one size class per CELL_GRANULE.
+//New objects are bump allocated through nursery pages, which hold cells of any size. Freed cells are reused by size class
+//for the survivors copied out of the nursery.
+//Mark bits live in the page rather than the object, a byte per cell so marking never writes into the heap itself
+#define CELL_GRANULE 16
+#define CELL_MAX 256
+#define PAGE_SIZE (64 * 1024)
+#define PAGE_CELLS (PAGE_SIZE / CELL_GRANULE)
+
+//Between collections any mark but MARK_WHITE means old. The steps between only matter while the marker thread runs,
+//where each object is scanned by whichever thread claims it first, see SnapshotBarrier
+typedef enum
+{
+	MARK_WHITE,
+	MARK_GREY, //Queued to be scanned
+	MARK_SCANNING, //Claimed by the thread reading its fields
+	MARK_BLACK,
+	MARK_FREE //Not an object at all but a freed cell, which a walk over the page steps over, see SweepPage
+} MarkState;
+
+//A large object's mark is the epoch it was last marked in plus its state, so epochs step over the state bits
+#define MARK_EPOCH_STEP 4
+
+//The marker thread reads and claims marks while the mutator allocates and scans, so with it built they're atomic
+#ifdef GC_THREAD_AVAILABLE
+typedef atomic_uchar MarkByte;
+typedef atomic_uint MarkWord;
+#define LOAD_MARK(mark) atomic_load_explicit(&(mark), memory_order_acquire)
+#define STORE_MARK(mark, state) atomic_store_explicit(&(mark), (state), memory_order_release)
+#else
+typedef uint8_t MarkByte;
+typedef uint32_t MarkWord;
+#define LOAD_MARK(mark) (mark)
+#define STORE_MARK(mark, state) ((mark) = (state))
+#endif //GC_THREAD_AVAILABLE
+
+typedef struct Page
+{
+	struct Page* next;
+	struct Page* previous; //Only kept while the page is unused, so a block's pages can leave the pool in any order
+	struct Block* block; //The allocation the page was carved from
+	struct Page* nurseryNext;
+	bool inNursery; //Only young objects have been put on it, see RecycleNursery
+	int used; //Bytes bump allocated, set once the nursery moves on from the page
+	int youngBytes; //What's still allocated on a nursery page
+	struct Cell* holes; //Cells freed on a nursery page, which only go on the free lists if it's retired
+	int freeBytes; //Only meaningful while a release runs, see ReleaseEmptyPages
+	int liveBytes; //Only meaningful while compacting, see Compact
+	bool evacuating; //Being emptied by a compaction
+	bool inSweep; //Old when the running sweep started, so the sweep walks it, see StartPageSweep
+	MarkByte marks[PAGE_CELLS]; //Indexed by cell, the entries that fall inside the header are unused
+} Page;
+
+//Bigger objects get a header of their own in front of them. Their mark holds the epoch they were last marked in,
+//so starting a full collection unmarks every one of them at once
+typedef struct
+{
+	MarkWord mark;
+} LargeHeader;
+
+#define PAGE_OF(object) ((Page*)((uintptr_t)(object) & ~(uintptr_t)(PAGE_SIZE - 1)))
+#define CELL_INDEX(object) (((uintptr_t)(object) & (PAGE_SIZE - 1)) / CELL_GRANULE)
+#define LARGE_HEADER(object) ((LargeHeader*)((char*)(object) - CELL_GRANULE))
+
 void* Reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* AllocateCell(size_t size);
+void FreeCell(void* pointer, size_t size);
 void MarkValue(Value value);
 void MarkObject(Obj* object);
+void RememberObject(Obj* object);
+void MarkAllocation(Obj* object);
+void MarkInterned(Obj* object);
+void ScanBeforeWrite(Obj* object);
+void CollectNursery();
 void CollectGarbage();
+void Compact();
 void FreeObjects();
 
+static inline MarkState MarkOf(Obj* object)
+{
+	if (object->isLarge)
+	{
+		uint32_t mark = LOAD_MARK(LARGE_HEADER(object)->mark);
+		return mark - (mark % MARK_EPOCH_STEP) == vm.markEpoch ? (MarkState)(mark % MARK_EPOCH_STEP) : MARK_WHITE;
+	}
+
+	return (MarkState)LOAD_MARK(PAGE_OF(object)->marks[CELL_INDEX(object)]);
+}
+
+static inline bool IsMarked(Obj* object)
+{
+	return MarkOf(object) != MARK_WHITE;
+}
+
+//Between collections the mark doubles as the old generation bit: survivors keep their mark and new objects start without one.
+//A minor collection doesn't trace old objects, so one that is given a young reference has to be remembered
+static inline void WriteBarrier(Obj* owner, Value value)
+{
+	if (IsMarked(owner) && IS_OBJ(value) && !IsMarked(AS_OBJ(value)))
+	{
+		RememberObject(owner);
+	}
+}
+
+//Goes before any change to an object's references, after whatever allocation the change needs. While the marker thread
+//runs, an object it hasn't scanned is scanned here first and the marker skips it, so everything the object held when
+//marking started is still marked, and the marker never reads a table or array that's being regrown
+static inline void SnapshotBarrier(Obj* owner)
+{
+#ifdef GC_THREAD_AVAILABLE
+	if (vm.gcMarking && MarkOf(owner) != MARK_BLACK)
+	{
+		ScanBeforeWrite(owner);
+	}
+#endif //GC_THREAD_AVAILABLE
+}
+
 #endif
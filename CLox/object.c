@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -12,11 +13,14 @@
 
 static Obj* AllocateObject(size_t size, ObjType type)
 {
-	Obj* object = (Obj*)Reallocate(NULL, 0, size);
+	Obj* object = (Obj*)AllocateCell(size);
 	object->type = type;
-	object->isMarked = false;
-	object->next = vm.objects;
-	vm.objects = object;
+	object->isLarge = size > CELL_MAX;
+	object->isRemembered = false;
+	object->isForwarded = false;
+	object->next = vm.nursery;
+	vm.nursery = object;
+	MarkAllocation(object);
 
 #ifdef DEBUG_LOG_GC
 	printf_s("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -29,7 +33,14 @@ ObjClass* NewClass(ObjString* name)
 {
 	ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
 	klass->name = name;
+	klass->rootShape = NULL;
 	InitTable(&klass->methods);
+	Push(OBJ_VAL(klass));
+	ObjShape* rootShape = NewShape(NULL, NULL);
+	SnapshotBarrier((Obj*)klass);
+	klass->rootShape = rootShape;
+	WriteBarrier((Obj*)klass, OBJ_VAL(rootShape));
+	Pop(1);
 	return klass;
 }
 
@@ -37,22 +48,24 @@ ObjInstance* NewInstance(ObjClass* klass)
 {
 	ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
 	instance->klass = klass;
+	instance->shape = klass->rootShape;
+	instance->slots = NULL;
+	instance->slotCapacity = 0;
 	InitTable(&instance->fields);
 	return instance;
 }
 
 ObjClosure* NewClosure(ObjFunction* function)
 {
-	ObjUpvalue** upvals = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+	size_t size = sizeof(ObjClosure) + sizeof(ObjUpvalue*) * function->upvalueCount;
+	ObjClosure* closure = (ObjClosure*)AllocateObject(size, OBJ_CLOSURE);
+	closure->function = function;
+	closure->upvalueCount = function->upvalueCount;
 	for (int idx = 0; idx < function->upvalueCount; idx++)
 	{
-		upvals[idx] = NULL;
+		closure->upvalues[idx] = NULL;
 	}
 
-	ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-	closure->function = function;
-	closure->upvalues = upvals;
-	closure->upvalueCount = function->upvalueCount;
 	return closure;
 }
 
@@ -64,18 +77,6 @@ ObjBoundMethod* NewBoundMethod(Value receiver, ObjClosure* method)
 	return bound;
 }
 
-static ObjString* AllocateString(char* chars, int length, uint32_t hash)
-{
-	ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-	string->length = length;
-	string->chars = chars;
-	string->hash = hash;
-	Push(OBJ_VAL(string));
-	TableSet(&vm.strings, string, NIL_VAL);
-	Pop(1);
-	return string;
-}
-
 static uint32_t HashString(const char* chars, int length)
 {
 	//FNV-1a hash algorithm
@@ -90,32 +91,193 @@ static uint32_t HashString(const char* chars, int length)
 	return hash;
 }
 
-ObjString* TakeString(char* chars, int length)
+//Room for length characters and the terminator, to be filled in and then passed to InternString
+ObjString* NewString(int length)
 {
-	uint32_t hash = HashString(chars, length);
-	ObjString* interned = TableFindString(&vm.strings, chars, length, hash);
-	if (interned != NULL)
+	ObjString* string = (ObjString*)AllocateObject(sizeof(ObjString) + (size_t)length + 1, OBJ_STRING);
+	string->isInterned = false;
+	string->length = length;
+	string->hash = 0;
+	string->chars[length] = '\0';
+	return string;
+}
+
+//While vm.strings is cleaned a slice at a time it still holds strings marking found dead, they mustn't be handed out again
+static bool IsLiveString(ObjString* string)
+{
+	return vm.gcPhase != GC_STRINGS || IsMarked((Obj*)string);
+}
+
+//Returns the interned copy if there already is one, and the new string is left for the next collection
+ObjString* InternString(ObjString* string)
+{
+	string->hash = HashString(string->chars, string->length);
+	ObjString* interned = TableFindString(&vm.strings, string->chars, string->length, string->hash);
+	if (interned != NULL && IsLiveString(interned))
 	{
-		FREE_ARRAY(char, chars, length);
+		MarkInterned((Obj*)interned);
 		return interned;
 	}
 
-	return AllocateString(chars, length, hash);
+	string->isInterned = true;
+	Push(OBJ_VAL(string));
+	TableSet(&vm.strings, string, NIL_VAL);
+	Pop(1);
+	return string;
 }
 
 ObjString* CopyString(const char* chars, int length)
 {
 	uint32_t hash = HashString(chars, length);
 	ObjString* interned = TableFindString(&vm.strings, chars, length, hash);
-	if (interned != NULL)
+	if (interned != NULL && IsLiveString(interned))
 	{
+		MarkInterned((Obj*)interned);
 		return interned;
 	}
 
-	char* heapChars = ALLOCATE(char, (rsize_t)length + 1);
-	memcpy_s(heapChars, (rsize_t)length + 1, chars, length);
-	heapChars[length] = '\0';
-	return AllocateString(heapChars, length, hash);
+	ObjString* string = NewString(length);
+	memcpy_s(string->chars, (rsize_t)length + 1, chars, length);
+	string->hash = hash;
+	string->isInterned = true;
+	Push(OBJ_VAL(string));
+	TableSet(&vm.strings, string, NIL_VAL);
+	Pop(1);
+	return string;
+}
+
+//Both children must be reachable while the rope is allocated
+ObjRope* NewRope(Obj* left, Obj* right, int length)
+{
+	ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+	rope->length = length;
+	rope->left = left;
+	rope->right = right;
+	rope->flat = NULL;
+	return rope;
+}
+
+//Finds the node's characters if they're already in one place
+static bool RopeLeaf(Obj* node, const char** chars, int* length)
+{
+	if (node->type == OBJ_ROPE)
+	{
+		node = (Obj*)((ObjRope*)node)->flat;
+		if (node == NULL)
+		{
+			return false;
+		}
+	}
+
+	*chars = FlatChars(node, length);
+	return true;
+}
+
+//Ropes can be far too deep to walk recursively, so the nodes still to visit are kept in a plain buffer.
+//It isn't counted by the collector, which mustn't run in the middle of a walk
+static Obj** PushNode(Obj** nodes, int* count, int* capacity, Obj* node)
+{
+	if (*capacity < *count + 1)
+	{
+		*capacity = *capacity < 16 ? 16 : *capacity * 2;
+		nodes = (Obj**)realloc(nodes, sizeof(Obj*) * *capacity);
+		if (nodes == NULL)
+		{
+			exit(1);
+		}
+	}
+
+	nodes[(*count)++] = node;
+	return nodes;
+}
+
+//Copies the leaves into one string. The rope keeps the result and lets go of its children,
+//so flattening it again is free. The rope must be reachable, the new string allocates
+ObjString* FlattenRope(ObjRope* rope)
+{
+	if (rope->flat != NULL)
+	{
+		return rope->flat;
+	}
+
+	ObjString* string = NewString(rope->length);
+
+	//Filled from the back, so a rope built by appending, which leans left, only ever has two nodes waiting
+	char* end = string->chars + rope->length;
+	Obj** nodes = NULL;
+	int count = 0;
+	int capacity = 0;
+	nodes = PushNode(nodes, &count, &capacity, (Obj*)rope);
+	while (count > 0)
+	{
+		Obj* node = nodes[--count];
+		const char* chars;
+		int length;
+		if (RopeLeaf(node, &chars, &length))
+		{
+			end -= length;
+			memcpy(end, chars, length);
+			continue;
+		}
+
+		nodes = PushNode(nodes, &count, &capacity, ((ObjRope*)node)->left);
+		nodes = PushNode(nodes, &count, &capacity, ((ObjRope*)node)->right);
+	}
+	free(nodes);
+
+	SnapshotBarrier((Obj*)rope);
+	rope->flat = string;
+	rope->left = NULL;
+	rope->right = NULL;
+	WriteBarrier((Obj*)rope, OBJ_VAL(string));
+	return string;
+}
+
+//Prints the leaves in order without flattening, printing mustn't allocate as the value has already been popped
+void PrintRope(ObjRope* rope)
+{
+	Obj** nodes = NULL;
+	int count = 0;
+	int capacity = 0;
+	nodes = PushNode(nodes, &count, &capacity, (Obj*)rope);
+	while (count > 0)
+	{
+		Obj* node = nodes[--count];
+		const char* chars;
+		int length;
+		if (RopeLeaf(node, &chars, &length))
+		{
+			fwrite(chars, 1, length, stdout);
+			continue;
+		}
+
+		nodes = PushNode(nodes, &count, &capacity, ((ObjRope*)node)->right);
+		nodes = PushNode(nodes, &count, &capacity, ((ObjRope*)node)->left);
+	}
+	free(nodes);
+}
+
+//Shares the characters when the piece is big enough for that to pay, and copies them otherwise.
+//The string must be reachable, both allocate
+Obj* Substring(ObjString* string, int start, int length)
+{
+	if (length == string->length)
+	{
+		return (Obj*)string;
+	}
+
+	if (length < SLICE_MIN || length < string->length / SLICE_FRACTION)
+	{
+		ObjString* copy = NewString(length);
+		memcpy(copy->chars, string->chars + start, length);
+		return (Obj*)copy;
+	}
+
+	ObjSlice* slice = ALLOCATE_OBJ(ObjSlice, OBJ_SLICE);
+	slice->length = length;
+	slice->start = start;
+	slice->parent = string;
+	return (Obj*)slice;
 }
 
 ObjUpvalue* NewUpvalue(Value* slot)
@@ -127,15 +289,19 @@ ObjUpvalue* NewUpvalue(Value* slot)
 	return upvalue;
 }
 
-static void PrintFunction(ObjFunction* function)
+static void DescribeFunction(ObjFunction* function, ValueText* text)
 {
 	if (function->name == NULL)
 	{
-		printf_s("<script>");
+		text->chars = "<script>";
+		text->length = 8;
 	}
 	else
 	{
-		printf_s("<fn %s>", function->name->chars);
+		text->prefix = "<fn ";
+		text->chars = function->name->chars;
+		text->length = function->name->length;
+		text->suffix = ">";
 	}
 }
 
@@ -144,7 +310,13 @@ ObjFunction* NewFunction()
 	ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
 	function->arity = 0;
 	function->upvalueCount = 0;
+	function->maxStack = 0;
 	function->name = NULL;
+#ifdef JIT_AVAILABLE
+	function->jit = NULL;
+	function->calls = 0;
+	function->traces = NULL;
+#endif //JIT_AVAILABLE
 	InitChunk(&function->chunk);
 	return function;
 }
@@ -156,33 +328,61 @@ ObjNative* NewNative(NativeFn function)
 	return native;
 }
 
-void PrintObject(Value value)
+ObjShape* NewShape(ObjShape* parent, ObjString* key)
+{
+	ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+	shape->parent = parent;
+	shape->key = key;
+	shape->slotCount = parent == NULL ? 0 : parent->slotCount + 1;
+	InitTable(&shape->transitions);
+	return shape;
+}
+
+//Describing a rope that hasn't been flattened yet flattens it, which allocates. PrintValue walks ropes instead
+void DescribeObject(Value value, ValueText* text)
 {
 	switch (OBJ_TYPE(value))
 	{
 	case OBJ_BOUND_METHOD:
-		PrintFunction(AS_BOUND_METHOD(value)->method->function);
+		DescribeFunction(AS_BOUND_METHOD(value)->method->function, text);
 		break;
 	case OBJ_CLASS:
-		printf_s("%s", AS_CLASS(value)->name->chars);
+		text->chars = AS_CLASS(value)->name->chars;
+		text->length = AS_CLASS(value)->name->length;
 		break;
 	case OBJ_INSTANCE:
-		printf_s("%s instance", AS_INSTANCE(value)->klass->name->chars);
+		text->chars = AS_INSTANCE(value)->klass->name->chars;
+		text->length = AS_INSTANCE(value)->klass->name->length;
+		text->suffix = " instance";
 		break;
 	case OBJ_CLOSURE:
-		PrintFunction(AS_CLOSURE(value)->function);
+		DescribeFunction(AS_CLOSURE(value)->function, text);
 		break;
 	case OBJ_FUNCTION:
-		PrintFunction(AS_FUNCTION(value));
+		DescribeFunction(AS_FUNCTION(value), text);
 		break;
 	case OBJ_NATIVE:
-		printf_s("<native fn>");
+		text->chars = "<native fn>";
+		text->length = 11;
 		break;
-	case OBJ_UPVALUE:
-		printf_s("upvalue");
+	case OBJ_ROPE:
+	{
+		ObjString* flat = FlattenRope(AS_ROPE(value));
+		text->chars = flat->chars;
+		text->length = flat->length;
+		break;
+	}
+	case OBJ_SHAPE:
+		text->chars = "shape";
+		text->length = 5;
 		break;
+	case OBJ_SLICE:
 	case OBJ_STRING:
-		printf_s("%s", AS_CSTRING(value));
+		text->chars = FlatChars(AS_OBJ(value), &text->length);
+		break;
+	case OBJ_UPVALUE:
+		text->chars = "upvalue";
+		text->length = 7;
 		break;
 	}
 }
\ No newline at end of file
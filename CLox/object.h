@@ -14,14 +14,20 @@
 #define IS_CLOSURE(value)		IsObjType(value, OBJ_CLOSURE)
 #define IS_CLASS(value)			IsObjType(value, OBJ_CLASS)
 #define IS_INSTANCE(value)		IsObjType(value, OBJ_INSTANCE)
+#define IS_SHAPE(value)			IsObjType(value, OBJ_SHAPE)
 #define IS_BOUND_METHOD(value)	IsObjType(value, OBJ_BOUND_METHOD)
+#define IS_ROPE(value)			IsObjType(value, OBJ_ROPE)
+#define IS_SLICE(value)			IsObjType(value, OBJ_SLICE)
 
 #define AS_CLOSURE(value)		((ObjClosure*)AS_OBJ(value))
 #define AS_CLASS(value)			((ObjClass*)AS_OBJ(value))
 #define AS_INSTANCE(value)		((ObjInstance*)AS_OBJ(value))
+#define AS_SHAPE(value)			((ObjShape*)AS_OBJ(value))
 #define AS_FUNCTION(value)		((ObjFunction*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value)	((ObjBoundMethod*)AS_OBJ(value))
 #define AS_NATIVE(value)		(((ObjNative*)AS_OBJ(value))->function)
+#define AS_ROPE(value)			((ObjRope*)AS_OBJ(value))
+#define AS_SLICE(value)			((ObjSlice*)AS_OBJ(value))
 #define AS_STRING(value)		((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)		(((ObjString*)AS_OBJ(value))->chars)
 
@@ -33,6 +39,9 @@ typedef enum
 	OBJ_FUNCTION,
 	OBJ_INSTANCE,
 	OBJ_NATIVE,
+	OBJ_ROPE,
+	OBJ_SHAPE,
+	OBJ_SLICE,
 	OBJ_STRING,
 	OBJ_UPVALUE,
 } ObjType;
@@ -40,7 +49,9 @@ typedef enum
 struct Obj
 {
 	ObjType type;
-	bool isMarked;
+	bool isLarge; //Allocated outside the cell pages, see IsMarked
+	bool isRemembered; //Old and in vm.remembered, see WriteBarrier
+	bool isForwarded; //Left behind by a compaction, next is where the object went, see Compact
 	struct Obj* next;
 };
 
@@ -49,8 +60,14 @@ typedef struct
 	Obj obj;
 	int arity;
 	int upvalueCount;
+	int maxStack; //Slots a frame needs from its callee slot up, see MaxStackDepth
 	Chunk chunk;
 	ObjString* name;
+#ifdef JIT_AVAILABLE
+	struct JitCode* jit;
+	int calls;
+	struct Trace* traces;
+#endif //JIT_AVAILABLE
 } ObjFunction;
 
 typedef Value(*NativeFn)(int argCount, Value* args);
@@ -61,14 +78,45 @@ typedef struct
 	NativeFn function;
 } ObjNative;
 
+//The characters live in the same allocation as the header. Names and literals are interned so tables can key on the
+//pointer, strings made while running aren't and are only hashed if they get interned, see InternString
 struct ObjString
 {
 	Obj obj;
+	bool isInterned;
 	int length;
-	char* chars;
-	uint32_t hash;
+	uint32_t hash; //Only set once interned
+	char chars[];
 };
 
+//Concatenations at least this long make a rope instead of copying, so no rope is ever shorter
+#define ROPE_MIN 64
+
+//The concatenation of left and right, each a string or another rope. It stays unflattened until something needs
+//the characters in one place, see FlattenRope
+typedef struct
+{
+	Obj obj;
+	int length;
+	Obj* left;
+	Obj* right;
+	ObjString* flat; //Set once flattened, the children are dropped then
+} ObjRope;
+
+//Substrings shorter than this are copied, a slice costs about as much as copying them
+#define SLICE_MIN 32
+//Nor is a substring sliced if it's less than this fraction of its parent, so it can't keep a much bigger string alive
+#define SLICE_FRACTION 8
+
+//Part of a string sharing its characters instead of copying them. The parent is always a string, never another slice
+typedef struct
+{
+	Obj obj;
+	int length;
+	int start;
+	ObjString* parent;
+} ObjSlice;
+
 typedef struct
 {
 	Obj obj;
@@ -81,22 +129,37 @@ typedef struct
 {
 	Obj obj;
 	ObjFunction* function;
-	ObjUpvalue** upvalues;
 	int upvalueCount;
+	ObjUpvalue* upvalues[];
 } ObjClosure;
 
+//A field layout shared by every instance that had the same fields added in the same order.
+//Each shape is its parent plus one field, and the parent remembers the child in its transitions
+typedef struct ObjShape
+{
+	Obj obj;
+	struct ObjShape* parent;
+	ObjString* key; //The field this shape added, NULL for the root
+	int slotCount;
+	Table transitions; //Field name -> child shape
+} ObjShape;
+
 typedef struct
 {
 	Obj obj;
 	ObjString* name;
 	Table methods;
+	ObjShape* rootShape;
 } ObjClass;
 
 typedef struct
 {
 	Obj obj;
 	ObjClass* klass;
-	Table fields;
+	ObjShape* shape; //NULL once the instance has fallen back to dictionary mode
+	Value* slots;
+	int slotCapacity;
+	Table fields; //Only used in dictionary mode
 } ObjInstance;
 
 typedef struct
@@ -112,14 +175,39 @@ ObjClosure* NewClosure(ObjFunction* function);
 ObjBoundMethod* NewBoundMethod(Value receiver, ObjClosure* method);
 ObjString* CopyString(const char* chars, int length);
 ObjUpvalue* NewUpvalue(Value* slot);
-ObjString* TakeString(char* chars, int length);
+ObjString* NewString(int length);
+ObjString* InternString(ObjString* string);
+ObjRope* NewRope(Obj* left, Obj* right, int length);
+ObjString* FlattenRope(ObjRope* rope);
+Obj* Substring(ObjString* string, int start, int length);
 ObjFunction* NewFunction();
 ObjNative* NewNative(NativeFn function);
-void PrintObject(Value value);
+ObjShape* NewShape(ObjShape* parent, ObjString* key);
+void DescribeObject(Value value, ValueText* text);
+void PrintRope(ObjRope* rope);
 
 static inline bool IsObjType(Value value, ObjType type)
 {
 	return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+//Strings and slices keep their characters in one place, though a slice's aren't terminated
+static inline bool IsFlat(Value value)
+{
+	return IS_STRING(value) || IS_SLICE(value);
+}
+
+static inline const char* FlatChars(Obj* object, int* length)
+{
+	if (object->type == OBJ_SLICE)
+	{
+		ObjSlice* slice = (ObjSlice*)object;
+		*length = slice->length;
+		return slice->parent->chars + slice->start;
+	}
+
+	*length = ((ObjString*)object)->length;
+	return ((ObjString*)object)->chars;
+}
+
 #endif
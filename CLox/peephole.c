@@ -0,0 +1,359 @@
+#include <stdlib.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "peephole.h"
+
+//Rewrites the fixed sequences the compiler emits into superinstructions.
+//The fused set was picked from dynamic opcode pair counts over the benchmark scripts,
+//where GET_LOCAL alone is ~25% of executed instructions and these pairs cover another ~25%.
+//Whole statements that only read locals and constants are fused first, into slot forms that name their operands.
+
+typedef struct
+{
+	int patch;		//Offset of the jump's 16 bit operand in the new code, always the instruction's last bytes
+	int target;		//Offset of the jump's destination in the old code
+	bool isLoop;
+} PendingJump;
+
+typedef struct
+{
+	Chunk* chunk;
+	int* jumpsTo;
+	Chunk optimised;
+	PendingJump* jumps;
+	int jumpCount;
+	int line;
+} Peephole;
+
+static bool IsJump(uint8_t instruction)
+{
+	return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP;
+}
+
+static int JumpTarget(Chunk* chunk, int offset)
+{
+	uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+	return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+//Can only fuse past an instruction if nothing jumps into the middle of the group
+static bool IsPlain(Chunk* chunk, int* jumpsTo, int offset, uint8_t instruction)
+{
+	return offset < chunk->count && jumpsTo[offset] == 0 && chunk->code[offset] == instruction;
+}
+
+//JUMP_IF_FALSE; POP can only become a single popping jump if the false path pops first thing too
+static bool CanFuseJumpPop(Chunk* chunk, int* jumpsTo, int offset)
+{
+	int target = JumpTarget(chunk, offset);
+	return IsPlain(chunk, jumpsTo, offset + 3, OP_POP) && target < chunk->count && chunk->code[target] == OP_POP;
+}
+
+static bool IsUnconditional(uint8_t instruction)
+{
+	return instruction == OP_JUMP || instruction == OP_LOOP || instruction == OP_RETURN;
+}
+
+static void Emit(Peephole* peephole, uint8_t byte)
+{
+	WriteChunk(&peephole->optimised, byte, peephole->line);
+}
+
+static void EmitJump(Peephole* peephole, int target, bool isLoop)
+{
+	PendingJump* jump = &peephole->jumps[peephole->jumpCount++];
+	jump->patch = peephole->optimised.count;
+	jump->target = target;
+	jump->isLoop = isLoop;
+
+	Emit(peephole, 0xff);
+	Emit(peephole, 0xff);
+}
+
+static bool ArithmeticSlotForm(uint8_t instruction, bool isConstant, uint8_t* form)
+{
+	switch (instruction)
+	{
+	case OP_ADD:		*form = isConstant ? OP_ADD_LK : OP_ADD_LL; return true;
+	case OP_SUBTRACT:	*form = isConstant ? OP_SUBTRACT_LK : OP_SUBTRACT_LL; return true;
+	case OP_MULTIPLY:	*form = isConstant ? OP_MULTIPLY_LK : OP_MULTIPLY_LL; return true;
+	case OP_DIVIDE:		*form = isConstant ? OP_DIVIDE_LK : OP_DIVIDE_LL; return true;
+	default:			return false;
+	}
+}
+
+static bool BranchSlotForm(uint8_t instruction, bool isConstant, uint8_t* form)
+{
+	switch (instruction)
+	{
+	case OP_LESS:		*form = isConstant ? OP_JUMP_IF_NOT_LESS_LK : OP_JUMP_IF_NOT_LESS_LL; return true;
+	case OP_GREATER:	*form = isConstant ? OP_JUMP_IF_NOT_GREATER_LK : OP_JUMP_IF_NOT_GREATER_LL; return true;
+	default:			return false;
+	}
+}
+
+//Operands are local slots (L) or constant indices (K). Only statements whose every operand is a local
+//are fused, temporaries stay on the value stack so the GC keeps seeing them, so a statement like
+//a = a + b * c is still all stack code.
+//Returns the number of stack code bytes consumed, or 0 if nothing matched.
+static int FuseSlotStatement(Peephole* peephole, int offset)
+{
+	Chunk* chunk = peephole->chunk;
+	int* jumpsTo = peephole->jumpsTo;
+	uint8_t* code = chunk->code;
+
+	if (code[offset] == OP_CONSTANT)
+	{
+		//CONSTANT k; SET_LOCAL d; POP
+		if (IsPlain(chunk, jumpsTo, offset + 2, OP_SET_LOCAL) && IsPlain(chunk, jumpsTo, offset + 4, OP_POP))
+		{
+			Emit(peephole, OP_STORE_CONSTANT);
+			Emit(peephole, code[offset + 3]);
+			Emit(peephole, code[offset + 1]);
+			return 5;
+		}
+
+		return 0;
+	}
+
+	if (code[offset] != OP_GET_LOCAL)
+	{
+		return 0;
+	}
+
+	//GET_LOCAL a; SET_LOCAL d; POP
+	if (IsPlain(chunk, jumpsTo, offset + 2, OP_SET_LOCAL) && IsPlain(chunk, jumpsTo, offset + 4, OP_POP))
+	{
+		Emit(peephole, OP_COPY_LOCAL);
+		Emit(peephole, code[offset + 3]);
+		Emit(peephole, code[offset + 1]);
+		return 5;
+	}
+
+	//GET_LOCAL a; GET_LOCAL b | CONSTANT k; <op>
+	int second = offset + 2;
+	if (second >= chunk->count || jumpsTo[second] != 0 ||
+		(code[second] != OP_GET_LOCAL && code[second] != OP_CONSTANT))
+	{
+		return 0;
+	}
+
+	bool isConstant = code[second] == OP_CONSTANT;
+	int op = offset + 4;
+	if (op >= chunk->count || jumpsTo[op] != 0)
+	{
+		return 0;
+	}
+
+	uint8_t form;
+	//... <arithmetic>; SET_LOCAL d; POP
+	if (ArithmeticSlotForm(code[op], isConstant, &form) &&
+		IsPlain(chunk, jumpsTo, op + 1, OP_SET_LOCAL) && IsPlain(chunk, jumpsTo, op + 3, OP_POP))
+	{
+		Emit(peephole, form);
+		Emit(peephole, code[op + 2]);
+		Emit(peephole, code[offset + 1]);
+		Emit(peephole, code[second + 1]);
+		return 8;
+	}
+
+	//... LESS | GREATER; JUMP_IF_FALSE; POP
+	if (BranchSlotForm(code[op], isConstant, &form) &&
+		IsPlain(chunk, jumpsTo, op + 1, OP_JUMP_IF_FALSE) && CanFuseJumpPop(chunk, jumpsTo, op + 1))
+	{
+		Emit(peephole, form);
+		Emit(peephole, code[offset + 1]);
+		Emit(peephole, code[second + 1]);
+		EmitJump(peephole, JumpTarget(chunk, op + 1) + 1, false);
+		return 9;
+	}
+
+	return 0;
+}
+
+void PeepholeOptimise(Chunk* chunk)
+{
+	int count = chunk->count;
+	int* jumpsTo = ALLOCATE(int, (size_t)count + 1);
+	int* newOffsets = ALLOCATE(int, (size_t)count + 1);
+	int* lines = ALLOCATE(int, (size_t)count + 1);
+	bool* removed = ALLOCATE(bool, (size_t)count + 1);
+	uint8_t* preceding = ALLOCATE(uint8_t, (size_t)count + 1);
+
+	Peephole peephole;
+	peephole.chunk = chunk;
+	peephole.jumpsTo = jumpsTo;
+	peephole.jumps = ALLOCATE(PendingJump, (size_t)count + 1);
+	peephole.jumpCount = 0;
+	InitChunk(&peephole.optimised);
+
+	for (int idx = 0; idx <= count; idx++)
+	{
+		jumpsTo[idx] = 0;
+		removed[idx] = false;
+	}
+
+	//Unpack the run-length encoded line info so every byte can be looked up directly
+	for (int idx = 0, offset = 0; idx < chunk->lines.count; idx += 2)
+	{
+		for (int run = 0; run < chunk->lines.lines[idx]; run++)
+		{
+			lines[offset++] = chunk->lines.lines[idx + 1];
+		}
+	}
+
+	uint8_t previous = OP_RETURN;
+	for (int offset = 0; offset < count; offset += InstructionLength(chunk, offset))
+	{
+		preceding[offset] = previous;
+		previous = chunk->code[offset];
+		if (IsJump(previous))
+		{
+			jumpsTo[JumpTarget(chunk, offset)]++;
+		}
+	}
+
+	//When a fused jump is the only way to reach its POP, that POP is dead
+	for (int offset = 0; offset < count; offset += InstructionLength(chunk, offset))
+	{
+		if (chunk->code[offset] == OP_JUMP_IF_FALSE && CanFuseJumpPop(chunk, jumpsTo, offset))
+		{
+			int target = JumpTarget(chunk, offset);
+			if (jumpsTo[target] == 1 && IsUnconditional(preceding[target]))
+			{
+				removed[target] = true;
+			}
+		}
+	}
+
+	int offset = 0;
+	while (offset < count)
+	{
+		uint8_t* code = chunk->code;
+		int length = InstructionLength(chunk, offset);
+		peephole.line = lines[offset];
+		newOffsets[offset] = peephole.optimised.count;
+
+		if (removed[offset])
+		{
+			offset += length;
+			continue;
+		}
+
+		int fused = FuseSlotStatement(&peephole, offset);
+		if (fused > 0)
+		{
+			offset += fused;
+			continue;
+		}
+
+		switch (code[offset])
+		{
+		case OP_GET_LOCAL:
+			if (IsPlain(chunk, jumpsTo, offset + 2, OP_GET_LOCAL) && IsPlain(chunk, jumpsTo, offset + 4, OP_ADD))
+			{
+				Emit(&peephole, OP_ADD_LOCALS);
+				Emit(&peephole, code[offset + 1]);
+				Emit(&peephole, code[offset + 3]);
+				length = 5;
+			}
+			else if (code[offset + 1] < 4)
+			{
+				Emit(&peephole, OP_GET_LOCAL_0 + code[offset + 1]);
+			}
+			else
+			{
+				Emit(&peephole, OP_GET_LOCAL);
+				Emit(&peephole, code[offset + 1]);
+			}
+			break;
+		case OP_SET_LOCAL:
+		case OP_CONSTANT:
+		{
+			uint8_t fused = code[offset];
+			uint8_t next = offset + 2 < count && jumpsTo[offset + 2] == 0 ? code[offset + 2] : OP_RETURN;
+			if (code[offset] == OP_SET_LOCAL && next == OP_POP)		{ fused = OP_SET_LOCAL_POP; }
+			else if (code[offset] == OP_CONSTANT && next == OP_ADD)		{ fused = OP_ADD_CONSTANT; }
+			else if (code[offset] == OP_CONSTANT && next == OP_SUBTRACT)	{ fused = OP_SUBTRACT_CONSTANT; }
+			else if (code[offset] == OP_CONSTANT && next == OP_LESS)		{ fused = OP_LESS_CONSTANT; }
+
+			Emit(&peephole, fused);
+			Emit(&peephole, code[offset + 1]);
+			if (fused != code[offset])
+			{
+				length = 3;
+			}
+			break;
+		}
+		case OP_EQUAL:
+		case OP_GREATER:
+		case OP_LESS:
+			if (IsPlain(chunk, jumpsTo, offset + 1, OP_NOT))
+			{
+				uint8_t fused = code[offset] == OP_EQUAL ? OP_NOT_EQUAL
+					: code[offset] == OP_GREATER ? OP_LESS_EQUAL : OP_GREATER_EQUAL;
+				Emit(&peephole, fused);
+				length = 2;
+			}
+			else
+			{
+				Emit(&peephole, code[offset]);
+			}
+			break;
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_LOOP:
+		{
+			int target = JumpTarget(chunk, offset);
+			uint8_t instruction = code[offset];
+			if (instruction == OP_JUMP_IF_FALSE && CanFuseJumpPop(chunk, jumpsTo, offset))
+			{
+				//Land after the POP at the target, the fused instruction has already popped
+				instruction = OP_JUMP_IF_FALSE_POP;
+				target++;
+				length = 4;
+			}
+
+			Emit(&peephole, instruction);
+			EmitJump(&peephole, target, instruction == OP_LOOP);
+			break;
+		}
+		default:
+			for (int idx = 0; idx < length; idx++)
+			{
+				Emit(&peephole, code[offset + idx]);
+			}
+			break;
+		}
+
+		offset += length;
+	}
+	newOffsets[count] = peephole.optimised.count;
+
+	Chunk* optimised = &peephole.optimised;
+	for (int idx = 0; idx < peephole.jumpCount; idx++)
+	{
+		PendingJump* pending = &peephole.jumps[idx];
+		int end = pending->patch + 2;
+		int target = newOffsets[pending->target];
+		int jump = pending->isLoop ? end - target : target - end;
+
+		optimised->code[pending->patch] = (jump >> 8) & 0xff;
+		optimised->code[pending->patch + 1] = jump & 0xff;
+	}
+
+	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+	FREE_ARRAY(int, chunk->lines.lines, chunk->lines.capacity);
+	chunk->code = optimised->code;
+	chunk->count = optimised->count;
+	chunk->capacity = optimised->capacity;
+	chunk->lines = optimised->lines;
+
+	FREE_ARRAY(int, jumpsTo, (size_t)count + 1);
+	FREE_ARRAY(int, newOffsets, (size_t)count + 1);
+	FREE_ARRAY(int, lines, (size_t)count + 1);
+	FREE_ARRAY(bool, removed, (size_t)count + 1);
+	FREE_ARRAY(uint8_t, preceding, (size_t)count + 1);
+	FREE_ARRAY(PendingJump, peephole.jumps, (size_t)count + 1);
+}
@@ -4,11 +4,16 @@
 #include "common.h"
 #include "scanner.h"
 
+//How many ${ can be open inside each other
+#define MAX_INTERPOLATION_DEPTH 8
+
 typedef struct
 {
 	const char* start;
 	const char* current;
 	int line;
+	int interpolationDepth;
+	int braces[MAX_INTERPOLATION_DEPTH]; //The { still open inside each ${, its } only ends the expression once they're closed
 } Scanner;
 
 Scanner scanner;
@@ -18,6 +23,7 @@ void InitScanner(const char* source)
 	scanner.start = source;
 	scanner.current = source;
 	scanner.line = 1;
+	scanner.interpolationDepth = 0;
 }
 
 static bool IsAtEnd()
@@ -116,10 +122,24 @@ static bool IsAlpha(char c)
 		c == '_';
 }
 
+//Scans to the closing " or the next ${. A string resumed after an interpolated expression starts at its }
 static Token String()
 {
 	while (Peek() != '"' && !IsAtEnd())
 	{
+		if (Peek() == '$' && PeekNext() == '{')
+		{
+			if (scanner.interpolationDepth == MAX_INTERPOLATION_DEPTH)
+			{
+				return ErrorToken("Interpolation nested too deeply");
+			}
+
+			Advance();
+			Advance();
+			scanner.braces[scanner.interpolationDepth++] = 0;
+			return MakeToken(TOKEN_INTERPOLATION);
+		}
+
 		if (Peek() == '\n') { scanner.line++; }
 		Advance();
 	}
@@ -217,8 +237,24 @@ Token ScanToken()
 	{
 	case '(': return MakeToken(TOKEN_LEFT_PAREN);
 	case ')': return MakeToken(TOKEN_RIGHT_PAREN);
-	case '{': return MakeToken(TOKEN_LEFT_BRACE);
-	case '}': return MakeToken(TOKEN_RIGHT_BRACE);
+	case '{':
+		if (scanner.interpolationDepth > 0)
+		{
+			scanner.braces[scanner.interpolationDepth - 1]++;
+		}
+		return MakeToken(TOKEN_LEFT_BRACE);
+	case '}':
+		if (scanner.interpolationDepth > 0)
+		{
+			if (scanner.braces[scanner.interpolationDepth - 1] == 0)
+			{
+				scanner.interpolationDepth--;
+				return String();
+			}
+
+			scanner.braces[scanner.interpolationDepth - 1]--;
+		}
+		return MakeToken(TOKEN_RIGHT_BRACE);
 	case ';': return MakeToken(TOKEN_SEMICOLON);
 	case ',': return MakeToken(TOKEN_COMMA);
 	case '.': return MakeToken(TOKEN_DOT);
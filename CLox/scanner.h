@@ -15,6 +15,7 @@ typedef enum
 	TOKEN_LESS, TOKEN_LESS_EQUAL,
 	// Literals.
 	TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
+	TOKEN_INTERPOLATION, //The part of a string up to a ${, the rest of the string follows the expression
 	// Keywords.
 	TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
 	TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
@@ -0,0 +1,113 @@
+#include "memory.h"
+#include "shape.h"
+#include "vm.h"
+
+int ShapeSlot(ObjShape* shape, ObjString* key)
+{
+	//Keys are interned, and shapes are short, so walking back to the root beats hashing
+	for (; shape->key != NULL; shape = shape->parent)
+	{
+		if (shape->key == key)
+		{
+			return shape->slotCount - 1;
+		}
+	}
+
+	return -1;
+}
+
+static ObjShape* ShapeTransition(ObjShape* shape, ObjString* key)
+{
+	Value child;
+	if (TableGet(&shape->transitions, key, &child))
+	{
+		return AS_SHAPE(child);
+	}
+
+	ObjShape* next = NewShape(shape, key);
+	Push(OBJ_VAL(next));
+	SnapshotBarrier((Obj*)shape);
+	TableSet(&shape->transitions, key, OBJ_VAL(next));
+	WriteBarrier((Obj*)shape, OBJ_VAL(next));
+	Pop(1);
+	return next;
+}
+
+static void ToDictionaryMode(ObjInstance* instance)
+{
+	for (ObjShape* shape = instance->shape; shape->key != NULL; shape = shape->parent)
+	{
+		TableSet(&instance->fields, shape->key, instance->slots[shape->slotCount - 1]);
+	}
+
+	//The keys were only reachable through the shape before
+	RememberObject((Obj*)instance);
+
+	FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+	instance->slots = NULL;
+	instance->slotCapacity = 0;
+	instance->shape = NULL;
+}
+
+bool InstanceGetField(ObjInstance* instance, ObjString* key, Value* value)
+{
+	if (instance->shape == NULL)
+	{
+		return TableGet(&instance->fields, key, value);
+	}
+
+	int slot = ShapeSlot(instance->shape, key);
+	if (slot == -1)
+	{
+		return false;
+	}
+
+	*value = instance->slots[slot];
+	return true;
+}
+
+//Next must be a transition out of the instance's current shape
+void InstanceAddField(ObjInstance* instance, ObjShape* next, Value value)
+{
+	SnapshotBarrier((Obj*)instance);
+	if (next->slotCount > instance->slotCapacity)
+	{
+		int oldCapacity = instance->slotCapacity;
+		int newCapacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+		instance->slots = GROW_ARRAY(Value, instance->slots, oldCapacity, newCapacity);
+		instance->slotCapacity = newCapacity;
+	}
+
+	instance->slots[next->slotCount - 1] = value;
+	instance->shape = next;
+	WriteBarrier((Obj*)instance, value);
+	WriteBarrier((Obj*)instance, OBJ_VAL(next));
+}
+
+//Value must be reachable by the GC, the shape transition and slot growth can both collect
+void InstanceSetField(ObjInstance* instance, ObjString* key, Value value)
+{
+	SnapshotBarrier((Obj*)instance);
+	if (instance->shape != NULL)
+	{
+		int slot = ShapeSlot(instance->shape, key);
+		if (slot != -1)
+		{
+			instance->slots[slot] = value;
+			WriteBarrier((Obj*)instance, value);
+			return;
+		}
+
+		if (instance->shape->slotCount < SHAPE_MAX_SLOTS)
+		{
+			InstanceAddField(instance, ShapeTransition(instance->shape, key), value);
+			return;
+		}
+
+		ToDictionaryMode(instance);
+	}
+
+	TableSet(&instance->fields, key, value);
+	WriteBarrier((Obj*)instance, OBJ_VAL(key));
+	WriteBarrier((Obj*)instance, value);
+}
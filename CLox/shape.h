@@ -0,0 +1,15 @@
+#ifndef clox_shape_h
+#define clox_shape_h
+
+#include "common.h"
+#include "object.h"
+
+//Instances with more fields than this stop sharing shapes and keep their fields in a table
+#define SHAPE_MAX_SLOTS 32
+
+int ShapeSlot(ObjShape* shape, ObjString* key);
+bool InstanceGetField(ObjInstance* instance, ObjString* key, Value* value);
+void InstanceSetField(ObjInstance* instance, ObjString* key, Value value);
+void InstanceAddField(ObjInstance* instance, ObjShape* next, Value value);
+
+#endif
@@ -75,7 +75,7 @@ static void AdjustCapacity(Table* table, int newCapacity)
 		Entry* dest = FindEntry(entries, newCapacity, entry->key);
 		dest->key = entry->key;
 		dest->value = entry->value;
-		table->count;
+		table->count++;
 	}
 
 	FREE_ARRAY(Entry, table->entries, table->capacity);
@@ -184,7 +184,7 @@ void TableRemoveWhite(Table* table)
 	for (int idx = 0; idx < table->capacity; idx++)
 	{
 		Entry* entry = &table->entries[idx];
-		if (entry->key != NULL && !entry->key->obj.isMarked)
+		if (entry->key != NULL && !IsMarked((Obj*)entry->key))
 		{
 			TableDelete(table, entry->key);
 		}
@@ -0,0 +1,1161 @@
+#include "common.h"
+
+#ifdef JIT_AVAILABLE
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "assembler.h"
+#include "chunk.h"
+#include "trace.h"
+
+//Longest loop body that will be recorded, in instructions
+#define MAX_TRACE_LENGTH 512
+//Temporaries above the loop's locals are kept in XMM2 upwards, XMM0 and XMM1 are scratch
+#define MAX_TEMPORARIES 14
+
+typedef enum
+{
+	TYPE_NUMBER,
+	TYPE_BOOL,
+	TYPE_NIL,
+	TYPE_OBJECT
+} TraceType;
+
+typedef struct
+{
+	CallFrame* frame;
+	ObjClosure* closure;
+	uint8_t* header;
+	int depth;
+	int count;
+	uint8_t* instructions[MAX_TRACE_LENGTH];
+	uint8_t observed[MAX_TRACE_LENGTH]; //Type seen by each global and upvalue load
+	uint8_t entryTypes[UINT8_COUNT];
+} Recorder;
+
+typedef enum
+{
+	VALUE_CONSTANT,
+	VALUE_REGISTER
+} TraceValueKind;
+
+//What the compiler knows about one stack slot above the loop's locals, those below live in the frame
+typedef struct
+{
+	TraceValueKind kind;
+	TraceType type;
+	Value constant;
+} TraceValue;
+
+//Either a frame slot or a constant, so the slot forms and the stack forms can share code
+typedef struct
+{
+	int slot; //-1 for a constant
+	Value constant;
+} Operand;
+
+typedef struct
+{
+	bool swap;
+	Condition cc; //CC_A or CC_BE, the same pairs the baseline JIT uses
+} Comparison;
+
+//A guard's way back to the interpreter, with the temporaries it has to write out
+typedef struct
+{
+	int patch;
+	uint8_t* ip;
+	int top;
+	int snapshot;
+} TraceExit;
+
+typedef struct
+{
+	Assembler as;
+	Chunk* chunk;
+	int depth;
+	int top;
+	TraceValue stack[UINT8_COUNT];
+	uint8_t slotTypes[UINT8_COUNT];
+	bool written[UINT8_COUNT];
+	bool guarded[UINT8_COUNT]; //Read before it was written, so the type it had on entry has to be checked
+	TraceExit* exits;
+	int exitCount;
+	int exitCapacity;
+	TraceValue* snapshots;
+	int snapshotCount;
+	int snapshotCapacity;
+	bool failed;
+} TraceCompiler;
+
+typedef void(*TraceFunction)(CallFrame* frame);
+
+static Recorder recorder;
+
+static TraceType TypeOf(Value value)
+{
+	if (IS_NUMBER(value))
+	{
+		return TYPE_NUMBER;
+	}
+
+	if (IS_BOOL(value))
+	{
+		return TYPE_BOOL;
+	}
+
+	return IS_NIL(value) ? TYPE_NIL : TYPE_OBJECT;
+}
+
+static Operand SlotOperand(int slot)
+{
+	Operand operand = { slot, NIL_VAL };
+	return operand;
+}
+
+//Integer constants are widened so numbers in a trace are always doubles
+static Value TraceConstant(Value constant)
+{
+	return IS_INTEGER(constant) ? NUMBER_VAL(AS_INTEGER(constant)) : constant;
+}
+
+static Operand ConstantOperand(Value constant)
+{
+	Operand operand = { -1, TraceConstant(constant) };
+	return operand;
+}
+
+static XmmRegister Temporary(TraceCompiler* tc, int slot)
+{
+	return (XmmRegister)(XMM2 + slot - tc->depth);
+}
+
+static void Fail(TraceCompiler* tc)
+{
+	tc->failed = true;
+}
+
+static int PushSlot(TraceCompiler* tc)
+{
+	if (tc->top - tc->depth == MAX_TEMPORARIES)
+	{
+		Fail(tc);
+		return tc->top - 1;
+	}
+
+	return tc->top++;
+}
+
+static void PopSlots(TraceCompiler* tc, int count)
+{
+	tc->top -= count;
+	if (tc->top < tc->depth)
+	{
+		Fail(tc);
+		tc->top = tc->depth;
+	}
+}
+
+static bool ValidSlot(TraceCompiler* tc, int slot)
+{
+	if (slot < 0 || slot >= tc->top)
+	{
+		Fail(tc);
+		return false;
+	}
+
+	return true;
+}
+
+static TraceType OperandType(TraceCompiler* tc, Operand operand)
+{
+	if (operand.slot == -1)
+	{
+		return TypeOf(operand.constant);
+	}
+
+	if (!ValidSlot(tc, operand.slot))
+	{
+		return TYPE_NIL;
+	}
+
+	if (operand.slot >= tc->depth)
+	{
+		return tc->stack[operand.slot].type;
+	}
+
+	if (!tc->written[operand.slot])
+	{
+		tc->guarded[operand.slot] = true;
+	}
+
+	return (TraceType)tc->slotTypes[operand.slot];
+}
+
+static bool IsConstant(TraceCompiler* tc, Operand operand, Value* constant)
+{
+	if (operand.slot == -1)
+	{
+		*constant = operand.constant;
+		return true;
+	}
+
+	if (operand.slot >= tc->depth && tc->stack[operand.slot].kind == VALUE_CONSTANT)
+	{
+		*constant = tc->stack[operand.slot].constant;
+		return true;
+	}
+
+	return false;
+}
+
+static void LoadOperand(TraceCompiler* tc, Operand operand, XmmRegister dst)
+{
+	Value constant;
+	if (IsConstant(tc, operand, &constant))
+	{
+		MovValue(&tc->as, RAX, constant);
+		MovqToXmm(&tc->as, dst, RAX);
+	}
+	else if (operand.slot < tc->depth)
+	{
+		LoadXmm(&tc->as, dst, SLOTS, operand.slot * (int32_t)sizeof(Value));
+	}
+	else
+	{
+		MoveXmm(&tc->as, dst, Temporary(tc, operand.slot));
+	}
+}
+
+//Boxed bits in a general purpose register, for stores and comparisons that aren't numeric
+static void LoadOperandBits(TraceCompiler* tc, Operand operand, Register dst)
+{
+	Value constant;
+	if (IsConstant(tc, operand, &constant))
+	{
+		MovValue(&tc->as, dst, constant);
+	}
+	else if (operand.slot < tc->depth)
+	{
+		Load(&tc->as, dst, SLOTS, operand.slot * (int32_t)sizeof(Value));
+	}
+	else
+	{
+		MovqFromXmm(&tc->as, dst, Temporary(tc, operand.slot));
+	}
+}
+
+static void SetConstant(TraceCompiler* tc, int slot, Value constant)
+{
+	constant = TraceConstant(constant);
+	if (slot < tc->depth)
+	{
+		MovValue(&tc->as, RAX, constant);
+		Store(&tc->as, SLOTS, slot * (int32_t)sizeof(Value), RAX);
+		tc->slotTypes[slot] = TypeOf(constant);
+		tc->written[slot] = true;
+		return;
+	}
+
+	tc->stack[slot].kind = VALUE_CONSTANT;
+	tc->stack[slot].type = TypeOf(constant);
+	tc->stack[slot].constant = constant;
+}
+
+//The value is in src, which is moved into the slot's temporary or stored to the frame
+static void SetRegister(TraceCompiler* tc, int slot, XmmRegister src, TraceType type)
+{
+	if (slot < tc->depth)
+	{
+		StoreXmm(&tc->as, SLOTS, slot * (int32_t)sizeof(Value), src);
+		tc->slotTypes[slot] = type;
+		tc->written[slot] = true;
+		return;
+	}
+
+	MoveXmm(&tc->as, Temporary(tc, slot), src);
+	tc->stack[slot].kind = VALUE_REGISTER;
+	tc->stack[slot].type = type;
+}
+
+static void SetBits(TraceCompiler* tc, int slot, Register src, TraceType type)
+{
+	MovqToXmm(&tc->as, XMM0, src);
+	SetRegister(tc, slot, XMM0, type);
+}
+
+static void CopySlot(TraceCompiler* tc, int dst, Operand src)
+{
+	TraceType type = OperandType(tc, src);
+	Value constant;
+	if (IsConstant(tc, src, &constant))
+	{
+		SetConstant(tc, dst, constant);
+		return;
+	}
+
+	if (src.slot >= tc->depth)
+	{
+		SetRegister(tc, dst, Temporary(tc, src.slot), type);
+		return;
+	}
+
+	LoadXmm(&tc->as, XMM0, SLOTS, src.slot * (int32_t)sizeof(Value));
+	SetRegister(tc, dst, XMM0, type);
+}
+
+static void Guard(TraceCompiler* tc, Condition exitWhen, uint8_t* exitIp)
+{
+	if (tc->exitCapacity < tc->exitCount + 1)
+	{
+		tc->exitCapacity = tc->exitCapacity < 16 ? 16 : tc->exitCapacity * 2;
+		tc->exits = (TraceExit*)GrowBuffer(tc->exits, sizeof(TraceExit) * tc->exitCapacity);
+	}
+
+	int temporaries = tc->top - tc->depth;
+	if (tc->snapshotCapacity < tc->snapshotCount + temporaries)
+	{
+		tc->snapshotCapacity = tc->snapshotCount + temporaries < 64 ? 64 : (tc->snapshotCount + temporaries) * 2;
+		tc->snapshots = (TraceValue*)GrowBuffer(tc->snapshots, sizeof(TraceValue) * tc->snapshotCapacity);
+	}
+
+	TraceExit* exit = &tc->exits[tc->exitCount++];
+	exit->patch = JumpForward(&tc->as, exitWhen);
+	exit->ip = exitIp;
+	exit->top = tc->top;
+	exit->snapshot = tc->snapshotCount;
+	for (int slot = tc->depth; slot < tc->top; slot++)
+	{
+		tc->snapshots[tc->snapshotCount++] = tc->stack[slot];
+	}
+}
+
+//Checks the boxed value in reg, which must not be RCX or RDX. Traces only work in doubles,
+//so an integer passes as a number and is widened in place
+static void TypeGuard(TraceCompiler* tc, Register reg, TraceType type, uint8_t* exitIp)
+{
+	Assembler* as = &tc->as;
+	switch (type)
+	{
+	case TYPE_NUMBER:
+	{
+		Move(as, RCX, reg);
+		And(as, RCX, NAN_MASK);
+		Cmp(as, RCX, NAN_MASK);
+		int isDouble = JumpForward(as, CC_NE);
+		MovImm(as, RCX, INTEGER_MASK);
+		And(as, RCX, reg);
+		MovImm(as, RDX, QNAN | TAG_INTEGER);
+		Cmp(as, RCX, RDX);
+		Guard(tc, CC_NE, exitIp);
+		Cvtsi2sd(as, XMM0, reg);
+		MovqFromXmm(as, reg, XMM0);
+		PatchHere(as, isDouble);
+		break;
+	}
+	case TYPE_BOOL:
+		MovImm(as, RCX, ~(uint64_t)1);
+		And(as, RCX, reg);
+		MovImm(as, RDX, FALSE_VAL);
+		Cmp(as, RCX, RDX);
+		Guard(tc, CC_NE, exitIp);
+		break;
+	case TYPE_NIL:
+		MovImm(as, RDX, NIL_VAL);
+		Cmp(as, reg, RDX);
+		Guard(tc, CC_NE, exitIp);
+		break;
+	case TYPE_OBJECT:
+		MovImm(as, RCX, QNAN | SIGN_BIT);
+		And(as, RCX, reg);
+		MovImm(as, RDX, QNAN | SIGN_BIT);
+		Cmp(as, RCX, RDX);
+		Guard(tc, CC_NE, exitIp);
+		break;
+	}
+}
+
+static void Arithmetic(TraceCompiler* tc, SseOp op, int dst, Operand a, Operand b)
+{
+	if (OperandType(tc, a) != TYPE_NUMBER || OperandType(tc, b) != TYPE_NUMBER)
+	{
+		Fail(tc);
+		return;
+	}
+
+	Value x;
+	Value y;
+	if (IsConstant(tc, a, &x) && IsConstant(tc, b, &y))
+	{
+		double result;
+		switch (op)
+		{
+		case SSE_ADD:		result = AS_NUMBER(x) + AS_NUMBER(y); break;
+		case SSE_SUBTRACT:	result = AS_NUMBER(x) - AS_NUMBER(y); break;
+		case SSE_MULTIPLY:	result = AS_NUMBER(x) * AS_NUMBER(y); break;
+		default:			result = AS_NUMBER(x) / AS_NUMBER(y); break;
+		}
+
+		SetConstant(tc, dst, NUMBER_VAL(result));
+		return;
+	}
+
+	LoadOperand(tc, a, XMM0);
+	LoadOperand(tc, b, XMM1);
+	Sse(&tc->as, op, XMM0, XMM1);
+	SetRegister(tc, dst, XMM0, TYPE_NUMBER);
+}
+
+//Sets the flags for the comparison, false if both sides were constants and it was folded into result
+static bool Compare(TraceCompiler* tc, Comparison comparison, Operand a, Operand b, bool* result)
+{
+	if (OperandType(tc, a) != TYPE_NUMBER || OperandType(tc, b) != TYPE_NUMBER)
+	{
+		Fail(tc);
+		return false;
+	}
+
+	Operand left = comparison.swap ? b : a;
+	Operand right = comparison.swap ? a : b;
+
+	Value x;
+	Value y;
+	if (IsConstant(tc, left, &x) && IsConstant(tc, right, &y))
+	{
+		bool above = AS_NUMBER(x) > AS_NUMBER(y);
+		*result = comparison.cc == CC_A ? above : !above;
+		return false;
+	}
+
+	LoadOperand(tc, left, XMM0);
+	LoadOperand(tc, right, XMM1);
+	Ucomisd(&tc->as, XMM0, XMM1);
+	return true;
+}
+
+static void MaterialiseComparison(TraceCompiler* tc, Comparison comparison, int dst, Operand a, Operand b)
+{
+	bool result;
+	if (!Compare(tc, comparison, a, b, &result))
+	{
+		SetConstant(tc, dst, BOOL_VAL(result));
+		return;
+	}
+
+	MovImm(&tc->as, RAX, FALSE_VAL);
+	MovImm(&tc->as, RDX, TRUE_VAL);
+	Cmov(&tc->as, comparison.cc, RAX, RDX);
+	SetBits(tc, dst, RAX, TYPE_BOOL);
+}
+
+//A comparison that feeds a branch never becomes a value, the recorded direction is guarded on the flags instead
+static void CompareAndBranch(TraceCompiler* tc, Comparison comparison, Operand a, Operand b, bool taken, uint8_t* exitIp)
+{
+	bool result;
+	if (!Compare(tc, comparison, a, b, &result))
+	{
+		if (result == taken)
+		{
+			Fail(tc);
+		}
+
+		return;
+	}
+
+	Guard(tc, taken ? comparison.cc : (Condition)(comparison.cc ^ 1), exitIp);
+}
+
+//Leaves the trace if the object in reg is a rope, a slice or a string that isn't interned. Uses RCX, RSI and RDI
+static void InternedGuard(TraceCompiler* tc, Register reg, uint8_t* exitIp)
+{
+	Assembler* as = &tc->as;
+	MovImm(as, RCX, ~(SIGN_BIT | QNAN));
+	And(as, RCX, reg);
+	Load(as, RSI, RCX, offsetof(Obj, type));
+	MovImm(as, RDI, 0xFFFFFFFF); //The type is only the low half of the load
+	And(as, RSI, RDI);
+	MovImm(as, RDI, OBJ_ROPE);
+	Cmp(as, RSI, RDI);
+	Guard(tc, CC_E, exitIp);
+	MovImm(as, RDI, OBJ_SLICE);
+	Cmp(as, RSI, RDI);
+	Guard(tc, CC_E, exitIp);
+	MovImm(as, RDI, OBJ_STRING);
+	Cmp(as, RSI, RDI);
+	int notString = JumpForward(as, CC_NE);
+	Load(as, RSI, RCX, offsetof(ObjString, isInterned));
+	MovImm(as, RDI, 0xFF);
+	And(as, RSI, RDI);
+	Guard(tc, CC_E, exitIp);
+	PatchHere(as, notString);
+}
+
+static void Equal(TraceCompiler* tc, bool negate, uint8_t* ip)
+{
+	int dst = tc->top - 2;
+	Operand a = SlotOperand(tc->top - 2);
+	Operand b = SlotOperand(tc->top - 1);
+	TraceType typeA = OperandType(tc, a);
+	TraceType typeB = OperandType(tc, b);
+
+	//Different objects can still be equal strings if either is a rope, a slice or wasn't interned,
+	//those go back to the interpreter to be compared there
+	Assembler* as = &tc->as;
+	if (typeA == TYPE_OBJECT && typeB == TYPE_OBJECT)
+	{
+		LoadOperandBits(tc, a, RAX);
+		LoadOperandBits(tc, b, RDX);
+		Cmp(as, RAX, RDX);
+		int same = JumpForward(as, CC_E);
+		InternedGuard(tc, RAX, ip);
+		InternedGuard(tc, RDX, ip);
+		PatchHere(as, same);
+	}
+
+	PopSlots(tc, 1);
+
+	Value x;
+	Value y;
+	if (IsConstant(tc, a, &x) && IsConstant(tc, b, &y))
+	{
+		SetConstant(tc, dst, BOOL_VAL(ValuesEqual(x, y) != negate));
+		return;
+	}
+
+	if (typeA != typeB || typeA == TYPE_NIL)
+	{
+		SetConstant(tc, dst, BOOL_VAL((typeA == typeB) != negate));
+		return;
+	}
+
+	if (typeA == TYPE_NUMBER)
+	{
+		//Unordered sets ZF as well as PF, and NaN is never equal to anything
+		LoadOperand(tc, a, XMM0);
+		LoadOperand(tc, b, XMM1);
+		Ucomisd(as, XMM0, XMM1);
+		MovImm(as, RAX, FALSE_VAL);
+		MovImm(as, RDX, TRUE_VAL);
+		Cmov(as, CC_E, RAX, RDX);
+		MovImm(as, RDX, FALSE_VAL);
+		Cmov(as, CC_P, RAX, RDX);
+	}
+	else
+	{
+		LoadOperandBits(tc, a, RAX);
+		LoadOperandBits(tc, b, RDX);
+		Cmp(as, RAX, RDX);
+		MovImm(as, RAX, FALSE_VAL);
+		MovImm(as, RDX, TRUE_VAL);
+		Cmov(as, CC_E, RAX, RDX);
+	}
+
+	if (negate)
+	{
+		MovImm(as, RDX, TRUE_VAL ^ FALSE_VAL);
+		Xor(as, RAX, RDX);
+	}
+
+	SetBits(tc, dst, RAX, TYPE_BOOL);
+}
+
+static void Not(TraceCompiler* tc)
+{
+	int slot = tc->top - 1;
+	TraceType type = OperandType(tc, SlotOperand(slot));
+	Value constant;
+	if (IsConstant(tc, SlotOperand(slot), &constant))
+	{
+		SetConstant(tc, slot, BOOL_VAL(IS_NIL(constant) || (IS_BOOL(constant) && !AS_BOOL(constant))));
+	}
+	else if (type != TYPE_BOOL)
+	{
+		SetConstant(tc, slot, BOOL_VAL(type == TYPE_NIL));
+	}
+	else
+	{
+		LoadOperandBits(tc, SlotOperand(slot), RAX);
+		MovImm(&tc->as, RDX, TRUE_VAL ^ FALSE_VAL);
+		Xor(&tc->as, RAX, RDX);
+		SetBits(tc, slot, RAX, TYPE_BOOL);
+	}
+}
+
+static void Negate(TraceCompiler* tc)
+{
+	int slot = tc->top - 1;
+	if (OperandType(tc, SlotOperand(slot)) != TYPE_NUMBER)
+	{
+		Fail(tc);
+		return;
+	}
+
+	Value constant;
+	if (IsConstant(tc, SlotOperand(slot), &constant))
+	{
+		SetConstant(tc, slot, NUMBER_VAL(-AS_NUMBER(constant)));
+		return;
+	}
+
+	LoadOperandBits(tc, SlotOperand(slot), RAX);
+	MovImm(&tc->as, RDX, SIGN_BIT);
+	Xor(&tc->as, RAX, RDX);
+	SetBits(tc, slot, RAX, TYPE_NUMBER);
+}
+
+//Follows the recorded direction of a falsey check on the top of the stack
+static void JumpIfFalse(TraceCompiler* tc, bool pop, bool taken, uint8_t* exitIp)
+{
+	int slot = tc->top - 1;
+	TraceType type = OperandType(tc, SlotOperand(slot));
+	Value constant;
+	if (IsConstant(tc, SlotOperand(slot), &constant) || type != TYPE_BOOL)
+	{
+		bool isFalsey = type == TYPE_NIL || (type == TYPE_BOOL && !AS_BOOL(constant));
+		if (isFalsey != taken)
+		{
+			Fail(tc);
+		}
+	}
+	else
+	{
+		LoadOperandBits(tc, SlotOperand(slot), RAX);
+		MovImm(&tc->as, RDX, TRUE_VAL);
+		Cmp(&tc->as, RAX, RDX);
+		if (pop)
+		{
+			PopSlots(tc, 1);
+		}
+
+		Guard(tc, taken ? CC_E : CC_NE, exitIp);
+		if (!pop)
+		{
+			SetConstant(tc, slot, BOOL_VAL(!taken));
+		}
+
+		return;
+	}
+
+	if (pop)
+	{
+		PopSlots(tc, 1);
+	}
+}
+
+//The stack comparisons and a branch straight after them are compiled together, index is the comparison's
+static void StackComparison(TraceCompiler* tc, Comparison comparison, Operand b, int index, bool* fused)
+{
+	int dst = b.slot == -1 ? tc->top - 1 : tc->top - 2;
+	Operand a = SlotOperand(dst);
+	*fused = false;
+
+	uint8_t* next = index + 2 < recorder.count ? recorder.instructions[index + 1] : NULL;
+	if (next != NULL && (*next == OP_JUMP_IF_FALSE || *next == OP_JUMP_IF_FALSE_POP))
+	{
+		uint16_t jump = (uint16_t)((next[1] << 8) | next[2]);
+		bool taken = recorder.instructions[index + 2] == next + 3 + jump;
+		uint8_t* exitIp = taken ? next + 3 : next + 3 + jump;
+		bool pop = *next == OP_JUMP_IF_FALSE_POP;
+
+		//Both operands have been read into XMM0 and XMM1 before the slots are given up
+		bool result;
+		bool flags = Compare(tc, comparison, a, b, &result);
+		PopSlots(tc, tc->top - dst);
+		if (!pop)
+		{
+			SetConstant(tc, PushSlot(tc), BOOL_VAL(taken));
+		}
+
+		if (flags)
+		{
+			Guard(tc, taken ? comparison.cc : (Condition)(comparison.cc ^ 1), exitIp);
+		}
+		else if (result == taken)
+		{
+			Fail(tc);
+		}
+
+		if (!pop)
+		{
+			SetConstant(tc, tc->top - 1, BOOL_VAL(!taken));
+		}
+
+		*fused = true;
+		return;
+	}
+
+	MaterialiseComparison(tc, comparison, dst, a, b);
+	PopSlots(tc, tc->top - dst - 1);
+}
+
+//Leaves the address of the upvalue's value in RDX
+static void UpvalueAddress(TraceCompiler* tc, uint8_t slot)
+{
+	Load(&tc->as, RDX, FRAME, offsetof(CallFrame, closure));
+	Load(&tc->as, RDX, RDX, (int32_t)(offsetof(ObjClosure, upvalues) + slot * sizeof(ObjUpvalue*)));
+	Load(&tc->as, RDX, RDX, offsetof(ObjUpvalue, location));
+}
+
+static void GlobalsAddress(TraceCompiler* tc)
+{
+	MovImm(&tc->as, RDX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+	Load(&tc->as, RDX, RDX, 0);
+}
+
+static void TracePrint(Value value)
+{
+	PrintValue(value);
+	printf_s("\n");
+}
+
+//Compiles the instruction at index, returning how many recorded instructions it used up
+static int CompileInstruction(TraceCompiler* tc, int index)
+{
+	uint8_t* ip = recorder.instructions[index];
+	uint8_t* operands = ip + 1;
+	int length = InstructionLength(tc->chunk, (int)(ip - tc->chunk->code));
+	uint8_t* next = ip + length;
+	uint8_t* nextRecorded = index + 1 < recorder.count ? recorder.instructions[index + 1] : NULL;
+	Assembler* as = &tc->as;
+	Chunk* chunk = tc->chunk;
+	bool fused = false;
+#define constant (chunk->constants.values[operands[0]])
+#define operandShort ((uint16_t)((operands[0] << 8) | operands[1]))
+#define TOP(distance) SlotOperand(tc->top - 1 - (distance))
+#define STACK_ARITHMETIC(op) \
+	do { \
+		Arithmetic(tc, op, tc->top - 2, TOP(1), TOP(0)); \
+		PopSlots(tc, 1); \
+	} while (false)
+#define SLOT_ARITHMETIC(op, isConstant) \
+	do { \
+		Operand b = isConstant ? ConstantOperand(chunk->constants.values[operands[2]]) : SlotOperand(operands[2]); \
+		if (ValidSlot(tc, operands[0])) { \
+			Arithmetic(tc, op, operands[0], SlotOperand(operands[1]), b); \
+		} \
+	} while (false)
+
+	switch (*ip)
+	{
+	case OP_CONSTANT:	SetConstant(tc, PushSlot(tc), constant); break;
+	case OP_NIL:		SetConstant(tc, PushSlot(tc), NIL_VAL); break;
+	case OP_TRUE:		SetConstant(tc, PushSlot(tc), TRUE_VAL); break;
+	case OP_FALSE:		SetConstant(tc, PushSlot(tc), FALSE_VAL); break;
+	case OP_POP:		PopSlots(tc, 1); break;
+	case OP_POPN:		PopSlots(tc, operands[0]); break;
+	case OP_GET_LOCAL_0:
+	case OP_GET_LOCAL_1:
+	case OP_GET_LOCAL_2:
+	case OP_GET_LOCAL_3:
+	{
+		Operand local = SlotOperand(*ip - OP_GET_LOCAL_0);
+		CopySlot(tc, PushSlot(tc), local);
+		break;
+	}
+	case OP_GET_LOCAL:
+	{
+		Operand local = SlotOperand(operands[0]);
+		CopySlot(tc, PushSlot(tc), local);
+		break;
+	}
+	case OP_SET_LOCAL:
+		if (ValidSlot(tc, operands[0]))
+		{
+			CopySlot(tc, operands[0], TOP(0));
+		}
+		break;
+	case OP_SET_LOCAL_POP:
+		if (ValidSlot(tc, operands[0]))
+		{
+			CopySlot(tc, operands[0], TOP(0));
+		}
+		PopSlots(tc, 1);
+		break;
+	case OP_GET_GLOBAL:
+		GlobalsAddress(tc);
+		Load(as, RAX, RDX, operandShort * (int32_t)sizeof(Value));
+		TypeGuard(tc, RAX, (TraceType)recorder.observed[index], ip);
+		SetBits(tc, PushSlot(tc), RAX, (TraceType)recorder.observed[index]);
+		break;
+	case OP_SET_GLOBAL:
+		LoadOperandBits(tc, TOP(0), RAX);
+		GlobalsAddress(tc);
+		Store(as, RDX, operandShort * (int32_t)sizeof(Value), RAX);
+		break;
+	case OP_GET_UPVALUE:
+		UpvalueAddress(tc, operands[0]);
+		Load(as, RAX, RDX, 0);
+		TypeGuard(tc, RAX, (TraceType)recorder.observed[index], ip);
+		SetBits(tc, PushSlot(tc), RAX, (TraceType)recorder.observed[index]);
+		break;
+	case OP_SET_UPVALUE:
+		//Traces don't run the write barrier, which only objects need
+		if (OperandType(tc, TOP(0)) == TYPE_OBJECT)
+		{
+			Fail(tc);
+		}
+
+#ifdef GC_THREAD_AVAILABLE
+		//Nor the snapshot barrier, which any store needs while the marker thread runs, so the interpreter does those
+		MovImm(as, RDX, (uint64_t)(uintptr_t)&vm.gcMarking);
+		Load(as, RDX, RDX, 0);
+		MovImm(as, RCX, 0xFF); //The flag is only the low byte of the load
+		And(as, RDX, RCX);
+		Guard(tc, CC_NE, ip);
+#endif //GC_THREAD_AVAILABLE
+
+		LoadOperandBits(tc, TOP(0), RAX);
+		UpvalueAddress(tc, operands[0]);
+		Store(as, RDX, 0, RAX);
+		break;
+	case OP_EQUAL:			Equal(tc, false, ip); break;
+	case OP_NOT_EQUAL:		Equal(tc, true, ip); break;
+	case OP_GREATER:		StackComparison(tc, (Comparison) { false, CC_A }, TOP(0), index, &fused); break;
+	case OP_LESS:			StackComparison(tc, (Comparison) { true, CC_A }, TOP(0), index, &fused); break;
+	case OP_GREATER_EQUAL:	StackComparison(tc, (Comparison) { true, CC_BE }, TOP(0), index, &fused); break;
+	case OP_LESS_EQUAL:		StackComparison(tc, (Comparison) { false, CC_BE }, TOP(0), index, &fused); break;
+	case OP_LESS_CONSTANT:	StackComparison(tc, (Comparison) { true, CC_A }, ConstantOperand(constant), index, &fused); break;
+	case OP_ADD:
+	case OP_ADD_NUMBER:
+	case OP_ADD_STRING:		STACK_ARITHMETIC(SSE_ADD); break;
+	case OP_SUBTRACT:		STACK_ARITHMETIC(SSE_SUBTRACT); break;
+	case OP_MULTIPLY:		STACK_ARITHMETIC(SSE_MULTIPLY); break;
+	case OP_DIVIDE:			STACK_ARITHMETIC(SSE_DIVIDE); break;
+	case OP_ADD_CONSTANT:		Arithmetic(tc, SSE_ADD, tc->top - 1, TOP(0), ConstantOperand(constant)); break;
+	case OP_SUBTRACT_CONSTANT:	Arithmetic(tc, SSE_SUBTRACT, tc->top - 1, TOP(0), ConstantOperand(constant)); break;
+	case OP_ADD_LOCALS:
+	{
+		int dst = PushSlot(tc);
+		Arithmetic(tc, SSE_ADD, dst, SlotOperand(operands[0]), SlotOperand(operands[1]));
+		break;
+	}
+	case OP_NOT:		Not(tc); break;
+	case OP_NEGATE:		Negate(tc); break;
+	case OP_PRINT:
+		//Calling out clobbers the temporaries, so only a print with nothing else on the stack is compiled
+		if (tc->top - 1 != tc->depth)
+		{
+			Fail(tc);
+			break;
+		}
+
+		LoadOperandBits(tc, TOP(0), RDI);
+		MovImm(as, RAX, (uint64_t)(uintptr_t)TracePrint);
+		CallReg(as, RAX);
+		PopSlots(tc, 1);
+		break;
+	case OP_JUMP:
+	case OP_LOOP:
+		break;
+	case OP_JUMP_IF_FALSE:
+	case OP_JUMP_IF_FALSE_POP:
+	{
+		uint8_t* target = next + operandShort;
+		bool taken = nextRecorded == target;
+		JumpIfFalse(tc, *ip == OP_JUMP_IF_FALSE_POP, taken, taken ? next : target);
+		break;
+	}
+	case OP_COPY_LOCAL:
+		if (ValidSlot(tc, operands[0]))
+		{
+			CopySlot(tc, operands[0], SlotOperand(operands[1]));
+		}
+		break;
+	case OP_STORE_CONSTANT:
+		if (ValidSlot(tc, operands[0]))
+		{
+			SetConstant(tc, operands[0], chunk->constants.values[operands[1]]);
+		}
+		break;
+	case OP_ADD_LL:			SLOT_ARITHMETIC(SSE_ADD, false); break;
+	case OP_ADD_LK:			SLOT_ARITHMETIC(SSE_ADD, true); break;
+	case OP_SUBTRACT_LL:	SLOT_ARITHMETIC(SSE_SUBTRACT, false); break;
+	case OP_SUBTRACT_LK:	SLOT_ARITHMETIC(SSE_SUBTRACT, true); break;
+	case OP_MULTIPLY_LL:	SLOT_ARITHMETIC(SSE_MULTIPLY, false); break;
+	case OP_MULTIPLY_LK:	SLOT_ARITHMETIC(SSE_MULTIPLY, true); break;
+	case OP_DIVIDE_LL:		SLOT_ARITHMETIC(SSE_DIVIDE, false); break;
+	case OP_DIVIDE_LK:		SLOT_ARITHMETIC(SSE_DIVIDE, true); break;
+	case OP_JUMP_IF_NOT_LESS_LL:
+	case OP_JUMP_IF_NOT_LESS_LK:
+	case OP_JUMP_IF_NOT_GREATER_LL:
+	case OP_JUMP_IF_NOT_GREATER_LK:
+	{
+		bool isLess = *ip == OP_JUMP_IF_NOT_LESS_LL || *ip == OP_JUMP_IF_NOT_LESS_LK;
+		bool isConstant = *ip == OP_JUMP_IF_NOT_LESS_LK || *ip == OP_JUMP_IF_NOT_GREATER_LK;
+		Operand b = isConstant ? ConstantOperand(chunk->constants.values[operands[1]]) : SlotOperand(operands[1]);
+		uint8_t* target = next + (uint16_t)((operands[2] << 8) | operands[3]);
+		bool taken = nextRecorded == target;
+		CompareAndBranch(tc, (Comparison) { isLess, CC_A }, SlotOperand(operands[0]), b, taken, taken ? next : target);
+		break;
+	}
+	default:
+		Fail(tc);
+		break;
+	}
+
+#undef constant
+#undef operandShort
+#undef TOP
+#undef STACK_ARITHMETIC
+#undef SLOT_ARITHMETIC
+
+	return fused ? 2 : 1;
+}
+
+static void EmitExit(TraceCompiler* tc, TraceExit* exit, int epilogue[], int* epilogueCount)
+{
+	Assembler* as = &tc->as;
+	PatchHere(as, exit->patch);
+	for (int slot = tc->depth; slot < exit->top; slot++)
+	{
+		TraceValue* value = &tc->snapshots[exit->snapshot + slot - tc->depth];
+		if (value->kind == VALUE_CONSTANT)
+		{
+			MovValue(as, RAX, value->constant);
+			Store(as, SLOTS, slot * (int32_t)sizeof(Value), RAX);
+		}
+		else
+		{
+			StoreXmm(as, SLOTS, slot * (int32_t)sizeof(Value), Temporary(tc, slot));
+		}
+	}
+
+	Move(as, RAX, SLOTS);
+	AddImm(as, RAX, exit->top * (int32_t)sizeof(Value));
+	Store(as, STACK_TOP_ADDRESS, 0, RAX);
+	MovImm(as, RAX, (uint64_t)(uintptr_t)exit->ip);
+	Store(as, FRAME, offsetof(CallFrame, ip), RAX);
+	epilogue[(*epilogueCount)++] = JumpForward(as, CC_ALWAYS);
+}
+
+static Trace* CompileTrace()
+{
+	TraceCompiler tc = { 0 };
+	tc.chunk = &recorder.closure->function->chunk;
+	tc.depth = recorder.depth;
+	tc.top = recorder.depth;
+	for (int slot = 0; slot < recorder.depth; slot++)
+	{
+		tc.slotTypes[slot] = recorder.entryTypes[slot];
+	}
+
+	Assembler* as = &tc.as;
+	Prologue(as);
+	int toGuards = JumpForward(as, CC_ALWAYS);
+	int loopStart = as->count;
+
+	//The last recorded instruction is the back edge
+	for (int index = 0; index < recorder.count - 1 && !tc.failed;)
+	{
+		index += CompileInstruction(&tc, index);
+	}
+
+	//Only loop straight back if every slot the body relies on still has the type it was checked for
+	bool stable = tc.top == tc.depth;
+	for (int slot = 0; slot < tc.depth; slot++)
+	{
+		stable &= !tc.guarded[slot] || tc.slotTypes[slot] == recorder.entryTypes[slot];
+	}
+
+	//Otherwise the back edge falls through into the entry checks and most likely leaves the trace
+	if (stable)
+	{
+		PatchJump(as, JumpForward(as, CC_ALWAYS), loopStart);
+	}
+
+	PatchHere(as, toGuards);
+	tc.top = tc.depth;
+	for (int slot = 0; slot < tc.depth; slot++)
+	{
+		if (tc.guarded[slot])
+		{
+			Load(as, RAX, SLOTS, slot * (int32_t)sizeof(Value));
+			TypeGuard(&tc, RAX, (TraceType)recorder.entryTypes[slot], recorder.header);
+			if (recorder.entryTypes[slot] == TYPE_NUMBER)
+			{
+				Store(as, SLOTS, slot * (int32_t)sizeof(Value), RAX);
+			}
+		}
+	}
+
+	PatchJump(as, JumpForward(as, CC_ALWAYS), loopStart);
+
+	int* epilogue = (int*)GrowBuffer(NULL, sizeof(int) * ((size_t)tc.exitCount + 1));
+	int epilogueCount = 0;
+	for (int idx = 0; idx < tc.exitCount; idx++)
+	{
+		EmitExit(&tc, &tc.exits[idx], epilogue, &epilogueCount);
+	}
+
+	for (int idx = 0; idx < epilogueCount; idx++)
+	{
+		PatchHere(as, epilogue[idx]);
+	}
+
+	Epilogue(as);
+	free(epilogue);
+	free(tc.exits);
+	free(tc.snapshots);
+	free(as->fixups);
+
+	if (tc.failed)
+	{
+		free(as->code);
+		free(as->relocs);
+		return NULL;
+	}
+
+	size_t size = as->count;
+	uint8_t* code = MakeExecutable(as);
+	if (code == NULL)
+	{
+		free(as->relocs);
+		return NULL;
+	}
+
+	Trace* trace = (Trace*)GrowBuffer(NULL, sizeof(Trace));
+	trace->header = recorder.header;
+	trace->depth = recorder.depth;
+	trace->code = code;
+	trace->size = size;
+	trace->relocs = as->relocs;
+	trace->relocCount = as->relocCount;
+	return trace;
+}
+
+static bool StopRecording(bool backOff)
+{
+	if (backOff)
+	{
+		vm.hotLoops[HOT_LOOP_SLOT(recorder.header)] = HOT_LOOP_BACKOFF;
+	}
+
+	recorder.header = NULL;
+	return false;
+}
+
+bool StartRecording(CallFrame* frame, uint8_t* header)
+{
+	recorder.frame = frame;
+	recorder.closure = frame->closure;
+	recorder.header = header;
+	recorder.depth = (int)(vm.stackTop - frame->slots);
+	recorder.count = 0;
+
+	if (recorder.depth > UINT8_COUNT)
+	{
+		return StopRecording(true);
+	}
+
+	for (int slot = 0; slot < recorder.depth; slot++)
+	{
+		recorder.entryTypes[slot] = TypeOf(frame->slots[slot]);
+	}
+
+	return true;
+}
+
+bool RecordInstruction(CallFrame* frame, uint8_t* ip)
+{
+	if (recorder.header == NULL)
+	{
+		return false;
+	}
+
+	if (frame != recorder.frame || frame->closure != recorder.closure || recorder.count == MAX_TRACE_LENGTH)
+	{
+		return StopRecording(true);
+	}
+
+	int index = recorder.count++;
+	recorder.instructions[index] = ip;
+
+	switch (*ip)
+	{
+	case OP_GET_GLOBAL:
+		recorder.observed[index] = TypeOf(vm.globalValues.values[(ip[1] << 8) | ip[2]]);
+		return true;
+	case OP_GET_UPVALUE:
+		recorder.observed[index] = TypeOf(*frame->closure->upvalues[ip[1]]->location);
+		return true;
+	case OP_LOOP:
+	{
+		//A for loop's body loops back to its increment, which is fine as long as the trace hasn't been there yet.
+		//Going back over recorded code means an inner loop, and that gets a trace of its own
+		uint8_t* target = ip + 3 - ((ip[1] << 8) | ip[2]);
+		if (target != recorder.header)
+		{
+			for (int idx = 0; idx < index; idx++)
+			{
+				if (recorder.instructions[idx] == target)
+				{
+					return StopRecording(true);
+				}
+			}
+
+			return true;
+		}
+
+		Trace* trace = CompileTrace();
+		if (trace == NULL)
+		{
+			return StopRecording(true);
+		}
+
+		ObjFunction* function = recorder.closure->function;
+		trace->next = function->traces;
+		function->traces = trace;
+		*ip = OP_TRACE_LOOP;
+		return StopRecording(false);
+	}
+	case OP_CALL:
+	case OP_TAIL_CALL:
+	case OP_INVOKE:
+	case OP_SUPER_INVOKE:
+	case OP_TAIL_INVOKE:
+	case OP_TAIL_SUPER_INVOKE:
+	case OP_RETURN:
+	case OP_TRACE_LOOP:
+	case OP_GET_PROPERTY:
+	case OP_GET_FIELD:
+	case OP_GET_METHOD:
+	case OP_SET_PROPERTY:
+	case OP_GET_SUPER:
+	case OP_DEFINE_GLOBAL:
+	case OP_CLOSURE:
+	case OP_CLOSE_UPVAL:
+	case OP_CLASS:
+	case OP_INHERIT:
+	case OP_METHOD:
+	case OP_BUILD_STRING:
+		return StopRecording(true);
+	default:
+		return true;
+	}
+}
+
+void RunTrace(CallFrame* frame)
+{
+	for (Trace* trace = frame->closure->function->traces; trace != NULL; trace = trace->next)
+	{
+		if (trace->header == frame->ip && vm.stackTop - frame->slots == trace->depth)
+		{
+			((TraceFunction)(uintptr_t)trace->code)(frame);
+			return;
+		}
+	}
+}
+
+void FreeTraces(Trace* trace)
+{
+	while (trace != NULL)
+	{
+		Trace* next = trace->next;
+		FreeExecutable(trace->code, trace->size);
+		free(trace->relocs);
+		free(trace);
+		trace = next;
+	}
+}
+
+#endif //JIT_AVAILABLE
@@ -0,0 +1,32 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "common.h"
+
+#ifdef JIT_AVAILABLE
+#include "object.h"
+#include "vm.h"
+
+//A compiled loop body, entered from the loop's back edge and left through a guard once it stops matching what was recorded
+typedef struct Trace
+{
+	struct Trace* next;
+	uint8_t* header;
+	int depth; //Stack slots the frame has in use at the loop header
+	uint8_t* code;
+	size_t size;
+	struct Reloc* relocs;
+	int relocCount;
+} Trace;
+
+//Called from the back edge of a hot loop, true if the interpreter should start feeding instructions to RecordInstruction
+bool StartRecording(CallFrame* frame, uint8_t* header);
+//Called before each instruction while recording, false once the recording has finished or been abandoned
+bool RecordInstruction(CallFrame* frame, uint8_t* ip);
+//Runs the trace for the loop at frame->ip, leaving frame->ip and the stack wherever it exits
+void RunTrace(CallFrame* frame);
+void FreeTraces(Trace* trace);
+
+#endif //JIT_AVAILABLE
+
+#endif
@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -31,52 +32,125 @@ void FreeValueArray(ValueArray* array)
 	InitValueArray(array);
 }
 
+//Ropes are printed leaf by leaf, everything else through DescribeValue
 void PrintValue(Value value)
 {
-#ifdef NAN_BOXING
+	if (IS_ROPE(value))
+	{
+		PrintRope(AS_ROPE(value));
+		return;
+	}
+
+	ValueText text;
+	DescribeValue(value, &text);
+	fwrite(text.prefix, 1, strlen(text.prefix), stdout);
+	fwrite(text.chars, 1, text.length, stdout);
+	fwrite(text.suffix, 1, strlen(text.suffix), stdout);
+}
+
+void DescribeValue(Value value, ValueText* text)
+{
+	text->prefix = "";
+	text->suffix = "";
 	if (IS_BOOL(value))
 	{
-		printf_s(AS_BOOL(value) ? "true" : "false");
+		text->chars = AS_BOOL(value) ? "true" : "false";
+		text->length = AS_BOOL(value) ? 4 : 5;
 	}
 	else if (IS_NIL(value))
 	{
-		printf_s("nil");
+		text->chars = "nil";
+		text->length = 3;
 	}
 	else if (IS_NUMBER(value))
 	{
-		printf_s("%g", AS_NUMBER(value));
+		text->length = FormatNumber(AS_NUMBER(value), text->number);
+		text->chars = text->number;
 	}
 	else if (IS_OBJ(value))
 	{
-		PrintObject(AS_OBJ(value));
+		DescribeObject(value, text);
 	}
-#else
-	switch (value.type)
-	{
-	case VAL_BOOL:
-		printf_s(AS_BOOL(value) ? "true" : "false");
-		break;
-	case VAL_NIL:
-		printf_s("nil");
-		break;
-	case VAL_NUMBER:
-		printf_s("%g", AS_NUMBER(value));
-		break;
-	case VAL_OBJ:
-		PrintObject(value);
-		break;
+	else
+	{
+		//Only the marker for a global that hasn't been defined yet gets here
+		text->chars = "";
+		text->length = 0;
 	}
-#endif //NAN_BOXING
+}
+
+//Writes the number and returns the length. Whole numbers below a million are written digit by digit, %g only
+//switches to an exponent past six digits so they come out the same
+int FormatNumber(double number, char* buffer)
+{
+	if (!(number > -1000000 && number < 1000000) || number != (int)number || (number == 0 && signbit(number)))
+	{
+		return snprintf(buffer, NUMBER_CHARS, "%g", number);
+	}
+
+	int whole = (int)number;
+	int magnitude = whole < 0 ? -whole : whole;
+	char digits[8];
+	int count = 0;
+	do
+	{
+		digits[count++] = (char)('0' + magnitude % 10);
+		magnitude /= 10;
+	} while (magnitude > 0);
+
+	int length = 0;
+	if (whole < 0)
+	{
+		buffer[length++] = '-';
+	}
+
+	while (count > 0)
+	{
+		buffer[length++] = digits[--count];
+	}
+
+	buffer[length] = '\0';
+	return length;
+}
+
+//Two interned strings are only equal if they're the same object, anything made at runtime is compared by its characters
+static bool FlatEqual(Obj* a, Obj* b)
+{
+	if (a == b)
+	{
+		return true;
+	}
+
+	if (a->type == OBJ_STRING && b->type == OBJ_STRING && ((ObjString*)a)->isInterned && ((ObjString*)b)->isInterned)
+	{
+		return false;
+	}
+
+	int lengthA;
+	int lengthB;
+	const char* charsA = FlatChars(a, &lengthA);
+	const char* charsB = FlatChars(b, &lengthB);
+	return lengthA == lengthB && memcmp(charsA, charsB, lengthA) == 0;
 }
 
 bool ValuesEqual(Value a, Value b)
 {
 #ifdef NAN_BOXING
+	if (IS_INTEGER(a) && IS_INTEGER(b))
+	{
+		return a == b;
+	}
+
 	if (IS_NUMBER(a) && IS_NUMBER(b))
 	{
 		return AS_NUMBER(a) == AS_NUMBER(b);
 	}
 
+	if (a != b && IsFlat(a) && IsFlat(b))
+	{
+		return FlatEqual(AS_OBJ(a), AS_OBJ(b));
+	}
+
 	return a == b;
 #else
 	if (a.type != b.type)
@@ -89,7 +163,7 @@ bool ValuesEqual(Value a, Value b)
 	case VAL_BOOL:		return AS_BOOL(a) == AS_BOOL(b);
 	case VAL_NIL:		return true;
 	case VAL_NUMBER:	return AS_NUMBER(a) == AS_NUMBER(b);
-	case VAL_OBJ:		return AS_OBJ(a) == AS_OBJ(b);
+	case VAL_OBJ:		return IsFlat(a) && IsFlat(b) ? FlatEqual(AS_OBJ(a), AS_OBJ(b)) : AS_OBJ(a) == AS_OBJ(b);
 	default:			return false; //Unreachable
 	}
 #endif //NAN_BOXING
@@ -18,15 +18,25 @@ typedef struct ObjString ObjString;
 #define TAG_NIL				1
 #define TAG_FALSE			2
 #define TAG_TRUE			3
+#define TAG_UNDEFINED		4
+
+//Numbers that fit in 32 bits are kept as integers in the low half of a quiet NaN with this bit set.
+//Hardware NaNs never have QNAN's low bit set, so they can't be mistaken for one
+#define TAG_INTEGER			((uint64_t)0x0002000000000000)
+#define INTEGER_MASK		(SIGN_BIT | QNAN | TAG_INTEGER)
 
 typedef uint64_t Value;
 
 #define IS_NIL(value)		((value) == NIL_VAL)
-#define IS_NUMBER(value)	(((value) & QNAN) != QNAN)
+#define IS_DOUBLE(value)	(((value) & QNAN) != QNAN)
+#define IS_INTEGER(value)	(((value) & INTEGER_MASK) == (QNAN | TAG_INTEGER))
+#define IS_NUMBER(value)	(IS_DOUBLE(value) || IS_INTEGER(value))
 #define IS_BOOL(value)		(((value) | 1) == TRUE_VAL)
 #define IS_OBJ(value)		(((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value)	((value) == UNDEFINED_VAL)
 
 #define AS_NUMBER(value)	ValueToNum(value)
+#define AS_INTEGER(value)	((int32_t)(uint32_t)(value))
 #define AS_BOOL(value)		((value) == TRUE_VAL)
 #define AS_OBJ(value)		((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
@@ -34,7 +44,9 @@ typedef uint64_t Value;
 #define FALSE_VAL			((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL			((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL				((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL		((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num)		NumToValue(num)
+#define INTEGER_VAL(i)		((Value)(QNAN | TAG_INTEGER | (uint32_t)(int32_t)(i)))
 #define OBJ_VAL(obj)		(Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
 static inline Value NumToValue(double num)
@@ -46,11 +58,39 @@ static inline Value NumToValue(double num)
 
 static inline double ValueToNum(Value value)
 {
+	if (IS_INTEGER(value))
+	{
+		return (double)AS_INTEGER(value);
+	}
+
 	double num;
 	memcpy(&num, &value, sizeof(Value));
 	return num;
 }
 
+//The result of integer arithmetic, which only becomes a double once it no longer fits
+static inline Value IntegerValue(int64_t integer)
+{
+	return integer == (int32_t)integer ? INTEGER_VAL(integer) : NUMBER_VAL((double)integer);
+}
+
+static inline Value IntegerSum(int32_t a, int32_t b)
+{
+	return IntegerValue((int64_t)a + b);
+}
+
+static inline Value IntegerDifference(int32_t a, int32_t b)
+{
+	return IntegerValue((int64_t)a - b);
+}
+
+//-0 has no integer form, so a zero product with a negative factor has to be a double
+static inline Value IntegerProduct(int32_t a, int32_t b)
+{
+	int64_t product = (int64_t)a * b;
+	return product == 0 && (a < 0 || b < 0) ? NUMBER_VAL(-0.0) : IntegerValue(product);
+}
+
 #else
 
 typedef enum
@@ -58,7 +98,8 @@ typedef enum
 	VAL_BOOL,
 	VAL_NIL,
 	VAL_NUMBER,
-	VAL_OBJ
+	VAL_OBJ,
+	VAL_UNDEFINED
 } ValueType;
 
 typedef struct
@@ -76,6 +117,7 @@ typedef struct
 #define IS_NIL(value)		((value).type == VAL_NIL)
 #define IS_NUMBER(value)	((value).type == VAL_NUMBER)
 #define IS_OBJ(value)		((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value)	((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value)		((value).as.boolean)
 #define AS_NUMBER(value)	((value).as.number)
@@ -84,10 +126,22 @@ typedef struct
 #define BOOL_VAL(value)		((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL				((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value)	((Value){VAL_NUMBER, {.number = value}})
-#define OBJ_VAL(object)		((Value){VAL_OBJ, {.obj = object}})
+#define OBJ_VAL(object)		((Value){VAL_OBJ, {.obj = (Obj*)(object)}})
+#define UNDEFINED_VAL		((Value){VAL_UNDEFINED, {.number = 0}})
+
+//Every number is a double in this representation, so the integer fast paths compile away
+#define IS_INTEGER(value)	false
+#define AS_INTEGER(value)	0
+#define INTEGER_VAL(i)		NUMBER_VAL((double)(i))
+#define IntegerValue(i)		NUMBER_VAL((double)(i))
+#define IntegerSum(a, b)		NUMBER_VAL((double)(a) + (b))
+#define IntegerDifference(a, b)	NUMBER_VAL((double)(a) - (b))
+#define IntegerProduct(a, b)	NUMBER_VAL((double)(a) * (b))
 
 #endif //NAN_BOXING
 
+//UNDEFINED_VAL marks a global slot that has been named but not yet defined, it is never visible to Lox code
+
 typedef struct
 {
 	int capacity;
@@ -102,4 +156,22 @@ void WriteValueArray(ValueArray* array, Value value);
 void FreeValueArray(ValueArray* array);
 void PrintValue(Value value);
 
+//Room for anything FormatNumber writes, the longest is something like -1.23457e-308
+#define NUMBER_CHARS 24
+int FormatNumber(double number, char* buffer);
+
+//The text PrintValue writes for a value, kept in pieces so it can be measured and copied without being printed.
+//The variable part sits between two fixed strings, like a function's name between "<fn " and ">", and a number
+//is formatted into number
+typedef struct
+{
+	const char* prefix;
+	const char* chars;
+	int length;
+	const char* suffix;
+	char number[NUMBER_CHARS];
+} ValueText;
+
+void DescribeValue(Value value, ValueText* text);
+
 #endif
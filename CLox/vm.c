@@ -1,5 +1,7 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -8,17 +10,78 @@
 #include "compiler.h"
 #include "object.h"
 #include "memory.h"
+#include "shape.h"
+#include "jit.h"
+#include "trace.h"
 #ifdef DEBUG_TRACE_EXECUTION
 #include "debug.h"
 #endif //DEBUG_TRACE_EXECUTION
 
 VM vm;
 
+static void CloseUpvalues(Value* last);
+
 static Value NAT_clock(int argCount, Value* args)
 {
 	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+static bool IsIndex(Value value)
+{
+	if (!IS_NUMBER(value))
+	{
+		return false;
+	}
+
+	double number = AS_NUMBER(value);
+	return number >= 0 && number <= INT32_MAX && number == (int)number;
+}
+
+//substring(string, start, end) is the characters from start up to but not including end, or nil if those don't fit
+static Value NAT_substring(int argCount, Value* args)
+{
+	if (argCount != 3 || !IsIndex(args[1]) || !IsIndex(args[2]))
+	{
+		return NIL_VAL;
+	}
+
+	int start = (int)AS_NUMBER(args[1]);
+	int end = (int)AS_NUMBER(args[2]);
+	ObjString* string;
+	if (IS_ROPE(args[0]))
+	{
+		string = FlattenRope(AS_ROPE(args[0]));
+	}
+	else if (IS_SLICE(args[0]))
+	{
+		//Slices of slices point at the original string
+		ObjSlice* slice = AS_SLICE(args[0]);
+		if (end < start || end > slice->length)
+		{
+			return NIL_VAL;
+		}
+
+		string = slice->parent;
+		start += slice->start;
+		end += slice->start;
+	}
+	else if (IS_STRING(args[0]))
+	{
+		string = AS_STRING(args[0]);
+	}
+	else
+	{
+		return NIL_VAL;
+	}
+
+	if (end < start || end > string->length)
+	{
+		return NIL_VAL;
+	}
+
+	return OBJ_VAL(Substring(string, start, end - start));
+}
+
 static void ResetStack()
 {
 	vm.stackTop = vm.stack;
@@ -55,45 +118,161 @@ static void RuntimeError(uint8_t* ip, const char* format, ...)
 	ResetStack();
 }
 
-static void DefineNative(const char* name, NativeFn function)
+int GlobalSlot(ObjString* name)
 {
-	Push(OBJ_VAL(CopyString(name, (int)(strlen(name)))));
-	Push(OBJ_VAL(NewNative(function)));
-	TableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-	Pop(1);
+	Value slot;
+	if (TableGet(&vm.globalSlots, name, &slot))
+	{
+		return (int)AS_NUMBER(slot);
+	}
+
+	Push(OBJ_VAL(name));
+	WriteValueArray(&vm.globalValues, UNDEFINED_VAL);
+	WriteValueArray(&vm.globalNames, OBJ_VAL(name));
+	TableSet(&vm.globalSlots, name, NUMBER_VAL((double)vm.globalValues.count - 1));
 	Pop(1);
+	return vm.globalValues.count - 1;
+}
+
+int NewHandle(Value value)
+{
+	if (vm.handleCapacity < vm.handleCount + 1)
+	{
+		vm.handleCapacity = GROW_CAPACITY(vm.handleCapacity);
+		vm.handles = (Value*)realloc(vm.handles, sizeof(Value) * vm.handleCapacity);
+
+		if (vm.handles == NULL)
+		{
+			exit(1);
+		}
+	}
+
+	vm.handles[vm.handleCount] = value;
+	return vm.handleCount++;
+}
+
+Value HandleValue(int handle)
+{
+	return vm.handles[handle];
+}
+
+void ReleaseHandles(int handle)
+{
+	vm.handleCount = handle;
+}
+
+static void DefineNative(const char* name, NativeFn function)
+{
+	int nameHandle = NewHandle(OBJ_VAL(CopyString(name, (int)(strlen(name)))));
+	int nativeHandle = NewHandle(OBJ_VAL(NewNative(function)));
+	int slot = GlobalSlot(AS_STRING(HandleValue(nameHandle)));
+	vm.globalValues.values[slot] = HandleValue(nativeHandle);
+	ReleaseHandles(nameHandle);
 }
 
 void InitVM()
 {
-	ResetStack();
 	vm.bytesAllocated = 0;
 	vm.nextGC = 1024 * 1024;
 	vm.greyCount = 0;
 	vm.greyCapacity = 0;
 	vm.greyStack = NULL;
+	vm.nurseryBytes = 0;
+	vm.rememberedCount = 0;
+	vm.rememberedCapacity = 0;
+	vm.remembered = NULL;
+#ifdef GC_THREAD_AVAILABLE
+	vm.gcThread = false;
+	vm.gcMarking = false;
+#endif //GC_THREAD_AVAILABLE
+	vm.gcPause = 0;
+	vm.gcCompact = false;
+	vm.compactPending = false;
+	vm.handles = NULL;
+	vm.handleCount = 0;
+	vm.handleCapacity = 0;
+	vm.gcPhase = GC_IDLE;
+	vm.clearCursor = NULL;
+	vm.markEpoch = MARK_EPOCH_STEP;
+	vm.stringCursor = 0;
+	vm.stringCapacity = 0;
+	vm.nurseryCursor = NULL;
+	vm.sweepCursor = NULL;
+	vm.sweepLink = NULL;
+	vm.sliceBytes = 0;
+	vm.liveBytes = 0;
 
 	vm.objects = NULL;
+	vm.nursery = NULL;
+	vm.frames = ALLOCATE(CallFrame, FRAMES_INITIAL);
+	vm.frameCapacity = FRAMES_INITIAL;
+	vm.maxFrames = FRAMES_MAX;
+	vm.stack = ALLOCATE(Value, STACK_INITIAL);
+	vm.stackCapacity = STACK_INITIAL;
+	ResetStack();
+
+	vm.methodEpoch = 0;
+#ifdef JIT_AVAILABLE
+	vm.jitEnabled = false;
+	vm.tracingEnabled = false;
+	for (int idx = 0; idx < HOT_LOOP_SLOTS; idx++)
+	{
+		vm.hotLoops[idx] = HOT_LOOP_THRESHOLD;
+	}
+#endif //JIT_AVAILABLE
 	InitTable(&vm.strings);
 
 	vm.initString = NULL;
 	vm.initString = CopyString("init", 4);
 
-	InitTable(&vm.globals);
+	InitValueArray(&vm.globalValues);
+	InitValueArray(&vm.globalNames);
+	InitTable(&vm.globalSlots);
 
 	DefineNative("clock", NAT_clock);
+	DefineNative("substring", NAT_substring);
 }
 
 void FreeVM()
 {
-	FreeTable(&vm.globals);
+	FreeValueArray(&vm.globalValues);
+	FreeValueArray(&vm.globalNames);
+	FreeTable(&vm.globalSlots);
 	FreeTable(&vm.strings);
 	vm.initString = NULL;
 	FreeObjects();
+	free(vm.handles);
+	vm.handles = NULL;
+	vm.handleCount = 0;
+	vm.handleCapacity = 0;
+	FREE_ARRAY(CallFrame, vm.frames, vm.frameCapacity);
+	FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+}
+
+#ifdef DEBUG_CHECK_STACK
+//Every push has to land inside the slots MaxStackDepth reserved for the running frame
+static void CheckStackRoom(Value* stackTop)
+{
+	if (vm.frameCount == 0)
+	{
+		return;
+	}
+
+	ObjFunction* function = vm.frames[vm.frameCount - 1].closure->function;
+	if (stackTop >= vm.frames[vm.frameCount - 1].slots + function->maxStack)
+	{
+		fprintf_s(stderr, "Pushed past the %d stack slots reserved for %s\n", function->maxStack,
+			function->name != NULL ? function->name->chars : "script");
+		exit(1);
+	}
 }
+#endif //DEBUG_CHECK_STACK
 
 void Push(Value value)
 {
+#ifdef DEBUG_CHECK_STACK
+	CheckStackRoom(vm.stackTop);
+#endif //DEBUG_CHECK_STACK
 	*vm.stackTop = value;
 	vm.stackTop++;
 }
@@ -106,12 +285,35 @@ Value Pop(int n)
 
 Value* Peek(int distance)
 {
-	if (vm.stack == vm.stackTop)
+	return (vm.stackTop - 1 - distance);
+}
+
+//Moving the value stack leaves every pointer into it dangling, so the frames and open upvalues are re-pointed
+static void GrowStack(int needed)
+{
+	int oldCapacity = vm.stackCapacity;
+	while (vm.stackCapacity < needed)
 	{
-		return NULL;
+		vm.stackCapacity *= 2;
 	}
 
-	return (vm.stackTop - 1 - distance);
+	Value* oldStack = vm.stack;
+	vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, vm.stackCapacity);
+	if (vm.stack == oldStack)
+	{
+		return;
+	}
+
+	vm.stackTop = vm.stack + (vm.stackTop - oldStack);
+	for (int idx = 0; idx < vm.frameCount; idx++)
+	{
+		vm.frames[idx].slots = vm.stack + (vm.frames[idx].slots - oldStack);
+	}
+
+	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = (ObjUpvalue*)upvalue->next)
+	{
+		upvalue->location = vm.stack + (upvalue->location - oldStack);
+	}
 }
 
 static bool Call(ObjClosure* closure, uint8_t argCount)
@@ -122,12 +324,34 @@ static bool Call(ObjClosure* closure, uint8_t argCount)
 		return false;
 	}
 
-	if (vm.frameCount == FRAMES_MAX)
+	if (vm.frameCount == vm.maxFrames)
 	{
 		RuntimeError(vm.frames[vm.frameCount - 1].ip, "Stack overflow");
 		return false;
 	}
 
+	//Callers reload their frame after a call, which is what keeps them safe when either stack moves
+	if (vm.frameCount == vm.frameCapacity)
+	{
+		int oldCapacity = vm.frameCapacity;
+		vm.frameCapacity = GROW_CAPACITY(oldCapacity);
+		vm.frames = GROW_ARRAY(CallFrame, vm.frames, oldCapacity, vm.frameCapacity);
+	}
+
+	int stackNeeded = (int)(vm.stackTop - vm.stack) - argCount - 1 + closure->function->maxStack;
+	if (stackNeeded > vm.stackCapacity)
+	{
+		GrowStack(stackNeeded);
+	}
+
+#ifdef JIT_AVAILABLE
+	ObjFunction* function = closure->function;
+	if (vm.jitEnabled && function->jit == NULL && ++function->calls == JIT_CALL_THRESHOLD)
+	{
+		JitCompile(function);
+	}
+#endif //JIT_AVAILABLE
+
 	CallFrame* frame = &vm.frames[vm.frameCount++];
 	frame->closure = closure;
 	frame->ip = closure->function->chunk.code;
@@ -188,20 +412,117 @@ static bool CallValue(Value callee, uint8_t argCount, uint8_t* currentIp, bool*
 	return false;
 }
 
-static bool InvokeFromClass(ObjClass* klass, ObjString* name, int argcount, uint8_t* currentIP)
+//Calls closure from the top frame. A tail call hands it that frame instead, the callee and its arguments slide down
+//over the caller's slots first
+static bool CallClosure(ObjClosure* closure, int argCount, uint8_t* currentIp, bool isTail)
+{
+	CallFrame* frame = &vm.frames[vm.frameCount - 1];
+	frame->ip = currentIp;
+	//A call with the wrong arity reports its error with this frame still on the stack trace
+	if (isTail && argCount == closure->function->arity)
+	{
+		CloseUpvalues(frame->slots);
+		memmove(frame->slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+		vm.stackTop = frame->slots + argCount + 1;
+		vm.frameCount--;
+	}
+
+	return Call(closure, argCount);
+}
+
+//Closures and bound methods reuse the caller's frame. Anything else is called normally and the OP_RETURN after the
+//tail call returns its result
+static bool TailCall(Value callee, uint8_t argCount, uint8_t* currentIp, bool* changesFrame)
+{
+	if (IS_CLOSURE(callee))
+	{
+		*changesFrame = true;
+		return CallClosure(AS_CLOSURE(callee), argCount, currentIp, true);
+	}
+	else if (IS_BOUND_METHOD(callee))
+	{
+		*changesFrame = true;
+		ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+		vm.stackTop[-argCount - 1] = bound->receiver;
+		return CallClosure(bound->method, argCount, currentIp, true);
+	}
+
+	return CallValue(callee, argCount, currentIp, changesFrame);
+}
+
+static inline CacheEntry* CacheLookup(InlineCache* cache, Obj* key)
+{
+	if (cache->epoch != vm.methodEpoch)
+	{
+		SnapshotBarrier((Obj*)vm.frames[vm.frameCount - 1].closure->function);
+		cache->count = 0;
+		cache->epoch = vm.methodEpoch;
+	}
+
+	for (int idx = 0; idx < cache->count; idx++)
+	{
+		if (cache->entries[idx].key == key)
+		{
+			return &cache->entries[idx];
+		}
+	}
+
+	return NULL;
+}
+
+static void CacheInsert(InlineCache* cache, Obj* key, Obj* target, int slot)
+{
+	//Past this many receivers the site is megamorphic, so it just keeps taking the slow path
+	if (key == NULL || cache->count == INLINE_CACHE_ENTRIES)
+	{
+		return;
+	}
+
+	//The cache belongs to the function running in the top frame
+	Obj* function = (Obj*)vm.frames[vm.frameCount - 1].closure->function;
+	SnapshotBarrier(function);
+
+	CacheEntry* entry = &cache->entries[cache->count++];
+	entry->key = key;
+	entry->target = target;
+	entry->slot = slot;
+
+	WriteBarrier(function, OBJ_VAL(key));
+	if (target != NULL)
+	{
+		WriteBarrier(function, OBJ_VAL(target));
+	}
+}
+
+//Resolves a method and remembers it against key, which may be NULL for receivers that can't be cached
+static ObjClosure* FindMethod(ObjClass* klass, ObjString* name, InlineCache* cache, Obj* key)
 {
 	Value method;
 	if (!TableGet(&klass->methods, name, &method))
+	{
+		return NULL;
+	}
+
+	CacheInsert(cache, key, AS_OBJ(method), -1);
+	return AS_CLOSURE(method);
+}
+
+static bool InvokeFromClass(ObjClass* klass, ObjString* name, int argcount, uint8_t* currentIP, InlineCache* cache, Obj* key,
+	bool isTail)
+{
+	ObjClosure* method = FindMethod(klass, name, cache, key);
+	if (method == NULL)
 	{
 		RuntimeError(currentIP, "Undefined property '%s'.", name->chars);
 		return false;
 	}
 
-	vm.frames[vm.frameCount - 1].ip = currentIP;
-	return Call(AS_CLOSURE(method), argcount);
+	return CallClosure(method, argcount, currentIP, isTail);
 }
 
-static bool Invoke(ObjString* name, int argCount, uint8_t* currentIp, bool* changesFrame)
+//A tail invoke hands the method this frame, unless the name turns out to be a field holding something that isn't a
+//closure or bound method
+static bool Invoke(ObjString* name, int argCount, uint8_t* currentIp, bool* changesFrame, InlineCache* cache, bool isTail)
 {
 	Value receiver = *Peek(argCount);
 	if (!IS_INSTANCE(receiver))
@@ -211,32 +532,158 @@ static bool Invoke(ObjString* name, int argCount, uint8_t* currentIp, bool* chan
 	}
 
 	ObjInstance* instance = AS_INSTANCE(receiver);
+	ObjShape* shape = instance->shape;
 	Value value;
-	if (TableGet(&instance->fields, name, &value))
+	if (shape != NULL)
+	{
+		CacheEntry* entry = CacheLookup(cache, (Obj*)shape);
+		if (entry != NULL)
+		{
+			if (entry->slot < 0)
+			{
+				*changesFrame = true;
+				return CallClosure((ObjClosure*)entry->target, argCount, currentIp, isTail);
+			}
+
+			value = instance->slots[entry->slot];
+			vm.stackTop[-argCount - 1] = value;
+			return isTail ? TailCall(value, argCount, currentIp, changesFrame) : CallValue(value, argCount, currentIp, changesFrame);
+		}
+
+		int slot = ShapeSlot(shape, name);
+		if (slot != -1)
+		{
+			CacheInsert(cache, (Obj*)shape, NULL, slot);
+			value = instance->slots[slot];
+			vm.stackTop[-argCount - 1] = value;
+			return isTail ? TailCall(value, argCount, currentIp, changesFrame) : CallValue(value, argCount, currentIp, changesFrame);
+		}
+	}
+	else if (TableGet(&instance->fields, name, &value))
 	{
 		vm.stackTop[-argCount - 1] = value;
-		return CallValue(value, argCount, currentIp, &changesFrame);
+		return isTail ? TailCall(value, argCount, currentIp, changesFrame) : CallValue(value, argCount, currentIp, changesFrame);
 	}
 
 	*changesFrame = true;
-	return InvokeFromClass(instance->klass, name, argCount, currentIp);
+	return InvokeFromClass(instance->klass, name, argCount, currentIp, cache, (Obj*)shape, isTail);
 }
 
-static bool BindMethod(ObjClass* klass, ObjString* name)
+static bool BindMethod(ObjClass* klass, ObjString* name, uint8_t* currentIp, InlineCache* cache, Obj* key)
 {
-	Value method;
-	if (!TableGet(&klass->methods, name, &method))
+	ObjClosure* method = FindMethod(klass, name, cache, key);
+	if (method == NULL)
 	{
-		RuntimeError("Undefined property '%s'.", name->chars);
+		RuntimeError(currentIp, "Undefined property '%s'.", name->chars);
 		return false;
 	}
 
-	ObjBoundMethod* bound = NewBoundMethod(*Peek(0), AS_CLOSURE(method));
-	Pop(0);
+	ObjBoundMethod* bound = NewBoundMethod(*Peek(0), method);
+	Pop(1);
 	Push(OBJ_VAL(bound));
 	return true;
 }
 
+static bool GetProperty(ObjString* name, InlineCache* cache, uint8_t* ip)
+{
+	if (!IS_INSTANCE(*Peek(0)))
+	{
+		RuntimeError(ip, "Only instances have properties.");
+		return false;
+	}
+
+	ObjInstance* instance = AS_INSTANCE(*Peek(0));
+	ObjShape* shape = instance->shape;
+
+	if (shape != NULL)
+	{
+		CacheEntry* entry = CacheLookup(cache, (Obj*)shape);
+		if (entry != NULL && entry->slot >= 0)
+		{
+			*Peek(0) = instance->slots[entry->slot];
+			return true;
+		}
+
+		if (entry != NULL)
+		{
+			ObjBoundMethod* bound = NewBoundMethod(*Peek(0), (ObjClosure*)entry->target);
+			*Peek(0) = OBJ_VAL(bound);
+			return true;
+		}
+
+		int slot = ShapeSlot(shape, name);
+		if (slot != -1)
+		{
+			CacheInsert(cache, (Obj*)shape, NULL, slot);
+			*Peek(0) = instance->slots[slot];
+			return true;
+		}
+	}
+	else
+	{
+		Value value;
+		if (TableGet(&instance->fields, name, &value))
+		{
+			*Peek(0) = value;
+			return true;
+		}
+	}
+
+	return BindMethod(instance->klass, name, ip, cache, (Obj*)shape);
+}
+
+static bool SetProperty(ObjString* name, InlineCache* cache, uint8_t* ip)
+{
+	if (!IS_INSTANCE(*Peek(1)))
+	{
+		RuntimeError(ip, "Only instances have properties.");
+		return false;
+	}
+
+	ObjInstance* instance = AS_INSTANCE(*Peek(1));
+	ObjShape* shape = instance->shape;
+
+	CacheEntry* entry = shape == NULL ? NULL : CacheLookup(cache, (Obj*)shape);
+	if (entry == NULL)
+	{
+		InstanceSetField(instance, name, *Peek(0));
+		if (shape != NULL && instance->shape != NULL)
+		{
+			//Either an existing field was overwritten or the store added one and moved the shape on
+			ObjShape* next = instance->shape == shape ? NULL : instance->shape;
+			CacheInsert(cache, (Obj*)shape, (Obj*)next, ShapeSlot(instance->shape, name));
+		}
+	}
+	else if (entry->target == NULL)
+	{
+		SnapshotBarrier((Obj*)instance);
+		instance->slots[entry->slot] = *Peek(0);
+		WriteBarrier((Obj*)instance, *Peek(0));
+	}
+	else
+	{
+		InstanceAddField(instance, (ObjShape*)entry->target, *Peek(0));
+	}
+
+	Value value = Pop(1);
+	Pop(1); //Instance
+	Push(value);
+	return true;
+}
+
+static bool SuperInvoke(ObjString* name, int argCount, InlineCache* cache, uint8_t* ip, bool isTail)
+{
+	ObjClass* superclass = AS_CLASS(Pop(1));
+
+	CacheEntry* entry = CacheLookup(cache, (Obj*)superclass);
+	if (entry != NULL)
+	{
+		return CallClosure((ObjClosure*)entry->target, argCount, ip, isTail);
+	}
+
+	return InvokeFromClass(superclass, name, argCount, ip, cache, (Obj*)superclass, isTail);
+}
+
 static ObjUpvalue* CaptureUpvalue(Value* local)
 {
 	ObjUpvalue* prevUpvalue = NULL;
@@ -271,17 +718,89 @@ static void CloseUpvalues(Value* last)
 	while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last)
 	{
 		ObjUpvalue* upvalue = vm.openUpvalues;
+		SnapshotBarrier((Obj*)upvalue);
 		upvalue->closed = *upvalue->location;
 		upvalue->location = &upvalue->closed;
+		WriteBarrier((Obj*)upvalue, upvalue->closed);
 		vm.openUpvalues = upvalue->next;
 	}
 }
 
+//Reads the function constant and upvalue operands following OP_CLOSURE, returning the ip after them
+static uint8_t* MakeClosure(CallFrame* frame, uint8_t* ip)
+{
+	ObjFunction* function = AS_FUNCTION(frame->closure->function->chunk.constants.values[*ip++]);
+	ObjClosure* closure = NewClosure(function);
+	Push(OBJ_VAL(closure));
+
+	for (int idx = 0; idx < function->upvalueCount; idx++)
+	{
+		uint8_t isLocal = *ip++;
+		uint8_t index = *ip++;
+
+		ObjUpvalue* upvalue;
+		if (isLocal)
+		{
+			upvalue = CaptureUpvalue(frame->slots + index);
+		}
+		else
+		{
+			upvalue = frame->closure->upvalues[index];
+		}
+
+		//Capturing can collect, so the closure may already be old or queued for the marker
+		SnapshotBarrier((Obj*)closure);
+		closure->upvalues[idx] = upvalue;
+		WriteBarrier((Obj*)closure, OBJ_VAL(upvalue));
+	}
+
+	return ip;
+}
+
+//Leaves the returned value where the caller expects it, false once the script itself has returned
+static bool PopFrame(CallFrame* frame)
+{
+	Value result = Pop(1);
+	CloseUpvalues(frame->slots);
+	vm.frameCount--;
+	if (vm.frameCount == 0)
+	{
+		Pop(1);
+		return false;
+	}
+
+	vm.stackTop = frame->slots;
+	Push(result);
+	return true;
+}
+
+static bool Inherit(uint8_t* ip)
+{
+	Value superclass = *Peek(1);
+	if (!IS_CLASS(superclass))
+	{
+		RuntimeError(ip, "Superclass must be a class.");
+		return false;
+	}
+
+	ObjClass* subclass = AS_CLASS(*Peek(0));
+	SnapshotBarrier((Obj*)subclass);
+	TableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+	RememberObject((Obj*)subclass);
+	vm.methodEpoch++;
+	Pop(1);
+	return true;
+}
+
 static void DefineMethod(ObjString* name)
 {
 	Value method = *Peek(0);
 	ObjClass* klass = AS_CLASS(*Peek(1));
+	SnapshotBarrier((Obj*)klass);
 	TableSet(&klass->methods, name, method);
+	WriteBarrier((Obj*)klass, OBJ_VAL(name));
+	WriteBarrier((Obj*)klass, method);
+	vm.methodEpoch++;
 	Pop(1);
 }
 
@@ -290,364 +809,1038 @@ static bool IsFalsey(Value value)
 	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+static bool IsText(Value value)
+{
+	return IsFlat(value) || IS_ROPE(value);
+}
+
+static int TextLength(Value value)
+{
+	if (IS_ROPE(value))
+	{
+		return AS_ROPE(value)->length;
+	}
+
+	int length;
+	FlatChars(AS_OBJ(value), &length);
+	return length;
+}
+
+//Long results become ropes so building a string piece by piece doesn't copy it every time
 static void Concatenate()
 {
-	ObjString* b = AS_STRING(*Peek(0));
-	ObjString* a = AS_STRING(*Peek(1));
+	Value b = *Peek(0);
+	Value a = *Peek(1);
 
-	int length = a->length + b->length;
-	char* chars = ALLOCATE(char, (rsize_t)length + 1);
-	memcpy_s(chars, (rsize_t)length + 1, a->chars, a->length);
-	memcpy_s(chars + a->length, (rsize_t)length + 1, b->chars, b->length);
-	chars[length] = '\0';
+	int length = TextLength(a) + TextLength(b);
+	Obj* result;
+	if (length < ROPE_MIN)
+	{
+		//Neither side can be a rope, they're never this short
+		int leftLength;
+		int rightLength;
+		ObjString* string = NewString(length);
+		const char* left = FlatChars(AS_OBJ(a), &leftLength);
+		const char* right = FlatChars(AS_OBJ(b), &rightLength);
+		memcpy_s(string->chars, (rsize_t)length + 1, left, leftLength);
+		memcpy_s(string->chars + leftLength, (rsize_t)rightLength + 1, right, rightLength);
+		result = (Obj*)string;
+	}
+	else
+	{
+		result = (Obj*)NewRope(AS_OBJ(a), AS_OBJ(b), length);
+	}
 
-	ObjString* result = TakeString(chars, length);
 	Pop(2);
 	Push(OBJ_VAL(result));
 }
 
-static InterpretResult Run()
+//Ropes are flattened in place on the stack so ValuesEqual can compare the top two values as strings
+static void FlattenOperands()
 {
-	CallFrame* frame = &vm.frames[vm.frameCount - 1];
-	register uint8_t* ip = frame->ip;
+	for (int distance = 0; distance < 2; distance++)
+	{
+		if (IS_ROPE(*Peek(distance)))
+		{
+			ObjString* flat = FlattenRope(AS_ROPE(*Peek(distance)));
+			*Peek(distance) = OBJ_VAL(flat);
+		}
+	}
+}
 
+//Joins the top count values into one new string, each written the way print would. Every piece is measured
+//first so the result is allocated once, only a rope that still has to be flattened allocates before it.
+//The first BUILD_CHUNK pieces are kept from the measuring pass, later ones are described again when they're
+//copied, which can't allocate as their ropes were flattened the first time
+#define BUILD_CHUNK 8
+
+static bool BuildString(int count, uint8_t* ip)
+{
+	ValueText texts[BUILD_CHUNK];
+
+	int64_t length = 0;
+	for (int idx = 0; idx < count; idx++)
+	{
+		ValueText spare;
+		ValueText* text = idx < BUILD_CHUNK ? &texts[idx] : &spare;
+		DescribeValue(*Peek(count - 1 - idx), text);
+		length += (int64_t)strlen(text->prefix) + text->length + (int64_t)strlen(text->suffix);
+	}
+
+	if (length > INT_MAX)
+	{
+		RuntimeError(ip, "String is too long.");
+		return false;
+	}
+
+	ObjString* result = NewString((int)length);
+	char* next = result->chars;
+	for (int idx = 0; idx < count; idx++)
+	{
+		ValueText spare;
+		ValueText* text = idx < BUILD_CHUNK ? &texts[idx] : &spare;
+		if (text == &spare)
+		{
+			DescribeValue(*Peek(count - 1 - idx), text);
+		}
+
+		int prefixLength = (int)strlen(text->prefix);
+		memcpy(next, text->prefix, prefixLength);
+		memcpy(next + prefixLength, text->chars, text->length);
+		next += prefixLength + text->length;
+
+		int suffixLength = (int)strlen(text->suffix);
+		memcpy(next, text->suffix, suffixLength);
+		next += suffixLength;
+	}
+
+	Pop(count);
+	Push(OBJ_VAL(result));
+	return true;
+}
+
+static bool Add(uint8_t* ip)
+{
+	if (IS_INTEGER(*Peek(0)) && IS_INTEGER(*Peek(1)))
+	{
+		int32_t b = AS_INTEGER(Pop(1));
+		int32_t a = AS_INTEGER(Pop(1));
+		Push(IntegerSum(a, b));
+	}
+	else if (IS_NUMBER(*Peek(0)) && IS_NUMBER(*Peek(1)))
+	{
+		double b = AS_NUMBER(Pop(1));
+		double a = AS_NUMBER(Pop(1));
+		Push(NUMBER_VAL(a + b));
+	}
+	else if (IsText(*Peek(0)) && IsText(*Peek(1)))
+	{
+		Concatenate();
+	}
+	else
+	{
+		RuntimeError(ip, "Operands must be two numbers or two strings");
+		return false;
+	}
+
+	return true;
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void TraceInstruction(CallFrame* frame, uint8_t* ip)
+{
+	printf_s("          ");
+	for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
+	{
+		printf_s("[ ");
+		PrintValue(*slot);
+		printf_s(" ]");
+	}
+	printf("\n");
+
+	DisassembleInstruction(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code));
+}
+#endif //DEBUG_TRACE_EXECUTION
+
+static InterpretResult Run()
+{
+	CallFrame* frame = &vm.frames[vm.frameCount - 1];
+	register uint8_t* ip = frame->ip;
+	//Kept in locals so they can live in registers. vm.stackTop is only written back before anything that reads it,
+	//allocates or could move the stack, and read again afterwards
+	register Value* stackTop = vm.stackTop;
+	Value* slots = frame->slots;
+	Value* constants = frame->closure->function->chunk.constants.values;
+
+#ifdef DEBUG_CHECK_STACK
+#define PUSH(value) (CheckStackRoom(stackTop), *stackTop++ = (value))
+#else
+#define PUSH(value) (*stackTop++ = (value))
+#endif //DEBUG_CHECK_STACK
+#define POP() (*--stackTop)
+#define DROP(n) (stackTop -= (n))
+#define PEEK(distance) (stackTop[-1 - (distance)])
+#define SAVE_STACK() (vm.stackTop = stackTop)
+#define LOAD_STACK() (stackTop = vm.stackTop)
 #define READ_BYTE() (*ip++)
 #define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() (AS_STRING(READ_CONSTANT()))
-#define BINARY_OP(valueType, op) \
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define READ_SLOT() (slots[READ_BYTE()])
+#define GLOBAL_NAME(high, low) (AS_CSTRING(vm.globalNames.values[(high << 8) | low]))
+#define NOT_BOOL_VAL(b) BOOL_VAL(!(b))
+#define DOUBLE_OP(valueType, op) \
 	do {\
-		if(!IS_NUMBER(*Peek(0)) || !IS_NUMBER(*Peek(1))) { \
+		if(!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
 			RuntimeError(ip, "Operands must be numbers."); \
 			return INTERPRET_RUNTIME_ERROR; \
 		} \
-		double b = AS_NUMBER(Pop(1)); \
-		double a = AS_NUMBER(Pop(1)); \
-		Push(valueType(a op b)); \
+		double b = AS_NUMBER(POP()); \
+		double a = AS_NUMBER(POP()); \
+		PUSH(valueType(a op b)); \
 	} while(false)
+//Two integers go through integerResult, which only falls back to a double when it has to. The operands are only
+//read inside the integer branch, which compiles away when every number is a double
+#define ARITHMETIC_OP(integerResult, op) \
+	do { \
+		if (IS_INTEGER(PEEK(0)) && IS_INTEGER(PEEK(1))) { \
+			int32_t b = AS_INTEGER(PEEK(0)); \
+			DROP(1); \
+			PEEK(0) = integerResult(AS_INTEGER(PEEK(0)), b); \
+		} else { \
+			DOUBLE_OP(NUMBER_VAL, op); \
+		} \
+	} while (false)
+#define COMPARISON_OP(valueType, op) \
+	do { \
+		if (IS_INTEGER(PEEK(0)) && IS_INTEGER(PEEK(1))) { \
+			int32_t b = AS_INTEGER(PEEK(0)); \
+			DROP(1); \
+			PEEK(0) = valueType(AS_INTEGER(PEEK(0)) op b); \
+		} else { \
+			DOUBLE_OP(valueType, op); \
+		} \
+	} while (false)
+//Slot forms write straight into a frame slot instead of pushing
+#define SLOT_OP(integerResult, op, readB) \
+	do { \
+		uint8_t dst = READ_BYTE(); \
+		Value a = READ_SLOT(); \
+		Value b = readB; \
+		if (IS_INTEGER(a) && IS_INTEGER(b)) { \
+			slots[dst] = integerResult(AS_INTEGER(a), AS_INTEGER(b)); \
+		} else if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+			slots[dst] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+		} else { \
+			RuntimeError(ip, "Operands must be numbers."); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+	} while (false)
+#define SLOT_DIVIDE(readB) \
+	do { \
+		uint8_t dst = READ_BYTE(); \
+		Value a = READ_SLOT(); \
+		Value b = readB; \
+		if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+			RuntimeError(ip, "Operands must be numbers."); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+		slots[dst] = NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b)); \
+	} while (false)
+//Strings still have to concatenate, so anything but two numbers goes through the stack
+#define SLOT_ADD(readB) \
+	do { \
+		uint8_t dst = READ_BYTE(); \
+		Value a = READ_SLOT(); \
+		Value b = readB; \
+		if (IS_INTEGER(a) && IS_INTEGER(b)) { \
+			slots[dst] = IntegerSum(AS_INTEGER(a), AS_INTEGER(b)); \
+		} else if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+			slots[dst] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)); \
+		} else { \
+			PUSH(a); \
+			PUSH(b); \
+			SAVE_STACK(); \
+			if (!Add(ip)) { \
+				return INTERPRET_RUNTIME_ERROR; \
+			} \
+			LOAD_STACK(); \
+			slots[dst] = POP(); \
+		} \
+	} while (false)
+#define SLOT_BRANCH(op, readB) \
+	do { \
+		Value a = READ_SLOT(); \
+		Value b = readB; \
+		uint16_t offset = READ_SHORT(); \
+		bool holds; \
+		if (IS_INTEGER(a) && IS_INTEGER(b)) { \
+			holds = AS_INTEGER(a) op AS_INTEGER(b); \
+		} else if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+			holds = AS_NUMBER(a) op AS_NUMBER(b); \
+		} else { \
+			RuntimeError(ip, "Operands must be numbers."); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+		if (!holds) { \
+			ip += offset; \
+		} \
+	} while (false)
+
+#ifdef COMPUTED_GOTO
+	static void* dispatchTable[] =
+	{
+		[OP_CONSTANT]		= &&TARGET_OP_CONSTANT,
+		[OP_NIL]			= &&TARGET_OP_NIL,
+		[OP_TRUE]			= &&TARGET_OP_TRUE,
+		[OP_FALSE]			= &&TARGET_OP_FALSE,
+		[OP_POP]			= &&TARGET_OP_POP,
+		[OP_POPN]			= &&TARGET_OP_POPN,
+		[OP_GET_LOCAL]		= &&TARGET_OP_GET_LOCAL,
+		[OP_SET_LOCAL]		= &&TARGET_OP_SET_LOCAL,
+		[OP_GET_GLOBAL]		= &&TARGET_OP_GET_GLOBAL,
+		[OP_GET_UPVALUE]	= &&TARGET_OP_GET_UPVALUE,
+		[OP_SET_UPVALUE]	= &&TARGET_OP_SET_UPVALUE,
+		[OP_GET_PROPERTY]	= &&TARGET_OP_GET_PROPERTY,
+		[OP_SET_PROPERTY]	= &&TARGET_OP_SET_PROPERTY,
+		[OP_GET_SUPER]		= &&TARGET_OP_GET_SUPER,
+		[OP_DEFINE_GLOBAL]	= &&TARGET_OP_DEFINE_GLOBAL,
+		[OP_SET_GLOBAL]		= &&TARGET_OP_SET_GLOBAL,
+		[OP_EQUAL]			= &&TARGET_OP_EQUAL,
+		[OP_GREATER]		= &&TARGET_OP_GREATER,
+		[OP_LESS]			= &&TARGET_OP_LESS,
+		[OP_ADD]			= &&TARGET_OP_ADD,
+		[OP_SUBTRACT]		= &&TARGET_OP_SUBTRACT,
+		[OP_MULTIPLY]		= &&TARGET_OP_MULTIPLY,
+		[OP_DIVIDE]			= &&TARGET_OP_DIVIDE,
+		[OP_NOT]			= &&TARGET_OP_NOT,
+		[OP_NEGATE]			= &&TARGET_OP_NEGATE,
+		[OP_PRINT]			= &&TARGET_OP_PRINT,
+		[OP_JUMP]			= &&TARGET_OP_JUMP,
+		[OP_JUMP_IF_FALSE]	= &&TARGET_OP_JUMP_IF_FALSE,
+		[OP_LOOP]			= &&TARGET_OP_LOOP,
+		[OP_CALL]			= &&TARGET_OP_CALL,
+		[OP_TAIL_CALL]		= &&TARGET_OP_TAIL_CALL,
+		[OP_INVOKE]			= &&TARGET_OP_INVOKE,
+		[OP_SUPER_INVOKE]	= &&TARGET_OP_SUPER_INVOKE,
+		[OP_TAIL_INVOKE]	= &&TARGET_OP_TAIL_INVOKE,
+		[OP_TAIL_SUPER_INVOKE]	= &&TARGET_OP_TAIL_SUPER_INVOKE,
+		[OP_CLOSURE]		= &&TARGET_OP_CLOSURE,
+		[OP_CLOSE_UPVAL]	= &&TARGET_OP_CLOSE_UPVAL,
+		[OP_RETURN]			= &&TARGET_OP_RETURN,
+		[OP_CLASS]			= &&TARGET_OP_CLASS,
+		[OP_INHERIT]		= &&TARGET_OP_INHERIT,
+		[OP_METHOD]			= &&TARGET_OP_METHOD,
+		[OP_BUILD_STRING]	= &&TARGET_OP_BUILD_STRING,
+		[OP_GET_LOCAL_0]	= &&TARGET_OP_GET_LOCAL_0,
+		[OP_GET_LOCAL_1]	= &&TARGET_OP_GET_LOCAL_1,
+		[OP_GET_LOCAL_2]	= &&TARGET_OP_GET_LOCAL_2,
+		[OP_GET_LOCAL_3]	= &&TARGET_OP_GET_LOCAL_3,
+		[OP_SET_LOCAL_POP]	= &&TARGET_OP_SET_LOCAL_POP,
+		[OP_ADD_LOCALS]		= &&TARGET_OP_ADD_LOCALS,
+		[OP_ADD_CONSTANT]	= &&TARGET_OP_ADD_CONSTANT,
+		[OP_SUBTRACT_CONSTANT]	= &&TARGET_OP_SUBTRACT_CONSTANT,
+		[OP_LESS_CONSTANT]	= &&TARGET_OP_LESS_CONSTANT,
+		[OP_NOT_EQUAL]		= &&TARGET_OP_NOT_EQUAL,
+		[OP_GREATER_EQUAL]	= &&TARGET_OP_GREATER_EQUAL,
+		[OP_LESS_EQUAL]		= &&TARGET_OP_LESS_EQUAL,
+		[OP_JUMP_IF_FALSE_POP]	= &&TARGET_OP_JUMP_IF_FALSE_POP,
+		[OP_COPY_LOCAL]		= &&TARGET_OP_COPY_LOCAL,
+		[OP_STORE_CONSTANT]	= &&TARGET_OP_STORE_CONSTANT,
+		[OP_ADD_LL]			= &&TARGET_OP_ADD_LL,
+		[OP_ADD_LK]			= &&TARGET_OP_ADD_LK,
+		[OP_SUBTRACT_LL]	= &&TARGET_OP_SUBTRACT_LL,
+		[OP_SUBTRACT_LK]	= &&TARGET_OP_SUBTRACT_LK,
+		[OP_MULTIPLY_LL]	= &&TARGET_OP_MULTIPLY_LL,
+		[OP_MULTIPLY_LK]	= &&TARGET_OP_MULTIPLY_LK,
+		[OP_DIVIDE_LL]		= &&TARGET_OP_DIVIDE_LL,
+		[OP_DIVIDE_LK]		= &&TARGET_OP_DIVIDE_LK,
+		[OP_JUMP_IF_NOT_LESS_LL]	= &&TARGET_OP_JUMP_IF_NOT_LESS_LL,
+		[OP_JUMP_IF_NOT_LESS_LK]	= &&TARGET_OP_JUMP_IF_NOT_LESS_LK,
+		[OP_JUMP_IF_NOT_GREATER_LL]	= &&TARGET_OP_JUMP_IF_NOT_GREATER_LL,
+		[OP_JUMP_IF_NOT_GREATER_LK]	= &&TARGET_OP_JUMP_IF_NOT_GREATER_LK,
+		[OP_ADD_NUMBER]		= &&TARGET_OP_ADD_NUMBER,
+		[OP_ADD_STRING]		= &&TARGET_OP_ADD_STRING,
+		[OP_GET_FIELD]		= &&TARGET_OP_GET_FIELD,
+		[OP_GET_METHOD]		= &&TARGET_OP_GET_METHOD,
+		[OP_TRACE_LOOP]		= &&TARGET_OP_TRACE_LOOP,
+	};
+
+#ifdef JIT_AVAILABLE
+	//Swapped in while a hot loop is being recorded, so every instruction passes through recordInstruction first
+	static void* recordTable[] = { [0 ... UINT8_MAX] = &&recordInstruction };
+#endif //JIT_AVAILABLE
+	void** dispatch = dispatchTable;
+
+//Every handler ends in its own indirect jump, so the branch predictor gets one history per opcode
+#define TARGET(op) TARGET_##op
+#define DISPATCH() \
+	do { \
+		TRACE_INSTRUCTION(); \
+		goto *dispatch[READ_BYTE()]; \
+	} while (false)
+#else
+#define TARGET(op) case op
+#define DISPATCH() continue
+#endif //COMPUTED_GOTO
+
+#ifdef JIT_AVAILABLE
+//Compiled functions call and return straight into each other's code, see CompileCall in jit.c. They hand the top frame
+//back to runCompiled when it isn't compiled, when something fails or when a compaction is waiting for its safepoint
+#define ENTER_FRAME() \
+	do { \
+		LOAD_FRAME(); \
+		if (frame->closure->function->jit != NULL) { goto runCompiled; } \
+	} while (false)
+#else
+#define ENTER_FRAME() LOAD_FRAME()
+#endif //JIT_AVAILABLE
+#define LOAD_FRAME() \
+	do { \
+		frame = &vm.frames[vm.frameCount - 1]; \
+		ip = frame->ip; \
+		slots = frame->slots; \
+		constants = frame->closure->function->chunk.constants.values; \
+		LOAD_STACK(); \
+	} while (false)
+
+//Objects only move at a safepoint, where the interpreter holds nothing but what's in the roots, see Compact. Not while
+//a loop is being recorded either, the recorder keeps the closure it started in
+#ifdef JIT_AVAILABLE
+#define SAFEPOINT() \
+	do { \
+		if (vm.compactPending && dispatch == dispatchTable) { SAVE_STACK(); Compact(); } \
+	} while (false)
+#else
+#define SAFEPOINT() \
+	do { \
+		if (vm.compactPending) { SAVE_STACK(); Compact(); } \
+	} while (false)
+#endif //JIT_AVAILABLE
 
 #ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() (SAVE_STACK(), TraceInstruction(frame, ip))
 	printf_s("\n\n");
+#else
+#define TRACE_INSTRUCTION() ((void)0)
 #endif //DEBUG_TRACE_EXECUTION
 
+#ifdef COMPUTED_GOTO
+#ifdef JIT_AVAILABLE
+	if (frame->closure->function->jit != NULL)
+	{
+		goto runCompiled;
+	}
+#endif //JIT_AVAILABLE
+	DISPATCH();
+#else
 	for (;;)
 	{
-#ifdef DEBUG_TRACE_EXECUTION
-		printf_s("          ");
-		for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
-		{
-			printf_s("[ ");
-			PrintValue(*slot);
-			printf_s(" ]");
-		}
-		printf("\n");
-
-		DisassembleInstruction(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code));
-#endif //DEBUG_TRACE_EXECUTION
-		uint8_t instruction;
-		switch (instruction = READ_BYTE())
+		TRACE_INSTRUCTION();
+		switch (READ_BYTE())
 		{
-		case OP_CONSTANT:
+#endif //COMPUTED_GOTO
+		TARGET(OP_CONSTANT):
 		{
 			Value constant = READ_CONSTANT();
-			Push(constant);
-			break;
+			PUSH(constant);
+			DISPATCH();
 		}
-		case OP_NIL:		Push(NIL_VAL); break;
-		case OP_TRUE:		Push(BOOL_VAL(true)); break;
-		case OP_FALSE:		Push(BOOL_VAL(false)); break;
-		case OP_POP:		Pop(1); break;
-		case OP_POPN:		Pop(READ_BYTE()); break;
-		case OP_GET_LOCAL:
+		TARGET(OP_NIL):		PUSH(NIL_VAL); DISPATCH();
+		TARGET(OP_TRUE):	PUSH(BOOL_VAL(true)); DISPATCH();
+		TARGET(OP_FALSE):	PUSH(BOOL_VAL(false)); DISPATCH();
+		TARGET(OP_POP):		DROP(1); DISPATCH();
+		TARGET(OP_POPN):	DROP(READ_BYTE()); DISPATCH();
+		TARGET(OP_GET_LOCAL):
 		{
 			uint8_t slot = READ_BYTE();
-			Push(frame->slots[slot]);
-			break;
+			PUSH(slots[slot]);
+			DISPATCH();
 		}
-		case OP_SET_LOCAL:
+		TARGET(OP_SET_LOCAL):
 			uint8_t slot = READ_BYTE();
-			frame->slots[slot] = *Peek(0);
-			break;
-		case OP_GET_GLOBAL:
+			slots[slot] = PEEK(0);
+			DISPATCH();
+		TARGET(OP_GET_GLOBAL):
 		{
-			ObjString* name = READ_STRING();
-			Value val;
-			if (!TableGet(&vm.globals, name, &val))
+			Value val = vm.globalValues.values[READ_SHORT()];
+			if (IS_UNDEFINED(val))
 			{
-				RuntimeError(ip, "Undefined global variable '%s'.", name->chars);
+				RuntimeError(ip, "Undefined global variable '%s'.", GLOBAL_NAME(ip[-2], ip[-1]));
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			Push(val);
-			break;
+			PUSH(val);
+			DISPATCH();
 		}
-		case OP_DEFINE_GLOBAL:
+		TARGET(OP_DEFINE_GLOBAL):
 		{
-			ObjString* name = READ_STRING();
-			TableSet(&vm.globals, name, *Peek(0));
-			Pop(1);
-			break;
+			vm.globalValues.values[READ_SHORT()] = PEEK(0);
+			DROP(1);
+			DISPATCH();
 		}
-		case OP_SET_GLOBAL:
+		TARGET(OP_SET_GLOBAL):
 		{
-			ObjString* name = READ_STRING();
-			if (TableSet(&vm.globals, name, *Peek(0)))
+			Value* val = &vm.globalValues.values[READ_SHORT()];
+			if (IS_UNDEFINED(*val))
 			{
-				TableDelete(&vm.globals, name);
-				RuntimeError(ip, "Undefined global variable '%s'.", name->chars);
+				RuntimeError(ip, "Undefined global variable '%s'.", GLOBAL_NAME(ip[-2], ip[-1]));
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			break;
 
+			*val = PEEK(0);
+			DISPATCH();
 		}
-		case OP_GET_UPVALUE:
+		TARGET(OP_GET_UPVALUE):
 		{
 			uint8_t slot = READ_BYTE();
-			Push(*frame->closure->upvalues[slot]->location);
-			break;
+			PUSH(*frame->closure->upvalues[slot]->location);
+			DISPATCH();
 		}
-		case OP_SET_UPVALUE:
+		TARGET(OP_SET_UPVALUE):
 		{
-			uint8_t slot = READ_BYTE();
-			*frame->closure->upvalues[slot]->location = *Peek(0);
-			break;
+			ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+			SnapshotBarrier((Obj*)upvalue);
+			*upvalue->location = PEEK(0);
+			WriteBarrier((Obj*)upvalue, PEEK(0));
+			DISPATCH();
 		}
-		case OP_GET_PROPERTY:
+		TARGET(OP_GET_PROPERTY):
 		{
-			if (!IS_INSTANCE(*Peek(0)))
-			{
-				RuntimeError(ip, "Only instances have properties.");
-				return INTERPRET_RUNTIME_ERROR;
-			}
-
-			ObjInstance* instance = AS_INSTANCE(*Peek(0));
 			ObjString* name = READ_STRING();
-
-			Value value;
-			if (TableGet(&instance->fields, name, &value))
+			InlineCache* cache = READ_CACHE();
+			SAVE_STACK();
+			if (!GetProperty(name, cache, ip))
 			{
-				Pop(1); //Instance
-				Push(value);
-				break;
+				return INTERPRET_RUNTIME_ERROR;
 			}
+			LOAD_STACK();
 
-			if (!BindMethod(instance->klass, name))
+			//A site that has only seen one shape so far gets the single guard form for whichever it found
+			if (cache->count == 1)
 			{
-				return INTERPRET_RUNTIME_ERROR;
+				ip[-4] = cache->entries[0].slot >= 0 ? OP_GET_FIELD : OP_GET_METHOD;
 			}
-
-			break;
+			DISPATCH();
 		}
-		case OP_SET_PROPERTY:
+		TARGET(OP_SET_PROPERTY):
 		{
-			if (!IS_INSTANCE(*Peek(1)))
+			ObjString* name = READ_STRING();
+			InlineCache* cache = READ_CACHE();
+			SAVE_STACK();
+			if (!SetProperty(name, cache, ip))
 			{
-				RuntimeError(ip, "Only instances have properties.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
+			LOAD_STACK();
 
-			ObjInstance* instance = AS_INSTANCE(*Peek(1));
-			TableSet(&instance->fields, READ_STRING(), *Peek(0));
-			Value value = Pop(1);
-			Push(value);
-			break;
+			DISPATCH();
 		}
-		case OP_GET_SUPER:
+		TARGET(OP_GET_SUPER):
 		{
 			ObjString* name = READ_STRING();
-			ObjClass* superclass = AS_CLASS(Pop(1));
+			ObjClass* superclass = AS_CLASS(POP());
 
-			if (!BindMethod(superclass, name))
+			SAVE_STACK();
+			if (!BindMethod(superclass, name, ip, NULL, NULL))
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			break;
+			LOAD_STACK();
+			DISPATCH();
 		}
-		case OP_EQUAL:
+		TARGET(OP_EQUAL):
 		{
-			Value a = Pop(1);
-			Value b = Pop(1);
-			Push(BOOL_VAL(ValuesEqual(a, b)));
-			break;
+			if (IS_ROPE(PEEK(0)) || IS_ROPE(PEEK(1)))
+			{
+				SAVE_STACK();
+				FlattenOperands();
+				LOAD_STACK();
+			}
+
+			Value a = POP();
+			Value b = POP();
+			PUSH(BOOL_VAL(ValuesEqual(a, b)));
+			DISPATCH();
 		}
-		case OP_GREATER:	BINARY_OP(BOOL_VAL, >); break;
-		case OP_LESS:		BINARY_OP(BOOL_VAL, <); break;
-		case OP_ADD:
-		{
-			if (IS_STRING(*Peek(0)) && IS_STRING(*Peek(1)))
+		TARGET(OP_GREATER):	COMPARISON_OP(BOOL_VAL, >); DISPATCH();
+		TARGET(OP_LESS):	COMPARISON_OP(BOOL_VAL, <); DISPATCH();
+		TARGET(OP_ADD):
+			if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
 			{
-				Concatenate();
+				ip[-1] = OP_ADD_NUMBER;
 			}
-			else if (IS_NUMBER(*Peek(0)) && IS_NUMBER(*Peek(1)))
+			else if (IsText(PEEK(0)) && IsText(PEEK(1)))
 			{
-				double b = AS_NUMBER(Pop(1));
-				double a = AS_NUMBER(Pop(1));
-				Push(NUMBER_VAL(a + b));
+				ip[-1] = OP_ADD_STRING;
 			}
-			else
+
+			SAVE_STACK();
+			if (!Add(ip))
 			{
-				RuntimeError(ip, "Operands must be two numbers or two strings");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-
-			break;
-		}
-		case OP_SUBTRACT:	BINARY_OP(NUMBER_VAL, -); break;
-		case OP_MULTIPLY:	BINARY_OP(NUMBER_VAL, *); break;
-		case OP_DIVIDE:		BINARY_OP(NUMBER_VAL, /); break;
-		case OP_NOT:		Push(BOOL_VAL(IsFalsey(Pop(1)))); break;
-		case OP_NEGATE:
-
-			if (!IS_NUMBER(*Peek(0)))
+			LOAD_STACK();
+			DISPATCH();
+		TARGET(OP_SUBTRACT):	ARITHMETIC_OP(IntegerDifference, -); DISPATCH();
+		TARGET(OP_MULTIPLY):	ARITHMETIC_OP(IntegerProduct, *); DISPATCH();
+		TARGET(OP_DIVIDE):	DOUBLE_OP(NUMBER_VAL, /); DISPATCH();
+		TARGET(OP_NOT):		PEEK(0) = BOOL_VAL(IsFalsey(PEEK(0))); DISPATCH();
+		TARGET(OP_NEGATE):
+
+			if (!IS_NUMBER(PEEK(0)))
 			{
 				RuntimeError(ip, "Operand must be a number");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			*Peek(0) = NUMBER_VAL(-AS_NUMBER(*Peek(0)));
-			break;
-		case OP_PRINT:
-			PrintValue(Pop(1));
+			//Zero has to become -0, and the most negative integer has no integer negation
+			Value operand = PEEK(0);
+			if (IS_INTEGER(operand) && AS_INTEGER(operand) != 0 && AS_INTEGER(operand) != INT32_MIN)
+			{
+				PEEK(0) = INTEGER_VAL(-AS_INTEGER(operand));
+			}
+			else
+			{
+				PEEK(0) = NUMBER_VAL(-AS_NUMBER(operand));
+			}
+			DISPATCH();
+		TARGET(OP_PRINT):
+			PrintValue(POP());
 			printf_s("\n");
-			break;
-		case OP_JUMP:
+			DISPATCH();
+		TARGET(OP_JUMP):
 		{
 			uint16_t offset = READ_SHORT();
 			ip += offset;
-			break;
+			DISPATCH();
 		}
-		case OP_JUMP_IF_FALSE:
+		TARGET(OP_JUMP_IF_FALSE):
 		{
 			uint16_t offset = READ_SHORT();
-			if (IsFalsey(*Peek(0)))
+			if (IsFalsey(PEEK(0)))
 			{
 				ip += offset;
 			}
 
-			break;
+			DISPATCH();
 		}
-		case OP_LOOP:
+		TARGET(OP_LOOP):
 		{
 			uint16_t offset = READ_SHORT();
 			ip -= offset;
-			break;
+#ifdef JIT_AVAILABLE
+			if (vm.tracingEnabled && --vm.hotLoops[HOT_LOOP_SLOT(ip)] == 0 && dispatch == dispatchTable)
+			{
+				vm.hotLoops[HOT_LOOP_SLOT(ip)] = HOT_LOOP_THRESHOLD;
+				SAVE_STACK();
+				if (StartRecording(frame, ip))
+				{
+					dispatch = recordTable;
+				}
+			}
+#endif //JIT_AVAILABLE
+			SAFEPOINT();
+			DISPATCH();
+		}
+		TARGET(OP_TRACE_LOOP):
+		{
+			uint16_t offset = READ_SHORT();
+			ip -= offset;
+#ifdef JIT_AVAILABLE
+			frame->ip = ip;
+			SAVE_STACK();
+			RunTrace(frame);
+			LOAD_STACK();
+			ip = frame->ip;
+#endif //JIT_AVAILABLE
+			DISPATCH();
 		}
-		case OP_CALL:
+		TARGET(OP_CALL):
 		{
 			uint8_t argCount = READ_BYTE();
 
 			bool changesFrame = false;
-			if (!CallValue(*Peek(argCount), argCount, ip, &changesFrame))
+			SAVE_STACK();
+			if (!CallValue(PEEK(argCount), argCount, ip, &changesFrame))
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			frame = &vm.frames[vm.frameCount - 1];
 			if (changesFrame)
 			{
-				ip = frame->ip;
+				ENTER_FRAME();
 			}
-			break;
+			else
+			{
+				LOAD_STACK();
+			}
+			DISPATCH();
 		}
-		case OP_INVOKE:
+		TARGET(OP_TAIL_CALL):
 		{
+			uint8_t argCount = READ_BYTE();
+
+			bool changesFrame = false;
+			SAVE_STACK();
+			if (!TailCall(PEEK(argCount), argCount, ip, &changesFrame))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+
+			if (changesFrame)
+			{
+				ENTER_FRAME();
+			}
+			else
+			{
+				LOAD_STACK();
+			}
+			DISPATCH();
+		}
+		TARGET(OP_INVOKE):
+		TARGET(OP_TAIL_INVOKE):
+		{
+			bool isTail = ip[-1] == OP_TAIL_INVOKE;
 			ObjString* method = READ_STRING();
 			int argCount = READ_BYTE();
+			InlineCache* cache = READ_CACHE();
 			bool changesFrame = false;
-			if (!Invoke(method, argCount, ip, &changesFrame))
+			SAVE_STACK();
+			if (!Invoke(method, argCount, ip, &changesFrame, cache, isTail))
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
 			if (changesFrame)
 			{
-				frame = &vm.frames[vm.frameCount - 1];
-				ip = frame->ip;
+				ENTER_FRAME();
 			}
-			break;
+			else
+			{
+				LOAD_STACK();
+			}
+			DISPATCH();
 		}
-		case OP_SUPER_INVOKE:
+		TARGET(OP_SUPER_INVOKE):
+		TARGET(OP_TAIL_SUPER_INVOKE):
 		{
+			bool isTail = ip[-1] == OP_TAIL_SUPER_INVOKE;
 			ObjString* method = READ_STRING();
 			int argCount = READ_BYTE();
-			ObjClass* superclass = AS_CLASS(Pop(1));
+			InlineCache* cache = READ_CACHE();
+			SAVE_STACK();
+			if (!SuperInvoke(method, argCount, cache, ip, isTail))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+
+			ENTER_FRAME();
+			DISPATCH();
+		}
+		TARGET(OP_CLOSURE):
+			SAVE_STACK();
+			ip = MakeClosure(frame, ip);
+			LOAD_STACK();
+			DISPATCH();
+		TARGET(OP_CLOSE_UPVAL):
+		{
+			CloseUpvalues(stackTop - 1);
+			DROP(1);
+			DISPATCH();
+		}
+		TARGET(OP_RETURN):
+			SAVE_STACK();
+			if (!PopFrame(frame))
+			{
+				return INTERPRET_OK;
+			}
 
-			if (!InvokeFromClass(superclass, method, argCount, ip))
+			ENTER_FRAME();
+			SAFEPOINT();
+			DISPATCH();
+		TARGET(OP_CLASS):
+			SAVE_STACK();
+			PUSH(OBJ_VAL(NewClass(READ_STRING())));
+			DISPATCH();
+		TARGET(OP_INHERIT):
+			SAVE_STACK();
+			if (!Inherit(ip))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			LOAD_STACK();
+			DISPATCH();
+		TARGET(OP_METHOD):
+			SAVE_STACK();
+			DefineMethod(READ_STRING());
+			LOAD_STACK();
+			DISPATCH();
+		TARGET(OP_BUILD_STRING):
+		{
+			uint8_t count = READ_BYTE();
+			SAVE_STACK();
+			if (!BuildString(count, ip))
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
+			LOAD_STACK();
+			DISPATCH();
+		}
+		TARGET(OP_GET_LOCAL_0):	PUSH(slots[0]); DISPATCH();
+		TARGET(OP_GET_LOCAL_1):	PUSH(slots[1]); DISPATCH();
+		TARGET(OP_GET_LOCAL_2):	PUSH(slots[2]); DISPATCH();
+		TARGET(OP_GET_LOCAL_3):	PUSH(slots[3]); DISPATCH();
+		TARGET(OP_SET_LOCAL_POP):
+		{
+			uint8_t slot = READ_BYTE();
+			slots[slot] = POP();
+			DISPATCH();
+		}
+		TARGET(OP_ADD_LOCALS):
+		{
+			Value a = slots[READ_BYTE()];
+			Value b = slots[READ_BYTE()];
+			if (IS_INTEGER(a) && IS_INTEGER(b))
+			{
+				PUSH(IntegerSum(AS_INTEGER(a), AS_INTEGER(b)));
+				DISPATCH();
+			}
+			else if (IS_NUMBER(a) && IS_NUMBER(b))
+			{
+				PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+				DISPATCH();
+			}
 
-			frame = &vm.frames[vm.frameCount - 1];
-			ip = frame->ip;
-			break;
+			PUSH(a);
+			PUSH(b);
+			SAVE_STACK();
+			if (!Add(ip))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			LOAD_STACK();
+			DISPATCH();
 		}
-		case OP_CLOSURE:
+		TARGET(OP_ADD_CONSTANT):
+			PUSH(READ_CONSTANT());
+			SAVE_STACK();
+			if (!Add(ip))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			LOAD_STACK();
+			DISPATCH();
+		TARGET(OP_SUBTRACT_CONSTANT):
+			PUSH(READ_CONSTANT());
+			ARITHMETIC_OP(IntegerDifference, -);
+			DISPATCH();
+		TARGET(OP_LESS_CONSTANT):
+			PUSH(READ_CONSTANT());
+			COMPARISON_OP(BOOL_VAL, <);
+			DISPATCH();
+		TARGET(OP_NOT_EQUAL):
 		{
-			ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-			ObjClosure* closure = NewClosure(function);
-			Push(OBJ_VAL(closure));
+			if (IS_ROPE(PEEK(0)) || IS_ROPE(PEEK(1)))
+			{
+				SAVE_STACK();
+				FlattenOperands();
+				LOAD_STACK();
+			}
 
-			for (int idx = 0; idx < function->upvalueCount; idx++)
+			Value a = POP();
+			Value b = POP();
+			PUSH(BOOL_VAL(!ValuesEqual(a, b)));
+			DISPATCH();
+		}
+		//Keep the !(a < b) semantics of the unfused pair so NaN comparisons don't change
+		TARGET(OP_GREATER_EQUAL):	COMPARISON_OP(NOT_BOOL_VAL, <); DISPATCH();
+		TARGET(OP_LESS_EQUAL):		COMPARISON_OP(NOT_BOOL_VAL, >); DISPATCH();
+		TARGET(OP_JUMP_IF_FALSE_POP):
+		{
+			uint16_t offset = READ_SHORT();
+			if (IsFalsey(POP()))
 			{
-				uint8_t isLocal = READ_BYTE();
-				uint8_t index = READ_BYTE();
+				ip += offset;
+			}
 
-				if (isLocal)
-				{
-					closure->upvalues[idx] = CaptureUpvalue(frame->slots + index);
-				}
-				else
-				{
-					closure->upvalues[idx] = frame->closure->upvalues[idx];
-				}
+			DISPATCH();
+		}
+		TARGET(OP_COPY_LOCAL):
+		{
+			uint8_t dst = READ_BYTE();
+			slots[dst] = READ_SLOT();
+			DISPATCH();
+		}
+		TARGET(OP_STORE_CONSTANT):
+		{
+			uint8_t dst = READ_BYTE();
+			slots[dst] = READ_CONSTANT();
+			DISPATCH();
+		}
+		TARGET(OP_ADD_LL):				SLOT_ADD(READ_SLOT()); DISPATCH();
+		TARGET(OP_ADD_LK):				SLOT_ADD(READ_CONSTANT()); DISPATCH();
+		TARGET(OP_SUBTRACT_LL):			SLOT_OP(IntegerDifference, -, READ_SLOT()); DISPATCH();
+		TARGET(OP_SUBTRACT_LK):			SLOT_OP(IntegerDifference, -, READ_CONSTANT()); DISPATCH();
+		TARGET(OP_MULTIPLY_LL):			SLOT_OP(IntegerProduct, *, READ_SLOT()); DISPATCH();
+		TARGET(OP_MULTIPLY_LK):			SLOT_OP(IntegerProduct, *, READ_CONSTANT()); DISPATCH();
+		TARGET(OP_DIVIDE_LL):			SLOT_DIVIDE(READ_SLOT()); DISPATCH();
+		TARGET(OP_DIVIDE_LK):			SLOT_DIVIDE(READ_CONSTANT()); DISPATCH();
+		TARGET(OP_JUMP_IF_NOT_LESS_LL):		SLOT_BRANCH(<, READ_SLOT()); DISPATCH();
+		TARGET(OP_JUMP_IF_NOT_LESS_LK):		SLOT_BRANCH(<, READ_CONSTANT()); DISPATCH();
+		TARGET(OP_JUMP_IF_NOT_GREATER_LL):	SLOT_BRANCH(>, READ_SLOT()); DISPATCH();
+		TARGET(OP_JUMP_IF_NOT_GREATER_LK):	SLOT_BRANCH(>, READ_CONSTANT()); DISPATCH();
+		TARGET(OP_ADD_NUMBER):
+		{
+			Value b = PEEK(0);
+			Value a = PEEK(1);
+			if (IS_INTEGER(a) && IS_INTEGER(b))
+			{
+				DROP(1);
+				PEEK(0) = IntegerSum(AS_INTEGER(a), AS_INTEGER(b));
+				DISPATCH();
+			}
+			else if (IS_NUMBER(a) && IS_NUMBER(b))
+			{
+				DROP(1);
+				PEEK(0) = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+				DISPATCH();
 			}
 
-			break;
+			ip[-1] = OP_ADD;
+			SAVE_STACK();
+			if (!Add(ip))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			LOAD_STACK();
+			DISPATCH();
 		}
-		case OP_CLOSE_UPVAL:
+		TARGET(OP_ADD_STRING):
+			if (IsText(PEEK(0)) && IsText(PEEK(1)))
+			{
+				SAVE_STACK();
+				Concatenate();
+				LOAD_STACK();
+				DISPATCH();
+			}
+
+			ip[-1] = OP_ADD;
+			SAVE_STACK();
+			if (!Add(ip))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			LOAD_STACK();
+			DISPATCH();
+		TARGET(OP_GET_FIELD):
 		{
-			CloseUpvalues(vm.stackTop - 1);
-			break;
+			ObjString* name = READ_STRING();
+			InlineCache* cache = READ_CACHE();
+			CacheEntry* entry = &cache->entries[0];
+			Value receiver = PEEK(0);
+			if (IS_INSTANCE(receiver) && (Obj*)AS_INSTANCE(receiver)->shape == entry->key && cache->count == 1 && entry->slot >= 0)
+			{
+				PEEK(0) = AS_INSTANCE(receiver)->slots[entry->slot];
+				DISPATCH();
+			}
+
+			ip[-4] = OP_GET_PROPERTY;
+			SAVE_STACK();
+			if (!GetProperty(name, cache, ip))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			LOAD_STACK();
+			DISPATCH();
 		}
-		case OP_RETURN:
-			Value result = Pop(1);
-			CloseUpvalues(frame->slots);
-			vm.frameCount--;
-			if (vm.frameCount == 0)
+		TARGET(OP_GET_METHOD):
+		{
+			ObjString* name = READ_STRING();
+			InlineCache* cache = READ_CACHE();
+			CacheEntry* entry = &cache->entries[0];
+			Value receiver = PEEK(0);
+			if (IS_INSTANCE(receiver) && (Obj*)AS_INSTANCE(receiver)->shape == entry->key && cache->count == 1 && entry->slot < 0 &&
+				cache->epoch == vm.methodEpoch)
 			{
-				Pop(1);
-				return INTERPRET_OK;
+				SAVE_STACK();
+				PEEK(0) = OBJ_VAL(NewBoundMethod(receiver, (ObjClosure*)entry->target));
+				DISPATCH();
 			}
 
-			vm.stackTop = frame->slots;
-			Push(result);
-			frame = &vm.frames[vm.frameCount - 1];
-			ip = frame->ip;
-			break;
-		case OP_CLASS:
-			Push(OBJ_VAL(NewClass(READ_STRING())));
-			break;
-		case OP_INHERIT:
-			Value superclass = *Peek(1);
-			if (!IS_CLASS(superclass))
+			ip[-4] = OP_GET_PROPERTY;
+			SAVE_STACK();
+			if (!GetProperty(name, cache, ip))
 			{
-				RuntimeError(ip, "Superclass must be a class.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			ObjClass* subclass = AS_CLASS(*Peek(0));
-			TableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-			Pop(1);
-			break;
-		case OP_METHOD:
-			DefineMethod(READ_STRING());
+			LOAD_STACK();
+			DISPATCH();
+		}
+#ifndef COMPUTED_GOTO
 		}
 	}
+#endif //COMPUTED_GOTO
+
+#ifdef JIT_AVAILABLE
+recordInstruction:
+	ip--;
+	if (!RecordInstruction(frame, ip))
+	{
+		dispatch = dispatchTable;
+	}
+	goto *dispatchTable[READ_BYTE()];
+
+runCompiled:
+	for (;;)
+	{
+		JitStatus status = JitRun(frame);
+		if (status == JIT_ERROR)
+		{
+			return INTERPRET_RUNTIME_ERROR;
+		}
 
+		if (status == JIT_FINISHED)
+		{
+			return INTERPRET_OK;
+		}
+
+		LOAD_FRAME();
+		SAFEPOINT();
+		if (frame->closure->function->jit == NULL)
+		{
+			DISPATCH();
+		}
+	}
+#endif //JIT_AVAILABLE
+
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
+#undef SAVE_STACK
+#undef LOAD_STACK
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
-#undef BINARY_OP
+#undef DOUBLE_OP
+#undef ARITHMETIC_OP
+#undef COMPARISON_OP
+#undef NOT_BOOL_VAL
+#undef READ_SLOT
+#undef GLOBAL_NAME
+#undef SLOT_OP
+#undef SLOT_ADD
+#undef SLOT_BRANCH
 #undef READ_STRING
+#undef READ_CACHE
+#undef TARGET
+#undef DISPATCH
+#undef ENTER_FRAME
+#undef LOAD_FRAME
+#undef SAFEPOINT
+#undef TRACE_INSTRUCTION
 }
 
 InterpretResult Interpret(const char* source)
@@ -665,4 +1858,170 @@ InterpretResult Interpret(const char* source)
 	Call(closure, 0);
 
 	return Run();
-}
\ No newline at end of file
+}
+
+#ifdef JIT_AVAILABLE
+JitStatus JitAdd(uint8_t* ip)
+{
+	return Add(ip) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+JitStatus JitOperandsError(uint8_t* ip)
+{
+	RuntimeError(ip, "Operands must be numbers.");
+	return JIT_ERROR;
+}
+
+JitStatus JitOperandError(uint8_t* ip)
+{
+	RuntimeError(ip, "Operand must be a number");
+	return JIT_ERROR;
+}
+
+JitStatus JitUndefinedGlobal(int slot, uint8_t* ip)
+{
+	RuntimeError(ip, "Undefined global variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+	return JIT_ERROR;
+}
+
+JitStatus JitEqual(bool negate)
+{
+	FlattenOperands();
+	Value a = Pop(1);
+	Value b = Pop(1);
+	Push(BOOL_VAL(ValuesEqual(a, b) != negate));
+	return JIT_CONTINUE;
+}
+
+JitStatus JitPrint()
+{
+	PrintValue(Pop(1));
+	printf_s("\n");
+	return JIT_CONTINUE;
+}
+
+JitStatus JitBuildString(int count, uint8_t* ip)
+{
+	return BuildString(count, ip) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+JitStatus JitCall(int argCount, uint8_t* ip)
+{
+	bool changesFrame = false;
+	if (!CallValue(*Peek(argCount), argCount, ip, &changesFrame))
+	{
+		return JIT_ERROR;
+	}
+
+	return changesFrame ? JIT_FRAME_CHANGED : JIT_CONTINUE;
+}
+
+JitStatus JitTailCall(int argCount, uint8_t* ip)
+{
+	bool changesFrame = false;
+	if (!TailCall(*Peek(argCount), argCount, ip, &changesFrame))
+	{
+		return JIT_ERROR;
+	}
+
+	return changesFrame ? JIT_FRAME_CHANGED : JIT_CONTINUE;
+}
+
+JitStatus JitInvoke(ObjString* name, int argCount, InlineCache* cache, uint8_t* ip)
+{
+	bool changesFrame = false;
+	if (!Invoke(name, argCount, ip, &changesFrame, cache, false))
+	{
+		return JIT_ERROR;
+	}
+
+	return changesFrame ? JIT_FRAME_CHANGED : JIT_CONTINUE;
+}
+
+JitStatus JitSuperInvoke(ObjString* name, int argCount, InlineCache* cache, uint8_t* ip)
+{
+	return SuperInvoke(name, argCount, cache, ip, false) ? JIT_FRAME_CHANGED : JIT_ERROR;
+}
+
+JitStatus JitTailInvoke(ObjString* name, int argCount, InlineCache* cache, uint8_t* ip)
+{
+	bool changesFrame = false;
+	if (!Invoke(name, argCount, ip, &changesFrame, cache, true))
+	{
+		return JIT_ERROR;
+	}
+
+	return changesFrame ? JIT_FRAME_CHANGED : JIT_CONTINUE;
+}
+
+JitStatus JitTailSuperInvoke(ObjString* name, int argCount, InlineCache* cache, uint8_t* ip)
+{
+	return SuperInvoke(name, argCount, cache, ip, true) ? JIT_FRAME_CHANGED : JIT_ERROR;
+}
+
+JitStatus JitGetProperty(ObjString* name, InlineCache* cache, uint8_t* ip)
+{
+	return GetProperty(name, cache, ip) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+JitStatus JitSetProperty(ObjString* name, InlineCache* cache, uint8_t* ip)
+{
+	return SetProperty(name, cache, ip) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+JitStatus JitGetSuper(ObjString* name, uint8_t* ip)
+{
+	ObjClass* superclass = AS_CLASS(Pop(1));
+	return BindMethod(superclass, name, ip, NULL, NULL) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+JitStatus JitClosure(CallFrame* frame, uint8_t* ip)
+{
+	MakeClosure(frame, ip);
+	return JIT_CONTINUE;
+}
+
+JitStatus JitCloseUpvalue()
+{
+	CloseUpvalues(vm.stackTop - 1);
+	Pop(1);
+	return JIT_CONTINUE;
+}
+
+JitStatus JitUpvalueBarrier(CallFrame* frame, int slot)
+{
+	ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+	WriteBarrier((Obj*)upvalue, *upvalue->location);
+	return JIT_CONTINUE;
+}
+
+#ifdef GC_THREAD_AVAILABLE
+JitStatus JitUpvalueSnapshot(CallFrame* frame, int slot)
+{
+	SnapshotBarrier((Obj*)frame->closure->upvalues[slot]);
+	return JIT_CONTINUE;
+}
+#endif //GC_THREAD_AVAILABLE
+
+JitStatus JitReturn(CallFrame* frame)
+{
+	return PopFrame(frame) ? JIT_FRAME_CHANGED : JIT_FINISHED;
+}
+
+JitStatus JitClass(ObjString* name)
+{
+	Push(OBJ_VAL(NewClass(name)));
+	return JIT_CONTINUE;
+}
+
+JitStatus JitInherit(uint8_t* ip)
+{
+	return Inherit(ip) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+JitStatus JitMethod(ObjString* name)
+{
+	DefineMethod(name);
+	return JIT_CONTINUE;
+}
+#endif //JIT_AVAILABLE
@@ -4,8 +4,18 @@
 #include "value.h"
 #include "table.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+//Both stacks start small and double when a call needs more room. Each call reserves the deepest its function's
+//stack gets (ObjFunction.maxStack), which can be past UINT8_COUNT once temporaries sit on top of the locals.
+//FRAMES_MAX is the default for vm.maxFrames
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL (2 * UINT8_COUNT)
+#define FRAMES_MAX 16384
+
+//Loop back edges are counted in a small table hashed on the loop header. Sharing a counter only makes a loop hot sooner
+#define HOT_LOOP_SLOTS 64
+#define HOT_LOOP_THRESHOLD 56
+#define HOT_LOOP_BACKOFF 4096 //Back edges to wait before retrying a loop that couldn't be traced
+#define HOT_LOOP_SLOT(ip) (((uintptr_t)(ip) >> 2) & (HOT_LOOP_SLOTS - 1))
 
 typedef struct
 {
@@ -14,23 +24,71 @@ typedef struct
 	Value* slots;
 } CallFrame;
 
+//Where an incremental collection is up to, GC_IDLE between cycles
+typedef enum
+{
+	GC_IDLE,
+	GC_CLEAR,
+	GC_MARK,
+	GC_STRINGS, //Dropping unmarked strings from vm.strings
+	GC_NURSERY, //Freeing or promoting what was young when marking ended
+	GC_SWEEP,
+	GC_RELEASE //Handing empty pages back, see ReleaseEmptyPages
+} GCPhase;
+
 typedef struct
 {
-	CallFrame frames[FRAMES_MAX];
+	CallFrame* frames;
 	int frameCount;
-	Value stack[STACK_MAX];
+	int frameCapacity;
+	int maxFrames; //Calls past this many frames fail with a stack overflow
+	Value* stack;
 	Value* stackTop;
+	int stackCapacity;
 	Table strings;
 	ObjString* initString;
 	ObjUpvalue* openUpvalues;
-	Table globals;
-	Obj* objects;
+	ValueArray globalValues;
+	ValueArray globalNames; //Slot -> name, for error messages
+	Table globalSlots; //Name -> slot, so the compiler and REPL resolve each name once
+	Obj* objects; //The old generation's large objects, the small ones are found by walking their pages
+	Obj* nursery; //Everything allocated since the last collection
+	uint32_t methodEpoch; //Bumped whenever a class's methods change, invalidating inline caches
+#ifdef JIT_AVAILABLE
+	bool jitEnabled;
+	bool tracingEnabled;
+	uint16_t hotLoops[HOT_LOOP_SLOTS];
+#endif //JIT_AVAILABLE
 
 	size_t bytesAllocated;
 	size_t nextGC;
+	size_t nurseryBytes;
 	int greyCount;
 	int greyCapacity;
 	Obj** greyStack;
+	int rememberedCount;
+	int rememberedCapacity;
+	Obj** remembered;
+#ifdef GC_THREAD_AVAILABLE
+	bool gcThread; //Mark and sweep the old generation on background threads
+	bool gcMarking; //The marker thread has a cycle, so changes to objects go through SnapshotBarrier
+#endif //GC_THREAD_AVAILABLE
+	int gcPause; //Microseconds of work per incremental slice, 0 collects in a single pause
+	bool gcCompact; //Move objects off sparse pages after each full collection, see Compact
+	bool compactPending; //Objects are waiting to be moved at the next safepoint, see Compact
+	Value* handles; //Roots for natives, see NewHandle
+	int handleCount;
+	int handleCapacity;
+	GCPhase gcPhase;
+	struct Page* clearCursor; //The next page whose marks need clearing
+	uint32_t markEpoch; //What a marked large object's header holds, less its state, see LargeHeader
+	int stringCursor; //The next vm.strings entry to look at
+	int stringCapacity; //What vm.strings held when the cursor started, it starts again if the table has grown
+	Obj* nurseryCursor; //The rest of the nursery as it was when marking ended
+	struct Page* sweepCursor; //The next page the sweep walks, see SweepPage
+	Obj** sweepLink;
+	size_t sliceBytes;
+	size_t liveBytes; //What the old generation held when marking ended, less what the sweep has freed since
 } VM;
 
 typedef enum
@@ -47,6 +105,14 @@ void FreeVM();
 void Push(Value value);
 Value Pop(int n);
 Value* Peek();
+int GlobalSlot(ObjString* name);
+
+//A native that keeps an object across an allocation holds it in a handle rather than a C local. Handles are roots, and
+//a compaction updates them when it moves an object, so HandleValue gives the object wherever it is now. Objects only
+//move at the interpreter's safepoints, so what HandleValue returns stays good until the native returns
+int NewHandle(Value value);
+Value HandleValue(int handle);
+void ReleaseHandles(int handle); //Drops the handle and every one made after it
 
 InterpretResult Interpret(const char* source);
 #endif